@@ -0,0 +1,31 @@
+LOCAL_PATH:= $(call my-dir)
+
+include $(CLEAR_VARS)
+
+# mm_daemon_bench.c includes mm_daemon_config.c itself
+LOCAL_SRC_FILES := \
+	mm_daemon_bench.c		\
+	../mm_daemon_actuator.c	\
+	../mm_daemon_csi.c		\
+	../mm_daemon_led.c		\
+	../mm_daemon_sensor.c	\
+	../mm_daemon_sock.c		\
+	../mm_daemon_util.c
+
+LOCAL_SHARED_LIBRARIES := \
+	libutils	\
+	libcutils	\
+	libdl
+
+LOCAL_C_INCLUDES += \
+	hardware/qcom/camera/QCamera2/stack/common
+
+LOCAL_C_INCLUDES += $(TARGET_OUT_INTERMEDIATES)/KERNEL_OBJ/usr/include
+
+LOCAL_MODULE := mm_daemon_bench
+
+LOCAL_MODULE_TAGS := optional
+
+LOCAL_CFLAGS = -Wall -Werror
+
+include $(BUILD_EXECUTABLE)
@@ -0,0 +1,401 @@
+/*
+   Copyright (C) 2014-2018 Brian Stepp
+      steppnasty@gmail.com
+
+   This program is free software; you can redistribute it and/or
+   modify it under the terms of the GNU General Public License as
+   published by the Free Software Foundation; either version 2 of the
+   License, or (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful, but
+   WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program; if not, write to the Free Software
+   Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA
+   02111-1307, USA.
+
+   The GNU General Public License is contained in the file COPYING.
+*/
+
+/* Runs the daemon's 3A engines against synthetic stats and reports how
+   they converge and what they cost per frame. The config source is
+   built into this program so its static functions can be driven
+   directly; subdev commands go to pipes that the benchmark drains. */
+
+#include <math.h>
+#include "../mm_daemon_config.c"
+
+#define BENCH_STATS_LEN 4096
+
+struct bench_ctx {
+    mm_daemon_cfg_t cfg;
+    mm_daemon_thread_info act_info;
+    mm_daemon_stats_buf_info stat;
+    struct mm_sensor_data sdata;
+    struct mm_daemon_act_params act_params;
+    struct msm_actuator_set_info_t act_info_set;
+    uint32_t buf[BENCH_STATS_LEN / sizeof(uint32_t)];
+    uint32_t seed;
+};
+
+static uint32_t bench_rand(struct bench_ctx *ctx)
+{
+    ctx->seed = ctx->seed * 1103515245 + 12345;
+    return (ctx->seed >> 16) & 0x7FFF;
+}
+
+/* Uniform noise of +/- pct percent of val */
+static double bench_noise(struct bench_ctx *ctx, double val, double pct)
+{
+    return val * pct / 100 * ((double)bench_rand(ctx) / 0x3FFF - 1);
+}
+
+static int bench_init(struct bench_ctx *ctx, uint8_t stats_type)
+{
+    memset(ctx, 0, sizeof(*ctx));
+    if (pipe(ctx->act_info.pfds) < 0)
+        return -1;
+    fcntl(ctx->act_info.pfds[0], F_SETFL, O_NONBLOCK);
+    ctx->act_info.state = STATE_POLL;
+    ctx->seed = 1;
+    ctx->stat.buf_data[0].vaddr = ctx->buf;
+    ctx->stat.buf_data[0].len = BENCH_STATS_LEN;
+    ctx->stat.buf_cnt = 1;
+    ctx->act_params.act_info = &ctx->act_info_set;
+    ctx->sdata.act_params = &ctx->act_params;
+    ctx->cfg.sdata = &ctx->sdata;
+    ctx->cfg.stats_buf[stats_type] = &ctx->stat;
+    return 0;
+}
+
+static void bench_deinit(struct bench_ctx *ctx)
+{
+    close(ctx->act_info.pfds[0]);
+    close(ctx->act_info.pfds[1]);
+}
+
+/* Focus-curve model: a 3x3 window grid whose sharpness follows a
+   gaussian around the in-focus step over a flat floor, with 2% noise.
+   The sharpness sits in bits [23:8] over a random status/count byte. */
+#define BENCH_AF_STEPS 36
+#define BENCH_AF_SIGMA 4.0
+#define BENCH_AF_LAG 1
+#define BENCH_AF_MAX_FRAMES 200
+
+static void bench_af_stats(struct bench_ctx *ctx, int pos, int peak)
+{
+    double d = pos - peak;
+    double v;
+    int i;
+
+    memset(ctx->buf, 0, sizeof(ctx->buf));
+    for (i = 0; i < 9; i++) {
+        v = 2000 + (i == 4 ? 60000 : 30000) *
+                exp(-d * d / (2 * BENCH_AF_SIGMA * BENCH_AF_SIGMA));
+        v += bench_noise(ctx, v, 2);
+        ctx->buf[i] = ((uint32_t)v & 0xFFFF) << 8 | (bench_rand(ctx) & 0xFF);
+    }
+}
+
+static void bench_af(void)
+{
+    struct bench_ctx ctx;
+    struct mm_daemon_af_info *af = &ctx.cfg.af;
+    mm_daemon_pipe_evt_t cmd;
+    uint32_t frames_sum = 0, moves_sum = 0, err_sum = 0, runs = 0;
+    uint32_t frames_max = 0, moves_max = 0, err_max = 0, fails = 0;
+    uint64_t t, us_total = 0, us_max = 0, calls = 0;
+    int peak, frame, land, target, err;
+
+    for (peak = 0; peak <= BENCH_AF_STEPS; peak++) {
+        if (bench_init(&ctx, MSM_ISP_STATS_AF) < 0)
+            return;
+        ctx.act_info_set.af_tuning_params.total_steps = BENCH_AF_STEPS;
+        ctx.cfg.info[ACT_DEV] = &ctx.act_info;
+        ctx.seed = peak + 1;
+        mm_daemon_config_auto_focus_start(&ctx.cfg);
+        land = -1;
+        target = 0;
+        for (frame = 0; frame < BENCH_AF_MAX_FRAMES; frame++) {
+            if (land == frame)
+                af->curr_step_pos = target;
+            bench_af_stats(&ctx, af->curr_step_pos, peak);
+            t = mm_daemon_util_time_us();
+            mm_daemon_config_af_process(&ctx.cfg, 0);
+            t = mm_daemon_util_time_us() - t;
+            us_total += t;
+            if (t > us_max)
+                us_max = t;
+            calls++;
+            while (read(ctx.act_info.pfds[0], &cmd, sizeof(cmd)) ==
+                    sizeof(cmd)) {
+                if (cmd.cmd == ACT_CMD_MOVE_FOCUS) {
+                    target = af->curr_step_pos + (int32_t)cmd.val;
+                    land = frame + BENCH_AF_LAG;
+                }
+            }
+            if (af->meta.state == CAM_AF_FOCUSED ||
+                    af->meta.state == CAM_AF_NOT_FOCUSED)
+                break;
+        }
+        if (af->meta.state != CAM_AF_FOCUSED)
+            fails++;
+        err = abs((int)af->curr_step_pos - peak);
+        frames_sum += af->frames;
+        moves_sum += af->moves;
+        err_sum += err;
+        if (af->frames > frames_max)
+            frames_max = af->frames;
+        if (af->moves > moves_max)
+            moves_max = af->moves;
+        if ((uint32_t)err > err_max)
+            err_max = err;
+        runs++;
+        bench_deinit(&ctx);
+    }
+    printf("af: %u peaks over %u steps, frames avg %.1f max %u, moves avg "
+            "%.1f max %u, step error avg %.2f max %u, %u not focused, "
+            "avg %.1f us max %llu us per frame\n", runs, BENCH_AF_STEPS,
+            (double)frames_sum / runs, frames_max, (double)moves_sum / runs,
+            moves_max, (double)err_sum / runs, err_max, fails,
+            (double)us_total / calls, (unsigned long long)us_max);
+}
+
+/* AWB model: 256 region records of Y, Cb and Cr sums and a pixel count
+   for a scene of mostly gray surfaces, a fifth of them tinted, under an
+   illuminant with the given R/G and B/G ratios. The per-frame budget is
+   checked against the 99.9th percentile: the host maximum over 10000
+   calls is a preemption of the bench, not the estimate. */
+#define BENCH_AWB_FRAMES 40
+#define BENCH_AWB_CALLS 10000
+
+static int bench_u32_cmp(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void bench_awb_stats(struct bench_ctx *ctx, double rg, double bg)
+{
+    int32_t *rec = (int32_t *)ctx->buf;
+    double refl, r, g, b, y, n;
+    int i;
+
+    for (i = 0; i < MM_DAEMON_AWB_REGIONS; i++, rec += 4) {
+        refl = 20 + bench_rand(ctx) % 120;
+        r = refl * rg;
+        g = refl;
+        b = refl * bg;
+        if (bench_rand(ctx) % 5 == 0) {
+            r *= 0.6 + (bench_rand(ctx) % 80) / 100.0;
+            b *= 0.6 + (bench_rand(ctx) % 80) / 100.0;
+        }
+        r = r > 255 ? 255 : r;
+        b = b > 255 ? 255 : b;
+        y = 0.299 * r + 0.587 * g + 0.114 * b;
+        n = 500 + bench_rand(ctx) % 2500;
+        rec[0] = (int32_t)(y * n);
+        rec[1] = (int32_t)((b - y) / 1.772 * n);
+        rec[2] = (int32_t)((r - y) / 1.402 * n);
+        rec[3] = (int32_t)n;
+    }
+}
+
+static void bench_awb(void)
+{
+    static const struct {
+        const char *name;
+        double rg;
+        double bg;
+    } light[] = {
+        { "incandescent", 1.80, 0.45 },
+        { "fluorescent", 1.25, 0.70 },
+        { "daylight", 1.00, 1.00 },
+        { "shade", 0.85, 1.25 },
+    };
+    struct bench_ctx ctx;
+    struct mm_daemon_wb_info *wb = &ctx.cfg.wb;
+    static uint32_t us[BENCH_AWB_CALLS];
+    uint64_t t, us_total = 0;
+    size_t l;
+    int i;
+
+    for (l = 0; l < ARRAY_SIZE(light); l++) {
+        if (bench_init(&ctx, MSM_ISP_STATS_AWB) < 0)
+            return;
+        for (i = 0; i < BENCH_AWB_FRAMES; i++) {
+            bench_awb_stats(&ctx, light[l].rg, light[l].bg);
+            mm_daemon_config_awb_estimate(&ctx.cfg, &ctx.stat.buf_data[0]);
+        }
+        printf("awb: %s r/g %.2f b/g %.2f -> r gain %.3f (%+.1f%%) b gain "
+                "%.3f (%+.1f%%) cct %u\n", light[l].name, light[l].rg,
+                light[l].bg, wb->r_gain,
+                (wb->r_gain * light[l].rg - 1) * 100, wb->b_gain,
+                (wb->b_gain * light[l].bg - 1) * 100, wb->cct);
+        bench_deinit(&ctx);
+    }
+
+    if (bench_init(&ctx, MSM_ISP_STATS_AWB) < 0)
+        return;
+    bench_awb_stats(&ctx, 1.25, 0.70);
+    for (i = 0; i < BENCH_AWB_CALLS; i++) {
+        t = mm_daemon_util_time_us();
+        mm_daemon_config_awb_estimate(&ctx.cfg, &ctx.stat.buf_data[0]);
+        us[i] = (uint32_t)(mm_daemon_util_time_us() - t);
+        us_total += us[i];
+    }
+    qsort(us, BENCH_AWB_CALLS, sizeof(us[0]), bench_u32_cmp);
+    t = us[BENCH_AWB_CALLS - BENCH_AWB_CALLS / 1000];
+    printf("awb: %u regions, avg %.2f us p99.9 %llu us max %u us per "
+            "frame, budget %u us, %s\n", MM_DAEMON_AWB_REGIONS,
+            (double)us_total / BENCH_AWB_CALLS, (unsigned long long)t,
+            us[BENCH_AWB_CALLS - 1], MM_DAEMON_AWB_BUDGET_US,
+            t <= MM_DAEMON_AWB_BUDGET_US ? "met" : "MISSED");
+    bench_deinit(&ctx);
+}
+
+/* Flicker model: s5k4e1gx preview timing at 30 fps over a scene of
+   fixed region luma with 2% noise, lit by mains light whose intensity
+   is modulated by depth pct at twice the mains frequency. Each region
+   row integrates the light over the exposure ending at its readout. */
+#define BENCH_AB_FRAMES 2000
+#define BENCH_AB_LINE 200
+
+static struct mm_sensor_stream_attr bench_ab_attr = {
+    .h = 980,
+    .w = 1304,
+    .blk_l = 12,
+    .blk_p = 1434,
+    .pix_clk = 81482880,
+};
+
+static void bench_ab_stats(struct bench_ctx *ctx, const uint16_t *scene,
+        uint32_t frame, uint16_t line, uint32_t hz, double pct)
+{
+    uint16_t *stats = (uint16_t *)ctx->buf;
+    double lt = (double)(bench_ab_attr.w + bench_ab_attr.blk_p) /
+            bench_ab_attr.pix_clk;
+    double t0 = frame * (bench_ab_attr.h + bench_ab_attr.blk_l) * lt;
+    double exp_t = line * lt;
+    double t, w, k;
+    int r, c;
+
+    for (r = 0; r < MM_DAEMON_AB_ROWS; r++) {
+        t = t0 + (r + 0.5) * bench_ab_attr.h / MM_DAEMON_AB_ROWS * lt;
+        w = 2 * M_PI * hz;
+        k = 1 + (hz ? pct / 100 * (sin(w * t) - sin(w * (t - exp_t))) /
+                (w * exp_t) : 0);
+        for (c = 0; c < MM_DAEMON_AB_ROWS; c++) {
+            t = scene[r * MM_DAEMON_AB_ROWS + c] * k;
+            stats[r * MM_DAEMON_AB_ROWS + c] =
+                    (uint16_t)(t + bench_noise(ctx, t, 2));
+        }
+    }
+}
+
+/* Runs the detector over BENCH_AB_FRAMES frames and reports when it
+   first settled on want_hz and how many frames it spent off it after.
+   From frame step on, AEC holds two flicker periods instead of one, and
+   with pan the scene changes there as well. */
+static void bench_ab_run(struct bench_ctx *ctx, const char *name,
+        uint32_t light_hz, double pct, uint16_t start_hz, uint16_t want_hz,
+        uint32_t step, int pan, uint64_t *us_total, uint64_t *us_max,
+        uint64_t *calls)
+{
+    uint16_t scene[MM_DAEMON_AB_ROWS * MM_DAEMON_AB_ROWS];
+    uint16_t *stats = (uint16_t *)ctx->buf;
+    uint32_t frame, sum, first = 0, changes = 0, off = 0;
+    uint16_t line, hz = start_hz;
+    uint64_t t;
+    int i;
+
+    mm_daemon_config_ab_set(&ctx->cfg, CAM_ANTIBANDING_MODE_AUTO);
+    ctx->cfg.ab.hz = start_hz;
+    for (i = 0; i < MM_DAEMON_AB_ROWS * MM_DAEMON_AB_ROWS; i++)
+        scene[i] = 100 + bench_rand(ctx) % 600;
+
+    for (frame = 0; frame < BENCH_AB_FRAMES; frame++) {
+        /* The exposure AEC would program: one or two flicker periods
+           when quantizing, BENCH_AB_LINE otherwise */
+        if (pan && step && frame == step)
+            for (i = 0; i < MM_DAEMON_AB_ROWS * MM_DAEMON_AB_ROWS; i++)
+                scene[i] = 100 + bench_rand(ctx) % 600;
+        line = mm_daemon_config_ab_period(&ctx->cfg, PREVIEW);
+        if (!line)
+            line = BENCH_AB_LINE;
+        else if (step && frame >= step)
+            line *= 2;
+        bench_ab_stats(ctx, scene, frame, line, light_hz, pct);
+        for (i = 0, sum = 0; i < MM_DAEMON_AB_ROWS * MM_DAEMON_AB_ROWS; i++)
+            sum += stats[i];
+        t = mm_daemon_util_time_us();
+        mm_daemon_config_ab_detect(&ctx->cfg, stats,
+                sum / (MM_DAEMON_AB_ROWS * MM_DAEMON_AB_ROWS), line);
+        t = mm_daemon_util_time_us() - t;
+        *us_total += t;
+        if (t > *us_max)
+            *us_max = t;
+        (*calls)++;
+        if (ctx->cfg.ab.hz != hz) {
+            hz = ctx->cfg.ab.hz;
+            changes++;
+            if (!first && hz == want_hz)
+                first = frame + 1;
+        }
+        if ((first || start_hz == want_hz) && hz != want_hz)
+            off++;
+    }
+    printf("ab: %s: %s after %u frames, %u switches, %u frames off after, "
+            "ends at %u Hz\n", name, hz == want_hz ? "settled" : "FAILED",
+            first, changes, off, hz / 2);
+}
+
+static void bench_ab(void)
+{
+    struct bench_ctx ctx;
+    struct mm_sensor_aec_config aec_cfg = {
+        .gain_min = 32,
+        .gain_max = 512,
+        .line_max = 1960,
+    };
+    uint64_t us_total = 0, us_max = 0, calls = 0;
+
+    if (bench_init(&ctx, MSM_ISP_STATS_AEC) < 0)
+        return;
+    ctx.sdata.attr[PREVIEW] = &bench_ab_attr;
+    ctx.sdata.aec_cfg = &aec_cfg;
+
+    bench_ab_run(&ctx, "50 Hz mains", 100, 20, 120, 100, 0, 0,
+            &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "50 Hz mains, exposure change", 100, 20, 120, 100,
+            300, 0, &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "50 Hz mains, pan and exposure change", 100, 20,
+            120, 100, 300, 1, &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "60 Hz mains", 120, 20, 120, 120, 0, 0,
+            &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "daylight", 0, 0, 120, 120, 0, 0,
+            &us_total, &us_max, &calls);
+    /* Back to 60 Hz only takes an exposure change over a steady scene */
+    bench_ab_run(&ctx, "60 Hz mains after a 50 Hz lock, no exposure change",
+            120, 20, 100, 100, 0, 0, &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "60 Hz mains after a 50 Hz lock, exposure change",
+            120, 20, 100, 120, 300, 0, &us_total, &us_max, &calls);
+    bench_ab_run(&ctx, "60 Hz mains after a 50 Hz lock, pan and exposure "
+            "change", 120, 20, 100, 100, 300, 1, &us_total, &us_max,
+            &calls);
+    printf("ab: avg %.2f us max %llu us per frame\n",
+            (double)us_total / calls, (unsigned long long)us_max);
+    bench_deinit(&ctx);
+}
+
+int main(void)
+{
+    bench_af();
+    bench_awb();
+    bench_ab();
+    return 0;
+}
@@ -53,6 +53,7 @@ struct mm_sensor_stream_attr {
     uint16_t blk_l;
     uint16_t blk_p;
     float vscale;
+    uint32_t pix_clk; /* Hz, 0 if exposure can't be carried over */
 };
 
 struct mm_sensor_aec_target {
@@ -72,6 +73,12 @@ struct mm_sensor_aec_config {
     uint16_t line_mult;
     uint16_t frame_skip;
     uint16_t flash_threshold;
+    uint16_t iso_gain[CAM_ISO_MODE_MAX]; /* gain for each fixed ISO mode */
+    uint16_t exp_latency; /* frames until an exposure write takes effect */
+    /* Convert a gain code to a value linear in sensor gain and back.
+       NULL when the gain codes are linear already. */
+    uint32_t (*gain_lin)(uint16_t code);
+    uint16_t (*gain_code)(uint32_t lin);
 };
 
 struct mm_sensor_awb_config {
@@ -80,10 +87,31 @@ struct mm_sensor_awb_config {
     uint32_t wb[CAM_WB_MODE_MAX];
 };
 
+/* Color calibration at one illuminant. ccm is a row-major 3x3 color
+   correction matrix in Q7, and the gains white balance the illuminant
+   in the demux block's Q7 format. */
+struct mm_sensor_cct_anchor {
+    uint16_t cct;
+    int16_t ccm[9];
+    uint16_t r_gain;
+    uint16_t g_gain;
+    uint16_t b_gain;
+};
+
+/* Anchors are sorted by ascending CCT. Interpolated values are only
+   taken once they move by at least the threshold, in Q7 units. */
+struct mm_sensor_color_cal {
+    const struct mm_sensor_cct_anchor *anchors;
+    uint8_t num_anchors;
+    uint8_t ccm_threshold;
+    uint8_t gain_threshold;
+};
+
 struct mm_sensor_data {
     struct mm_sensor_stream_attr *attr[STREAM_TYPE_MAX];
     struct mm_sensor_aec_config *aec_cfg;
     struct mm_sensor_awb_config *awb_cfg[STREAM_TYPE_MAX];
+    struct mm_sensor_color_cal *color_cal;
     void *csi_params;
     void *act_params;
     cam_capability_t *cap;
@@ -95,6 +123,7 @@ struct mm_sensor_data {
     uint8_t uses_sensor_ctrls;
     uint8_t csi_dev;
     uint8_t act_id;
+    uint8_t settle_frames;
 };
 
 /* For legacy Camera Serial Interface */
@@ -128,9 +157,13 @@ struct mm_daemon_act_snsr_ops {
         int sign_dir, struct damping_params_t *damping_params);
 };
 
+/* damping_tbl is optional: one entry per (current, destination) step
+   pair, indexed curr * (total_steps + 1) + dest. When absent, the daemon
+   builds the table from get_damping_params. */
 struct mm_daemon_act_params {
     struct msm_actuator_set_info_t *act_info;
     struct mm_daemon_act_snsr_ops *act_snsr_ops;
+    struct damping_params_t *damping_tbl;
 };
 
 #define MSM_CAMERA_SUBDEV_CSIC 15
@@ -26,12 +26,11 @@
 #include <sys/types.h>
 #include <cutils/properties.h>
 #include "mm_daemon.h"
+#include "mm_daemon_util.h"
 
 #define MM_CONFIG_NAME MSM_CONFIGURATION_NAME
 #define MM_CAMERA_NAME MSM_CAMERA_NAME
 
-static char subdev_name[32];
-
 static uint32_t msm_events[] = {
     MSM_CAMERA_NEW_SESSION,
     MSM_CAMERA_DEL_SESSION,
@@ -68,10 +67,186 @@ static void mm_daemon_server_config_cmd(mm_daemon_obj_t *mm_obj, uint8_t cmd,
         ALOGI("%s: write error", __FUNCTION__);
 }
 
-static void mm_daemon_server_find_subdev(mm_daemon_sd_obj_t *sd)
+/* Every entity of the camera media devices, read once at startup */
+#define MM_DAEMON_MEDIA_ENT_MAX 64
+
+struct mm_daemon_media_ent {
+    char model[32];
+    char devpath[32];
+    uint32_t group_id;
+    uint32_t type;
+};
+
+struct mm_daemon_media_tbl {
+    struct mm_daemon_media_ent ent[MM_DAEMON_MEDIA_ENT_MAX];
+    uint32_t num_ent;
+    uint32_t num_dev;
+    uint32_t num_ioctl;
+};
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_server_enum_media
+ *
+ * DESCRIPTION: Walk every /dev/mediaN once and record the entities of the
+ *              camera and configuration media devices.
+ *
+ * PARAMETERS :
+ *   @tbl: entity table to fill
+ *==========================================================================*/
+static void mm_daemon_server_enum_media(struct mm_daemon_media_tbl *tbl)
 {
-    unsigned int i;
     struct media_device_info dev_info;
+    struct media_entity_desc entity;
+    struct mm_daemon_media_ent *ent;
+    char media_dev_name[32];
+    int dev_fd, media_dev_num;
+
+    for (media_dev_num = 0; ; media_dev_num++) {
+        snprintf(media_dev_name, sizeof(media_dev_name), "/dev/media%d",
+                media_dev_num);
+        dev_fd = open(media_dev_name, O_RDWR | O_NONBLOCK);
+        if (dev_fd < 0)
+            break;
+        tbl->num_dev++;
+        memset(&dev_info, 0, sizeof(dev_info));
+        tbl->num_ioctl++;
+        if (ioctl(dev_fd, MEDIA_IOC_DEVICE_INFO, &dev_info) < 0) {
+            ALOGE("Error: Media dev info ioctl failed: %s", strerror(errno));
+            close(dev_fd);
+            continue;
+        }
+        if (strncmp(dev_info.model, MM_CAMERA_NAME,
+                sizeof(dev_info.model)) != 0 &&
+                strncmp(dev_info.model, MM_CONFIG_NAME,
+                sizeof(dev_info.model)) != 0) {
+            close(dev_fd);
+            continue;
+        }
+
+        memset(&entity, 0, sizeof(entity));
+        while (tbl->num_ent < MM_DAEMON_MEDIA_ENT_MAX) {
+            entity.id |= MEDIA_ENT_ID_FLAG_NEXT;
+            tbl->num_ioctl++;
+            if (ioctl(dev_fd, MEDIA_IOC_ENUM_ENTITIES, &entity) < 0)
+                break;
+            ent = &tbl->ent[tbl->num_ent++];
+            snprintf(ent->model, sizeof(ent->model), "%s", dev_info.model);
+            snprintf(ent->devpath, sizeof(ent->devpath), "/dev/%s",
+                    entity.name);
+            ent->group_id = entity.group_id;
+            ent->type = entity.type;
+        }
+        close(dev_fd);
+    }
+}
+
+static void mm_daemon_server_load_subdev(mm_daemon_sd_obj_t *sd,
+        struct mm_daemon_media_ent *ent)
+{
+    switch (ent->group_id) {
+    case QCAMERA_VNODE_GROUP_ID:
+        if (strncmp(ent->model, MM_CAMERA_NAME, sizeof(ent->model)) == 0) {
+            if (sd->num_cameras < MSM_MAX_CAMERA_SENSORS) {
+                sd->camera_sd[sd->num_cameras].type = MM_SOCK;
+                snprintf(sd->camera_sd[sd->num_cameras].devpath,
+                        sizeof(ent->devpath), "%s", ent->devpath);
+                mm_daemon_sock_load(&sd->camera_sd[sd->num_cameras]);
+                sd->num_cameras++;
+            }
+        } else if (strncmp(ent->model, MM_CONFIG_NAME,
+                sizeof(ent->model)) == 0) {
+            sd->msm_sd.type = MM_CFG;
+            snprintf(sd->msm_sd.devpath, sizeof(ent->devpath), "%s",
+                    ent->devpath);
+        }
+        break;
+    case MSM_CAMERA_SUBDEV_VFE:
+        sd->vfe_sd.found = 1;
+        sd->vfe_sd.type = MM_VFE;
+        snprintf(sd->vfe_sd.devpath, sizeof(ent->devpath), "%s", ent->devpath);
+        break;
+    case MSM_CAMERA_SUBDEV_SENSOR:
+        if (sd->num_sensors < MSM_MAX_CAMERA_SENSORS) {
+            sd->sensor_sd[sd->num_sensors].found = 1;
+            sd->sensor_sd[sd->num_sensors].type = MM_SNSR;
+            snprintf(sd->sensor_sd[sd->num_sensors].devpath,
+                    sizeof(ent->devpath), "%s", ent->devpath);
+            mm_daemon_snsr_probe(sd, sd->num_sensors);
+            sd->num_sensors++;
+        }
+        break;
+    case MSM_CAMERA_SUBDEV_BUF_MNGR:
+        sd->buf.found = 1;
+        sd->buf.type = MM_BUF;
+        snprintf(sd->buf.devpath, sizeof(ent->devpath), "%s", ent->devpath);
+        break;
+    case MSM_CAMERA_SUBDEV_CSIPHY:
+    case MSM_CAMERA_SUBDEV_CSID:
+    case MSM_CAMERA_SUBDEV_CSIC:
+        if (sd->num_csi < MSM_MAX_CAMERA_SENSORS) {
+            sd->csi[sd->num_csi].found = 1;
+            if (ent->group_id == MSM_CAMERA_SUBDEV_CSIPHY)
+                sd->csi[sd->num_csi].type = MM_CSIPHY;
+            else if (ent->group_id == MSM_CAMERA_SUBDEV_CSID)
+                sd->csi[sd->num_csi].type = MM_CSID;
+            else
+                sd->csi[sd->num_csi].type = MM_CSIC;
+            snprintf(sd->csi[sd->num_csi].devpath,
+                    sizeof(ent->devpath), "%s", ent->devpath);
+            mm_daemon_csi_load(&sd->csi[sd->num_csi]);
+            sd->num_csi++;
+        }
+        break;
+    case MSM_CAMERA_SUBDEV_LED_FLASH:
+        sd->led.found = 1;
+        sd->led.type = MM_LED;
+        snprintf(sd->led.devpath, sizeof(ent->devpath), "%s", ent->devpath);
+        mm_daemon_led_load(&sd->led);
+        break;
+    case MSM_CAMERA_SUBDEV_ACTUATOR: {
+        uint32_t subdev_id;
+        int act_fd = open(ent->devpath, O_RDWR | O_NONBLOCK);
+
+        if (act_fd < 0)
+            break;
+
+        if (ioctl(act_fd, VIDIOC_MSM_SENSOR_GET_SUBDEV_ID,
+                &subdev_id) < 0) {
+            close(act_fd);
+            break;
+        }
+        close(act_fd);
+        if (subdev_id >= MSM_MAX_CAMERA_SENSORS)
+            break;
+        sd->act[subdev_id].found = 1;
+        sd->act[subdev_id].type = MM_ACT;
+        snprintf(sd->act[subdev_id].devpath, sizeof(ent->devpath), "%s",
+                ent->devpath);
+        mm_daemon_act_load(&sd->act[subdev_id]);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_server_find_subdev
+ *
+ * DESCRIPTION: Enumerate the media devices once, then hand the entities the
+ *              daemon drives to their loaders in the order of the subdevs
+ *              table. Sensors are probed on worker threads that are still
+ *              running when this returns.
+ *
+ * PARAMETERS :
+ *   @sd: daemon subdev object
+ *==========================================================================*/
+static void mm_daemon_server_find_subdev(mm_daemon_sd_obj_t *sd)
+{
+    struct mm_daemon_media_tbl *tbl;
+    struct mm_daemon_media_ent *ent;
+    uint64_t t0, t1, t2;
+    unsigned int i, j;
 
     struct daemon_subdevs {
         char *dev_name;
@@ -88,156 +263,30 @@ static void mm_daemon_server_find_subdev(mm_daemon_sd_obj_t *sd)
         {MM_CONFIG_NAME, MSM_CAMERA_SUBDEV_ACTUATOR, MEDIA_ENT_T_V4L2_SUBDEV},
     };
 
-    for (i = 0; i < ARRAY_SIZE(subdevs); i++) {
-        int dev_fd = 0;
-        int media_dev_num = 0;
-        char *dev_name = subdevs[i].dev_name;
-        uint32_t group_id = subdevs[i].group_id;
-        uint32_t sd_type = subdevs[i].sd_type;
-
-        while (1) {
-            char media_dev_name[32];
-            snprintf(media_dev_name, sizeof(media_dev_name), "/dev/media%d",
-                    media_dev_num);
-            dev_fd = open(media_dev_name, O_RDWR | O_NONBLOCK);
-            if (dev_fd < 0)
-                break;
-            media_dev_num++;
-            memset(&dev_info, 0, sizeof(dev_info));
-            if (ioctl(dev_fd, MEDIA_IOC_DEVICE_INFO, &dev_info) < 0) {
-                ALOGE("Error: Media dev info ioctl failed: %s", strerror(errno));
-                break;
-            }
+    tbl = (struct mm_daemon_media_tbl *)calloc(1, sizeof(*tbl));
+    if (tbl == NULL)
+        return;
 
-            if (strncmp(dev_info.model, dev_name, sizeof(dev_info.model)) != 0) {
-                close(dev_fd);
-                dev_fd = 0;
+    t0 = mm_daemon_util_time_us();
+    mm_daemon_server_enum_media(tbl);
+    t1 = mm_daemon_util_time_us();
+    for (i = 0; i < ARRAY_SIZE(subdevs); i++) {
+        for (j = 0; j < tbl->num_ent; j++) {
+            ent = &tbl->ent[j];
+            if (ent->group_id != subdevs[i].group_id ||
+                    ent->type != subdevs[i].sd_type ||
+                    strncmp(ent->model, subdevs[i].dev_name,
+                    sizeof(ent->model)) != 0)
                 continue;
-            }
-
-            int num_entities = 1;
-            while (1) {
-                struct media_entity_desc entity;
-                memset(&entity, 0, sizeof(entity));
-                entity.id = num_entities++;
-                if (ioctl(dev_fd, MEDIA_IOC_ENUM_ENTITIES, &entity) < 0)
-                    break;
-                if (entity.group_id != group_id)
-                    continue;
-                if (entity.type == sd_type && entity.group_id == group_id) {
-                    snprintf(subdev_name, sizeof(subdev_name), "/dev/%s",
-                            entity.name);
-                    switch (group_id) {
-                    case QCAMERA_VNODE_GROUP_ID:
-                        if (strncmp(dev_info.model, MM_CAMERA_NAME,
-                                sizeof(dev_info.model)) == 0) {
-                            if (sd->num_cameras < MSM_MAX_CAMERA_SENSORS) {
-                                sd->camera_sd[sd->num_cameras].type = MM_SOCK;
-                                snprintf(sd->camera_sd[sd->num_cameras].devpath,
-                                        sizeof(subdev_name), "%s", subdev_name);
-                                mm_daemon_sock_load(
-                                        &sd->camera_sd[sd->num_cameras]);
-                                sd->num_cameras++;
-                            }
-                        } else if (strncmp(dev_info.model, MM_CONFIG_NAME,
-                                sizeof(dev_info.model)) == 0) {
-                            sd->msm_sd.type = MM_CFG;
-                            snprintf(sd->msm_sd.devpath,
-                                    sizeof(subdev_name), "%s", subdev_name);
-                        }
-                        break;
-                    case MSM_CAMERA_SUBDEV_VFE:
-                        sd->vfe_sd.found = 1;
-                        sd->vfe_sd.type = MM_VFE;
-                        snprintf(sd->vfe_sd.devpath, sizeof(subdev_name),
-                                "%s", subdev_name);
-                        break;
-                    case MSM_CAMERA_SUBDEV_SENSOR:
-                        if (sd->num_sensors < MSM_MAX_CAMERA_SENSORS) {
-                            sd->sensor_sd[sd->num_sensors].found = 1;
-                            sd->sensor_sd[sd->num_sensors].type = MM_SNSR;
-                            snprintf(sd->sensor_sd[sd->num_sensors].devpath,
-                                    sizeof(subdev_name), "%s", subdev_name);
-                            mm_daemon_snsr_load(
-                                 &sd->sensor_sd[sd->num_sensors],
-                                 &sd->csi[sd->num_sensors],
-                                 &sd->act[sd->num_sensors]);
-                            sd->num_sensors++;
-                        }
-                        break;
-                    case MSM_CAMERA_SUBDEV_BUF_MNGR:
-                        sd->buf.found = 1;
-                        sd->buf.type = MM_BUF;
-                        snprintf(sd->buf.devpath, sizeof(subdev_name),
-                                "%s", subdev_name);
-                        break;
-                    case MSM_CAMERA_SUBDEV_CSIPHY:
-                        if (sd->num_csi < MSM_MAX_CAMERA_SENSORS) {
-                            sd->csi[sd->num_csi].found = 1;
-                            sd->csi[sd->num_csi].type = MM_CSIPHY;
-                            snprintf(sd->csi[sd->num_csi].devpath,
-                                    sizeof(subdev_name), "%s", subdev_name);
-                            mm_daemon_csi_load(&sd->csi[sd->num_csi]);
-                            sd->num_csi++;
-                        }
-                        break;
-                    case MSM_CAMERA_SUBDEV_CSID:
-                        if (sd->num_csi < MSM_MAX_CAMERA_SENSORS) {
-                            sd->csi[sd->num_csi].found = 1;
-                            sd->csi[sd->num_csi].type = MM_CSID;
-                            snprintf(sd->csi[sd->num_csi].devpath,
-                                    sizeof(subdev_name), "%s", subdev_name);
-                            mm_daemon_csi_load(&sd->csi[sd->num_csi]);
-                            sd->num_csi++;
-                        }
-                        break;
-                    case MSM_CAMERA_SUBDEV_CSIC:
-                        if (sd->num_csi < MSM_MAX_CAMERA_SENSORS) {
-                            sd->csi[sd->num_csi].found = 1;
-                            sd->csi[sd->num_csi].type = MM_CSIC;
-                            snprintf(sd->csi[sd->num_csi].devpath,
-                                    sizeof(subdev_name), "%s", subdev_name);
-                            mm_daemon_csi_load(&sd->csi[sd->num_csi]);
-                            sd->num_csi++;
-                        }
-                        break;
-                    case MSM_CAMERA_SUBDEV_LED_FLASH:
-                        sd->led.found = 1;
-                        sd->led.type = MM_LED;
-                        snprintf(sd->led.devpath, sizeof(subdev_name),
-                                "%s", subdev_name);
-                        mm_daemon_led_load(&sd->led);
-                        break;
-                    case MSM_CAMERA_SUBDEV_ACTUATOR: {
-                        uint32_t subdev_id;
-                        int act_fd = open(subdev_name, O_RDWR | O_NONBLOCK);
-
-                        if (act_fd < 0)
-                            break;
-
-                        if (ioctl(act_fd, VIDIOC_MSM_SENSOR_GET_SUBDEV_ID,
-                                &subdev_id) < 0) {
-                            close(act_fd);
-                            break;
-                        }
-                        close(act_fd);
-                        sd->act[subdev_id].found = 1;
-                        sd->act[subdev_id].type = MM_ACT;
-                        snprintf(sd->act[subdev_id].devpath, sizeof(subdev_name),
-                                "%s", subdev_name);
-                        mm_daemon_act_load(&sd->act[subdev_id]);
-                        break;
-                    }
-                    default:
-                        break;
-                    }
-                }
-            }
+            mm_daemon_server_load_subdev(sd, ent);
         }
-        if (dev_fd)
-            close(dev_fd);
-        dev_fd = 0;
     }
+    t2 = mm_daemon_util_time_us();
+    ALOGI("%s: %u media devices, %u entities, %u ioctls: enumerate %lluus, "
+            "load %lluus", __FUNCTION__, tbl->num_dev, tbl->num_ent,
+            tbl->num_ioctl, (unsigned long long)(t1 - t0),
+            (unsigned long long)(t2 - t1));
+    free(tbl);
 }
 
 static void mm_daemon_notify(mm_daemon_sd_obj_t *sd)
@@ -442,6 +491,7 @@ static int mm_daemon_open()
 {
     int rc = 0;
     int n_try = 2;
+    uint8_t i;
     mm_daemon_obj_t *mm_obj;
     mm_daemon_sd_obj_t *sd;
 
@@ -494,6 +544,9 @@ error:
         mm_obj->server_fd = 0;
     }
 server_error:
+    for (i = 0; i < sd->num_sensors; i++)
+        mm_daemon_snsr_wait(sd, i);
+    mm_daemon_config_stats_pool_release(&sd->stats_pool);
     free(sd);
 tdata_error:
     free(mm_obj);
@@ -49,8 +49,16 @@
 
 #include "common.h"
 
+/* Held at four until the stats write sizes are confirmed, as every slot
+   is still a full page; the depth can only shrink below that */
+#define STATS_BUFFER_MIN 2
+#define STATS_BUFFER_DEF 4
 #define STATS_BUFFER_MAX 4
 #define MM_DAEMON_STATS_AEC_LEN 512
+#define MM_DAEMON_STATS_AWB_LEN 4096
+/* windows per side of the AF grid the 0x53C stats config sets up */
+#define MM_DAEMON_AF_GRID 3
+#define MM_DAEMON_STATS_AF_LEN (MM_DAEMON_AF_GRID * MM_DAEMON_AF_GRID * 4)
 
 struct mm_daemon_obj;
 struct mm_daemon_cfg;
@@ -96,6 +104,13 @@ typedef struct {
     pthread_t pid;
     pthread_mutex_t lock;
     pthread_cond_t cond;
+    pthread_cond_t done_cond;
+    uint32_t cmd_seq;
+    uint32_t done_seq;
+    uint32_t active_seq;
+    uint8_t active_wait;
+    int32_t cmd_rc;
+    int32_t done_rc;
     mm_daemon_thread_state state;
     struct mm_daemon_thread_ops *ops;
 } mm_daemon_thread_info;
@@ -113,6 +128,7 @@ enum mm_daemon_thread_type {
 
 typedef struct {
     char devpath[32];
+    char name[32];
     void *handle;
     void *data;
     void *ops;
@@ -120,6 +136,28 @@ typedef struct {
     uint8_t found;
 } mm_daemon_sd_info;
 
+/* Stats buffers for every session are carved from one ION allocation
+   made by the first session and kept for the daemon's lifetime. Each
+   stats type gets room for STATS_BUFFER_MAX slots of its own size; the
+   number queued per session follows the overflows seen in earlier ones.
+   Until the VFE write sizes are confirmed against the hardware no slot is
+   smaller than the page each buffer used to get to itself. */
+#define MM_DAEMON_STATS_BUF_ALIGN 256
+#define MM_DAEMON_STATS_SLOT_MIN 4096
+
+typedef struct {
+    int32_t ion_fd;
+    int fd;
+    struct ion_handle *handle;
+    void *vaddr;
+    uint32_t len;
+    uint32_t base[MSM_ISP_STATS_MAX];
+    uint32_t slot_len[MSM_ISP_STATS_MAX];
+    uint8_t depth[MSM_ISP_STATS_MAX];
+    uint32_t frames[MSM_ISP_STATS_MAX];
+    uint32_t overflows[MSM_ISP_STATS_MAX];
+} mm_daemon_stats_pool_t;
+
 typedef struct {
     uint8_t num_cameras;
     uint8_t num_sensors;
@@ -132,6 +170,10 @@ typedef struct {
     mm_daemon_sd_info vfe_sd;
     mm_daemon_sd_info led;
     mm_daemon_sd_info buf;
+    mm_daemon_stats_pool_t stats_pool;
+    /* sensors are probed by worker threads joined on first use */
+    pthread_t snsr_probe[MSM_MAX_CAMERA_SENSORS];
+    uint8_t snsr_probing[MSM_MAX_CAMERA_SENSORS];
     struct mm_daemon_obj *mm_obj;
 } mm_daemon_sd_obj_t;
 
@@ -141,6 +183,7 @@ typedef struct {
     void *vaddr;
     struct ion_handle *handle;
     uint32_t len;
+    uint32_t offset;
 } mm_daemon_buf_data;
 
 struct mm_daemon_stat_ops {
@@ -188,22 +231,61 @@ typedef struct {
 enum mm_daemon_act_focus_state {
     MM_FOCUS_INIT,
     MM_FOCUS_SCANNING,
+    MM_FOCUS_FINE,
     MM_FOCUS_SCANNING_DONE,
+    MM_FOCUS_MONITOR,
 };
 
+#define MM_DAEMON_AF_MAX_POS 64
+
 struct mm_daemon_af_metadata {
     cam_autofocus_state_t state;
     uint8_t is_focus_valid;
 };
 
+/* Focus values are kept per lens position so the fine search and the
+   final curve fit reuse every sample taken during the sweep. */
 struct mm_daemon_af_info {
     struct mm_daemon_af_metadata meta;
     enum mm_daemon_act_focus_state state;
-    uint16_t focus_stat_val;
-    uint8_t focus_step_pos;
+    uint32_t fv[MM_DAEMON_AF_MAX_POS];
+    uint64_t sampled;
+    uint32_t best_fv;
+    uint8_t best_pos;
+    uint8_t target_pos;
     uint8_t curr_step_pos;
     uint8_t frm_cnt;
-    uint8_t incr_step;
+    uint8_t coarse_step;
+    uint8_t fine_step;
+    uint8_t moves;
+    uint8_t move_fails;
+    uint16_t frames;
+};
+
+#define MM_DAEMON_CAF_HIST 4
+
+/* Processing cost of a per-frame algorithm, see mm_daemon_util_proc_time */
+struct mm_daemon_proc_time {
+    uint32_t runs;
+    uint32_t us_max;
+    uint64_t us_total;
+};
+
+/* Continuous AF keeps the AF stats stream running after the lens has
+   settled and watches sharpness and AEC luma for a reason to rescan. */
+struct mm_daemon_caf_info {
+    uint32_t hist[MM_DAEMON_CAF_HIST];
+    uint32_t ref_fv;
+    uint16_t ref_luma;
+    uint8_t active;
+    uint8_t focused;
+    uint8_t hist_idx;
+    uint8_t skip;
+    uint8_t drops;
+    uint8_t scene_change;
+    uint32_t rescans;
+    uint32_t moves;
+    struct mm_daemon_proc_time proc;
 };
 
 struct mm_daemon_ae_metadata {
@@ -211,16 +293,197 @@ struct mm_daemon_ae_metadata {
     uint8_t is_prep_snapshot_done_valid;
 };
 
+enum mm_daemon_preflash_state {
+    MM_PREFLASH_OFF,
+    MM_PREFLASH_AMBIENT,
+    MM_PREFLASH_METER,
+    MM_PREFLASH_DONE,
+};
+
+/* Pre-flash metering. Ambient luma and CCT are taken before the LED is
+   lit; f_line and f_cct are the main flash exposure and white point,
+   valid once metered is set. */
+struct mm_daemon_preflash_info {
+    enum mm_daemon_preflash_state state;
+    uint16_t amb_luma;
+    uint32_t amb_cct;
+    uint16_t f_line;
+    uint32_t f_cct;
+    uint8_t frames;
+    uint8_t metered;
+};
+
+/* AEC controls taken from the parm table when they change, so the
+   stats path reads plain fields */
+struct mm_daemon_aec_ctrl {
+    uint16_t target[STREAM_TYPE_MAX];
+    uint16_t iso_gain;
+    int32_t led_mode;
+    uint8_t iso_fixed;
+    uint8_t deblur;
+    uint8_t lock;
+};
+
 struct mm_daemon_ae_info {
     struct mm_daemon_ae_metadata meta;
+    struct mm_daemon_aec_ctrl ctrl;
+    struct mm_daemon_preflash_info pf;
     uint16_t c_gain;
     uint16_t c_line;
+    /* preview exposure held while a capture runs on converted values */
+    uint16_t p_gain;
+    uint16_t p_line;
+    /* exposure AEC asked for and what flicker quantization wrote */
+    uint16_t b_gain;
+    uint16_t b_line;
+    uint16_t q_gain;
+    uint16_t q_line;
+    uint16_t luma;
     uint8_t flash_needed;
     uint8_t frm_cnt;
+    uint8_t restore;
+};
+
+/* HDR bracketing. The later brackets are written from the first capture
+   SOF on, each the sensor's exposure latency ahead of the frame it is
+   for; frames still carrying the first bracket are dropped by the VFE. */
+#define MM_DAEMON_HDR_FRAMES 3
+
+struct mm_daemon_hdr_info {
+    uint16_t bracket[MM_DAEMON_HDR_FRAMES];
+    uint16_t gain[MM_DAEMON_HDR_FRAMES];
+    uint32_t pattern;
+    uint32_t first;
+    uint8_t num;
+    uint8_t next;
+    uint8_t late;
+    uint8_t active;
+    uint8_t started;
+};
+
+/* Exposure each frame is captured with, for the metadata. land[] holds
+   exposures written but not yet in effect by the frame they land on;
+   res[] holds what each recent frame was exposed with. */
+#define MM_DAEMON_EXP_HIST 8
+
+struct mm_daemon_exp_rec {
+    uint32_t frame_id;
+    uint16_t gain;
+    uint16_t line;
+    uint8_t valid;
+};
+
+struct mm_daemon_exp_hist {
+    struct mm_daemon_exp_rec land[MM_DAEMON_EXP_HIST];
+    struct mm_daemon_exp_rec res[MM_DAEMON_EXP_HIST];
+    struct mm_daemon_exp_rec cur;
+    uint32_t sof_id;
+    uint8_t in_flight;
+};
+
+/* Software anti-banding. hz is the flicker frequency exposure is
+   quantized to, 0 when off. In auto mode a window of AEC row profiles,
+   each as Q8 deviation from its frame mean, is searched for 100 and
+   120 Hz flicker. */
+#define MM_DAEMON_AB_ROWS 16
+#define MM_DAEMON_AB_FRAMES 8
+
+struct mm_daemon_ab_info {
+    int32_t parm;
+    uint16_t hz;
+    int16_t rows[MM_DAEMON_AB_FRAMES][MM_DAEMON_AB_ROWS];
+    uint16_t line;
+    uint16_t cand_hz;
+    uint8_t head;
+    uint8_t count;
+    uint8_t skip;
+    uint8_t votes;
+    /* window mean at the last line count, for the 60 Hz probe */
+    int16_t ref_mean[MM_DAEMON_AB_ROWS];
+    uint16_t ref_line;
+    struct mm_daemon_proc_time proc;
 };
 
+/* Auto white balance state. Gains are relative to green and smoothed
+   across frames; wb_reg is the last value written to the WB block. */
 struct mm_daemon_wb_info {
     cam_wb_mode_type curr_wb;
+    float r_gain;
+    float b_gain;
+    uint32_t cct;
+    uint32_t wb_reg;
+    uint8_t valid;
+    uint8_t rejects;
+    uint8_t disabled;
+    struct mm_daemon_proc_time proc;
+};
+
+/* 3A results saved per sensor in a memory mapped file so the next
+   session starts from converged values */
+#define MM_DAEMON_3A_STATE_AE  (1 << 0)
+#define MM_DAEMON_3A_STATE_AWB (1 << 1)
+#define MM_DAEMON_3A_STATE_AF  (1 << 2)
+
+struct mm_daemon_3a_state {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t valid;
+    uint16_t gain;
+    uint16_t line;
+    float r_gain;
+    float b_gain;
+    uint32_t cct;
+    uint32_t wb_reg;
+    uint8_t lens_pos;
+};
+
+/* Color matrix and demux gains interpolated at the current CCT. The
+   matrix is the one last written to the VFE, the gains are applied by
+   the next capture. */
+struct mm_daemon_color_info {
+    int16_t ccm[9];
+    uint16_t gain[3];
+    uint32_t cct;
+    uint8_t valid;
+};
+
+enum mm_daemon_vfe_blk {
+    VFE_BLK_MODULE,
+    VFE_BLK_OP_MODE,
+    VFE_BLK_ROLL_OFF,
+    VFE_BLK_ROLL_OFF_TBL,
+    VFE_BLK_FOV,
+    VFE_BLK_MAIN_SCALER,
+    VFE_BLK_S2Y,
+    VFE_BLK_S2CBCR,
+    VFE_BLK_AXI,
+    VFE_BLK_CHROMA_EN,
+    VFE_BLK_COLOR_COR,
+    VFE_BLK_ASF,
+    VFE_BLK_WB,
+    VFE_BLK_BLACK_LEVEL,
+    VFE_BLK_MCE,
+    VFE_BLK_GAMMA,
+    VFE_BLK_GAMMA_BANK,
+    VFE_BLK_CAMIF = VFE_BLK_GAMMA_BANK + 16,
+    VFE_BLK_DEMUX,
+    VFE_BLK_OUT_CLAMP,
+    VFE_BLK_FRAME_SKIP,
+    VFE_BLK_CHROMA_SUBS,
+    VFE_BLK_SK_ENHANCE,
+    VFE_BLK_STATS_AEC,
+    VFE_BLK_STATS_AWB,
+    VFE_BLK_STATS_AF,
+    VFE_BLK_MAX,
+};
+
+/* Last payload written to each VFE block. Blocks whose payload is
+   unchanged are not rewritten, so restarting a stream only touches the
+   blocks that differ from what the hardware already holds. */
+struct mm_daemon_vfe_shadow {
+    void *data[VFE_BLK_MAX];
+    uint32_t len[VFE_BLK_MAX];
+    uint8_t retained;
 };
 
 typedef struct mm_daemon_cfg {
@@ -231,18 +494,30 @@ typedef struct mm_daemon_cfg {
     mm_daemon_parm_buf_info parm_buf;
     mm_daemon_cap_buf_info cap_buf;
     struct mm_daemon_af_info af;
+    struct mm_daemon_caf_info caf;
     struct mm_daemon_ae_info ae;
+    struct mm_daemon_ab_info ab;
+    struct mm_daemon_hdr_info hdr;
+    struct mm_daemon_exp_hist exp_hist;
     struct mm_daemon_wb_info wb;
+    struct mm_daemon_color_info color;
+    struct mm_daemon_vfe_shadow vfe_shadow;
+    struct mm_daemon_3a_state *state;
     struct mm_sensor_data *sdata;
     int32_t vfe_fd;
-    int32_t ion_fd;
+    mm_daemon_stats_pool_t *stats_pool;
     int32_t buf_fd;
+    int32_t state_fd;
     uint32_t current_streams;
     uint16_t enabled_stats;
     uint16_t stat_frames;
     uint8_t num_stats_buf;
     uint8_t session_id;
     uint8_t prep_snapshot;
+    /* flash prepared in the preview that stopped, fired by the capture */
+    uint8_t snap_flash;
+    uint8_t settle_frames;
+    uint8_t warm_start;
     pthread_mutex_t lock;
     pthread_cond_t cond;
 } mm_daemon_cfg_t;
@@ -288,6 +563,7 @@ typedef struct {
     uint8_t wait;
     uint8_t cmd;
     uint32_t val;
+    uint32_t seq;
 } mm_daemon_pipe_evt_t;
 
 void mm_daemon_sock_load(mm_daemon_sd_info *sd);
@@ -296,7 +572,10 @@ void mm_daemon_led_load(mm_daemon_sd_info *sd);
 void mm_daemon_act_load(mm_daemon_sd_info *sd);
 void mm_daemon_snsr_load(mm_daemon_sd_info *sd, mm_daemon_sd_info *camif,
         mm_daemon_sd_info *act);
+void mm_daemon_snsr_probe(mm_daemon_sd_obj_t *sd, uint8_t idx);
+int mm_daemon_snsr_wait(mm_daemon_sd_obj_t *sd, uint8_t idx);
 mm_daemon_thread_info *mm_daemon_config_open(mm_daemon_sd_obj_t *sd,
         uint8_t session_id, int32_t cb_pfd);
 int mm_daemon_config_close(mm_daemon_thread_info *info);
+void mm_daemon_config_stats_pool_release(mm_daemon_stats_pool_t *pool);
 #endif // MM_DAEMON_H
@@ -31,8 +31,6 @@ static int mm_daemon_act_move_focus(mm_daemon_act_t *mm_act, int32_t num_steps)
     int8_t dir;
     int8_t sign_dir;
     int16_t dest_step_pos;
-    uint16_t region_size;
-    uint16_t region_idx;
     uint32_t total_steps;
     struct msm_actuator_cfg_data cdata;
     struct damping_params_t *damping_params;
@@ -51,8 +49,7 @@ static int mm_daemon_act_move_focus(mm_daemon_act_t *mm_act, int32_t num_steps)
         sign_dir = MSM_ACTUATOR_MOVE_SIGNED_NEAR;
     }
 
-    region_size = mm_act->params->act_info->af_tuning_params.region_size;
-    total_steps = mm_act->params->act_info->af_tuning_params.total_steps;
+    total_steps = mm_act->num_pos - 1;
 
     if (num_steps > (int32_t)total_steps)
         num_steps = total_steps;
@@ -68,14 +65,8 @@ static int mm_daemon_act_move_focus(mm_daemon_act_t *mm_act, int32_t num_steps)
     if (dest_step_pos == mm_act->curr_step_pos)
         return 0;
 
-    damping_params = (struct damping_params_t *)calloc(
-            1, sizeof(struct damping_params_t) * region_size);
-    if (!damping_params)
-        return -ENOMEM;
-
-    for (region_idx = 0; region_idx < region_size; region_idx++)
-        mm_act->params->act_snsr_ops->get_damping_params(dest_step_pos,
-                mm_act->curr_step_pos, sign_dir, &damping_params[region_idx]);
+    damping_params = &mm_act->damping[(mm_act->curr_step_pos *
+            mm_act->num_pos + dest_step_pos) * mm_act->region_size];
 
     cdata.cfgtype = CFG_MOVE_FOCUS;
     cdata.cfg.move.dir = dir;
@@ -88,10 +79,58 @@ static int mm_daemon_act_move_focus(mm_daemon_act_t *mm_act, int32_t num_steps)
     if (rc == 0)
         mm_act->curr_step_pos = dest_step_pos;
 
-    free(damping_params);
     return rc;
 }
 
+/*===========================================================================
+ * FUNCTION   : mm_daemon_act_damping_init
+ *
+ * DESCRIPTION: Fill the damping arena for every (current, destination)
+ *              step pair so a move only needs a lookup. Each pair holds
+ *              region_size identical entries as expected by the kernel.
+ *
+ * PARAMETERS :
+ *   @mm_act : actuator object
+ *
+ * RETURN     : 0 on success, -ENOMEM otherwise
+ *==========================================================================*/
+static int mm_daemon_act_damping_init(mm_daemon_act_t *mm_act)
+{
+    struct mm_daemon_act_params *params = mm_act->params;
+    struct damping_params_t *entry, dp;
+    uint16_t curr, dest, region_idx;
+
+    if (mm_act->damping)
+        return 0;
+
+    mm_act->num_pos = params->act_info->af_tuning_params.total_steps + 1;
+    mm_act->region_size = params->act_info->af_tuning_params.region_size;
+    mm_act->damping = (struct damping_params_t *)calloc((size_t)
+            mm_act->num_pos * mm_act->num_pos * mm_act->region_size,
+            sizeof(struct damping_params_t));
+    if (!mm_act->damping)
+        return -ENOMEM;
+
+    for (curr = 0; curr < mm_act->num_pos; curr++) {
+        for (dest = 0; dest < mm_act->num_pos; dest++) {
+            if (curr == dest)
+                continue;
+            if (params->damping_tbl)
+                dp = params->damping_tbl[curr * mm_act->num_pos + dest];
+            else
+                params->act_snsr_ops->get_damping_params(dest, curr,
+                        (dest > curr) ? MSM_ACTUATOR_MOVE_SIGNED_NEAR :
+                        MSM_ACTUATOR_MOVE_SIGNED_FAR, &dp);
+            entry = &mm_act->damping[(curr * mm_act->num_pos + dest) *
+                    mm_act->region_size];
+            for (region_idx = 0; region_idx < mm_act->region_size;
+                    region_idx++)
+                entry[region_idx] = dp;
+        }
+    }
+    return 0;
+}
+
 static int mm_daemon_act_init_focus(mm_daemon_act_t *mm_act)
 {
     struct msm_actuator_cfg_data cdata;
@@ -99,6 +138,9 @@ static int mm_daemon_act_init_focus(mm_daemon_act_t *mm_act)
     if (mm_act->is_focus_ready)
         return 0;
 
+    if (mm_daemon_act_damping_init(mm_act) < 0)
+        return -ENOMEM;
+
     cdata.cfgtype = CFG_SET_ACTUATOR_INFO;
     memcpy(&cdata.cfg.set_info, mm_act->params->act_info,
             sizeof(struct msm_actuator_set_info_t));
@@ -120,6 +162,7 @@ static void mm_daemon_act_shutdown(mm_daemon_thread_info *info)
             close(mm_act->fd);
             mm_act->fd = 0;
         }
+        free(mm_act->damping);
         free(info->obj);
         info->obj = NULL;
     }
@@ -35,6 +35,10 @@ typedef enum {
 typedef struct mm_daemon_act {
     int fd;
     struct mm_daemon_act_params *params;
+    /* region_size copies of the damping params for every step pair */
+    struct damping_params_t *damping;
+    uint16_t num_pos;
+    uint16_t region_size;
     int16_t curr_step_pos;
     uint8_t is_focus_ready;
 } mm_daemon_act_t;
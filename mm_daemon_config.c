@@ -24,6 +24,9 @@
 #define LOG_TAG "mm-daemon-cfg"
 
 #include <sys/types.h>
+#ifdef __ARM_NEON__
+#include <arm_neon.h>
+#endif
 #include "mm_daemon.h"
 #include "mm_daemon_sensor.h"
 #include "mm_daemon_sock.h"
@@ -32,6 +35,11 @@
 #include "mm_daemon_actuator.h"
 #include "mm_daemon_util.h"
 
+#define MM_DAEMON_SNSR_MODE_TIMEOUT_MS 2000
+#define MM_DAEMON_3A_STATE_PATH "/data/misc/camera/mm_daemon_%s.3a"
+#define MM_DAEMON_3A_STATE_MAGIC 0x33415354
+#define MM_DAEMON_3A_STATE_VERSION 1
+
 static uint32_t isp_events[] = {
     ISP_EVENT_REG_UPDATE,
     ISP_EVENT_START_ACK,
@@ -53,6 +61,23 @@ static uint32_t vfe_stats[] = {
     MSM_ISP_STATS_AWB,
 };
 
+/* Bytes the VFE is expected to write per frame for each stats type with
+   the regions the stats blocks are programmed with: a 16x16 grid of AEC
+   luma sums, 16x16 AWB records of four words and one word per 3x3 AF
+   window. These are not confirmed, so slots are padded to
+   MM_DAEMON_STATS_SLOT_MIN. */
+static uint32_t vfe_stats_len[MSM_ISP_STATS_MAX] = {
+    [MSM_ISP_STATS_AEC] = MM_DAEMON_STATS_AEC_LEN,
+    [MSM_ISP_STATS_AF] = MM_DAEMON_STATS_AF_LEN,
+    [MSM_ISP_STATS_AWB] = MM_DAEMON_STATS_AWB_LEN,
+};
+
+/* Queue depth is grown for the next session when more than one stats
+   frame in MM_DAEMON_STATS_OVF_RATE overflowed, and shrunk after
+   MM_DAEMON_STATS_SHRINK_FRAMES frames without an overflow */
+#define MM_DAEMON_STATS_OVF_RATE 1000
+#define MM_DAEMON_STATS_SHRINK_FRAMES 1800
+
 static uint32_t mm_daemon_config_v4l2_fmt(cam_format_t fmt)
 {
     uint32_t val;
@@ -99,6 +124,182 @@ static uint32_t mm_daemon_config_v4l2_fmt(cam_format_t fmt)
     return val;
 }
 
+static void mm_daemon_config_ab_set(mm_daemon_cfg_t *cfg_obj, int32_t mode)
+{
+    memset(&cfg_obj->ab, 0, sizeof(cfg_obj->ab));
+    cfg_obj->ab.parm = mode;
+    switch (mode) {
+    case CAM_ANTIBANDING_MODE_50HZ:
+        cfg_obj->ab.hz = 100;
+        break;
+    case CAM_ANTIBANDING_MODE_60HZ:
+    case CAM_ANTIBANDING_MODE_AUTO:
+        cfg_obj->ab.hz = 120;
+        break;
+    default:
+        break;
+    }
+}
+
+/* Flicker period in lines of the given mode, 0 when not quantizing */
+static uint16_t mm_daemon_config_ab_period(mm_daemon_cfg_t *cfg_obj,
+        enum mm_sensor_stream_type mode)
+{
+    struct mm_sensor_stream_attr *attr = cfg_obj->sdata->attr[mode];
+
+    uint32_t den;
+
+    if (!cfg_obj->ab.hz || !attr || !attr->pix_clk)
+        return 0;
+    den = (attr->w + attr->blk_p) * cfg_obj->ab.hz;
+    return (attr->pix_clk + den / 2) / den;
+}
+
+static uint32_t mm_daemon_config_gain_lin(struct mm_sensor_aec_config *aec_cfg,
+        uint16_t code)
+{
+    return aec_cfg->gain_lin ? aec_cfg->gain_lin(code) : code;
+}
+
+/* Gain code for a linear gain, clamped to the sensor's range */
+static uint16_t mm_daemon_config_gain_code(
+        struct mm_sensor_aec_config *aec_cfg, uint32_t lin)
+{
+    uint16_t code;
+
+    if (lin >= mm_daemon_config_gain_lin(aec_cfg, aec_cfg->gain_max))
+        return aec_cfg->gain_max;
+    code = aec_cfg->gain_code ? aec_cfg->gain_code(lin) : lin;
+    return code < aec_cfg->gain_min ? aec_cfg->gain_min : code;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_ab_quantize
+ *
+ * DESCRIPTION: Hold a line count at a whole number of flicker periods so
+ *              every row integrates the same amount of light, and make up
+ *              the remainder with gain. The period below the line count is
+ *              used unless that needs more than the maximum gain. Without
+ *              a gain to adjust, the nearest period is used. Exposures
+ *              shorter than one period give up gain first: one period at
+ *              a lower gain while that reaches the minimum gain, then the
+ *              minimum gain on a shorter line count.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @mode   : sensor mode the line count is for
+ *   @line   : line count
+ *   @gain   : gain to rescale, or NULL to keep the gain
+ *
+ * RETURN     : quantized line count
+ *==========================================================================*/
+static uint32_t mm_daemon_config_ab_quantize(mm_daemon_cfg_t *cfg_obj,
+        enum mm_sensor_stream_type mode, uint32_t line, uint16_t *gain)
+{
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    uint16_t period = mm_daemon_config_ab_period(cfg_obj, mode);
+    uint32_t lo, hi, g, g_min, exp;
+
+    if (!period || (line < period && !gain))
+        return line;
+    if (line < period) {
+        exp = mm_daemon_config_gain_lin(aec_cfg, *gain) * line;
+        g_min = mm_daemon_config_gain_lin(aec_cfg, aec_cfg->gain_min);
+        if (exp >= g_min * period) {
+            *gain = mm_daemon_config_gain_code(aec_cfg,
+                    (exp + period / 2) / period);
+            return period;
+        }
+        *gain = aec_cfg->gain_min;
+        line = g_min ? exp / g_min : line;
+        return line < aec_cfg->line_min ? aec_cfg->line_min : line;
+    }
+
+    lo = line - line % period;
+    hi = lo + period;
+    if (hi > aec_cfg->line_max)
+        hi = lo;
+    if (!gain)
+        return line - lo < hi - line ? lo : hi;
+
+    exp = mm_daemon_config_gain_lin(aec_cfg, *gain) * line;
+    g = (exp + lo / 2) / lo;
+    if (hi == lo ||
+            g <= mm_daemon_config_gain_lin(aec_cfg, aec_cfg->gain_max)) {
+        *gain = mm_daemon_config_gain_code(aec_cfg, g);
+        return lo;
+    }
+    *gain = mm_daemon_config_gain_code(aec_cfg, (exp + hi / 2) / hi);
+    return hi;
+}
+
+/* Exposure compensation comes in 1/6 EV steps; the target scale for the
+   fractional part is 2^(k/6) in Q8. */
+#define MM_DAEMON_EV_STEPS 6
+#define MM_DAEMON_EV_MAX 12
+
+static const uint16_t mm_daemon_ev_scale[MM_DAEMON_EV_STEPS] = {
+    256, 287, 323, 362, 406, 456,
+};
+
+/* Scale v by 2^(ev/6) */
+static uint32_t mm_daemon_config_ev_scale(uint32_t v, int32_t ev)
+{
+    if (ev >= 0)
+        return ((v * mm_daemon_ev_scale[ev % MM_DAEMON_EV_STEPS]) >> 8) <<
+                (ev / MM_DAEMON_EV_STEPS);
+    return ((v << 8) / mm_daemon_ev_scale[-ev % MM_DAEMON_EV_STEPS]) >>
+            (-ev / MM_DAEMON_EV_STEPS);
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_aec_ctrl
+ *
+ * DESCRIPTION: Refresh the AEC controls after one of them changed in the
+ *              parm table. Exposure compensation scales the luma targets,
+ *              fixed ISO modes pin the sensor gain and deblur favors gain
+ *              over integration time.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *==========================================================================*/
+static void mm_daemon_config_aec_ctrl(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    struct mm_daemon_aec_ctrl *ctrl = &cfg_obj->ae.ctrl;
+    parm_buffer_t *table = cfg_obj->parm_buf.cfg_buf;
+    int32_t ev, iso;
+    uint32_t tgt;
+    int i;
+
+    ctrl->lock = !!*(int32_t *)POINTER_OF(CAM_INTF_PARM_AEC_LOCK, table);
+    ctrl->led_mode = *(int32_t *)POINTER_OF(CAM_INTF_PARM_LED_MODE, table);
+    if (!aec_cfg)
+        return;
+
+    ev = *(int32_t *)POINTER_OF(CAM_INTF_PARM_EXPOSURE_COMPENSATION, table);
+    if (ev > MM_DAEMON_EV_MAX)
+        ev = MM_DAEMON_EV_MAX;
+    else if (ev < -MM_DAEMON_EV_MAX)
+        ev = -MM_DAEMON_EV_MAX;
+    for (i = 0; i < STREAM_TYPE_MAX; i++) {
+        tgt = mm_daemon_config_ev_scale(aec_cfg->target[i].tgt, ev);
+        ctrl->target[i] = tgt > 0xFFFF ? 0xFFFF : tgt;
+    }
+
+    iso = *(int32_t *)POINTER_OF(CAM_INTF_PARM_ISO, table);
+    ctrl->deblur = iso == CAM_ISO_MODE_DEBLUR;
+    ctrl->iso_fixed = iso >= CAM_ISO_MODE_100 && iso < CAM_ISO_MODE_MAX;
+    ctrl->iso_gain = 0;
+    if (ctrl->iso_fixed) {
+        ctrl->iso_gain = aec_cfg->iso_gain[iso];
+        if (ctrl->iso_gain < aec_cfg->gain_min)
+            ctrl->iso_gain = aec_cfg->gain_min;
+        else if (ctrl->iso_gain > aec_cfg->gain_max)
+            ctrl->iso_gain = aec_cfg->gain_max;
+    }
+}
+
 static void mm_daemon_config_parm_flash(mm_daemon_cfg_t *cfg_obj, int32_t mode)
 {
     mm_daemon_thread_info *led = cfg_obj->info[LED_DEV];
@@ -141,21 +342,27 @@ static void mm_daemon_config_parm(mm_daemon_cfg_t *cfg_obj)
                     if (cfg_obj->sdata->uses_sensor_ctrls)
                         mm_daemon_util_subdev_cmd(cfg_obj->info[SNSR_DEV],
                                 SENSOR_CMD_AB, *cvalue, FALSE);
+                    else
+                        mm_daemon_config_ab_set(cfg_obj, *cvalue);
                 }
                 break;
             }
             case CAM_INTF_PARM_EXPOSURE_COMPENSATION: {
                 int32_t *cvalue = (int32_t *)POINTER_OF(current, c_table);
                 int32_t *pvalue = (int32_t *)POINTER_OF(current, p_table);
-                if (*cvalue != *pvalue)
+                if (*cvalue != *pvalue) {
                     memcpy(cvalue, pvalue, sizeof(int32_t));
+                    mm_daemon_config_aec_ctrl(cfg_obj);
+                }
                 break;
             }
             case CAM_INTF_PARM_AEC_LOCK: {
                 int32_t *cvalue = (int32_t *)POINTER_OF(current, c_table);
                 int32_t *pvalue = (int32_t *)POINTER_OF(current, p_table);
-                if (*cvalue != *pvalue)
+                if (*cvalue != *pvalue) {
                     memcpy(cvalue, pvalue, sizeof(int32_t));
+                    mm_daemon_config_aec_ctrl(cfg_obj);
+                }
                 break;
             }
             case CAM_INTF_PARM_FPS_RANGE: {
@@ -217,6 +424,7 @@ static void mm_daemon_config_parm(mm_daemon_cfg_t *cfg_obj)
                 if (*cvalue != *pvalue) {
                     memcpy(cvalue, pvalue, sizeof(int32_t));
                     mm_daemon_config_parm_flash(cfg_obj, *cvalue);
+                    mm_daemon_config_aec_ctrl(cfg_obj);
                 }
                 break;
             }
@@ -267,8 +475,10 @@ static void mm_daemon_config_parm(mm_daemon_cfg_t *cfg_obj)
             case CAM_INTF_PARM_ISO: { /* 20 */
                 int32_t *cvalue = (int32_t *)POINTER_OF(current, c_table);
                 int32_t *pvalue = (int32_t *)POINTER_OF(current, p_table);
-                if (*cvalue != *pvalue)
+                if (*cvalue != *pvalue) {
                     memcpy(cvalue, pvalue, sizeof(int32_t));
+                    mm_daemon_config_aec_ctrl(cfg_obj);
+                }
                 break;
             }
             case CAM_INTF_PARM_ZOOM: { /* 21 */
@@ -538,6 +748,61 @@ static int mm_daemon_config_isp_metadata_buf_done(mm_daemon_cfg_t *cfg_obj,
     return rc;
 }
 
+/* Frames between writing an exposure and the frame it takes effect on */
+static uint8_t mm_daemon_config_exp_lead(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    uint8_t lead = 1;
+
+    if (aec_cfg && aec_cfg->exp_latency)
+        lead = aec_cfg->exp_latency;
+    if (lead >= MM_DAEMON_EXP_HIST)
+        lead = MM_DAEMON_EXP_HIST - 1;
+    return lead;
+}
+
+/* Record an exposure written at this SOF by the frame it lands on */
+static void mm_daemon_config_exp_land(mm_daemon_cfg_t *cfg_obj,
+        uint16_t gain, uint16_t line)
+{
+    struct mm_daemon_exp_hist *hist = &cfg_obj->exp_hist;
+    uint32_t frame_id = hist->sof_id + mm_daemon_config_exp_lead(cfg_obj);
+    struct mm_daemon_exp_rec *land =
+            &hist->land[frame_id % MM_DAEMON_EXP_HIST];
+
+    land->frame_id = frame_id;
+    land->gain = gain;
+    land->line = line;
+    land->valid = 1;
+    hist->in_flight = 1;
+}
+
+/* Frame ids restart with each stream; the exposure programmed before
+   streaming is in effect from the first frame */
+static void mm_daemon_config_exp_reset(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_exp_hist *hist = &cfg_obj->exp_hist;
+
+    memset(hist, 0, sizeof(*hist));
+    hist->cur.gain = cfg_obj->ae.c_gain;
+    hist->cur.line = cfg_obj->ae.c_line;
+    hist->cur.valid = 1;
+}
+
+/* Exposure time a frame was captured with in seconds, 0 if unknown */
+static float mm_daemon_config_exp_time(mm_daemon_cfg_t *cfg_obj,
+        uint32_t frame_id)
+{
+    struct mm_sensor_stream_attr *attr =
+            cfg_obj->sdata->attr[mm_daemon_get_sensor_mode(cfg_obj)];
+    struct mm_daemon_exp_rec *res =
+            &cfg_obj->exp_hist.res[frame_id % MM_DAEMON_EXP_HIST];
+
+    if (res->frame_id != frame_id || !res->valid || !attr || !attr->pix_clk)
+        return 0;
+    return (float)res->line * (attr->w + attr->blk_p) / attr->pix_clk;
+}
+
 static void mm_daemon_config_isp_set_metadata(mm_daemon_cfg_t *cfg_obj,
         struct v4l2_event *isp_event, uint32_t buf_idx)
 {
@@ -545,6 +810,7 @@ static void mm_daemon_config_isp_set_metadata(mm_daemon_cfg_t *cfg_obj,
     cam_metadata_info_t *meta;
     mm_daemon_buf_info *buf = mm_daemon_get_stream_buf(cfg_obj,
             CAM_STREAM_TYPE_METADATA);
+    float exp_time;
 
     if (!buf)
         return;
@@ -567,6 +833,11 @@ static void mm_daemon_config_isp_set_metadata(mm_daemon_cfg_t *cfg_obj,
         meta->focus_data.focus_state = cfg_obj->af.meta.state;
         meta->is_focus_valid = cfg_obj->af.meta.is_focus_valid;
     }
+    exp_time = mm_daemon_config_exp_time(cfg_obj, buf_event->frame_id);
+    if (exp_time > 0) {
+        meta->is_ae_params_valid = 1;
+        meta->ae_params.exp_time = exp_time;
+    }
     memset(&cfg_obj->ae.meta, 0, sizeof(struct mm_daemon_ae_metadata));
     memset(&cfg_obj->af.meta, 0, sizeof(struct mm_daemon_af_metadata));
     meta->meta_valid_params.meta_frame_id = buf_event->frame_id;
@@ -764,6 +1035,64 @@ static int mm_daemon_config_vfe_reg_cmd(mm_daemon_cfg_t *cfg_obj,
     return ioctl(cfg_obj->vfe_fd, VIDIOC_MSM_VFE_REG_CFG, &proc_cmd);
 }
 
+static void mm_daemon_config_vfe_shadow_reset(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_vfe_shadow *shadow = &cfg_obj->vfe_shadow;
+    int i;
+
+    for (i = 0; i < VFE_BLK_MAX; i++) {
+        if (shadow->data[i])
+            free(shadow->data[i]);
+        shadow->data[i] = NULL;
+        shadow->len[i] = 0;
+    }
+    shadow->retained = 0;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_vfe_blk_cmd
+ *
+ * DESCRIPTION: Writes a VFE block configuration unless the hardware already
+ *              holds the same payload for that block.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @blk:     VFE block being written
+ *   @length:  payload length in bytes
+ *   @value:   payload
+ *   @cfg_cmd: register/DMI commands
+ *   @num_cfg: number of entries in cfg_cmd
+ *
+ * RETURN     : 0 if skipped, ioctl result otherwise
+ *==========================================================================*/
+static int mm_daemon_config_vfe_blk_cmd(mm_daemon_cfg_t *cfg_obj,
+        enum mm_daemon_vfe_blk blk, int length, void *value, void *cfg_cmd,
+        int num_cfg)
+{
+    struct mm_daemon_vfe_shadow *shadow = &cfg_obj->vfe_shadow;
+    int rc;
+
+    if (shadow->len[blk] == (uint32_t)length &&
+            !memcmp(shadow->data[blk], value, length))
+        return 0;
+
+    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, length, value, cfg_cmd,
+            num_cfg);
+    if (rc < 0 || shadow->len[blk] != (uint32_t)length) {
+        free(shadow->data[blk]);
+        shadow->data[blk] = NULL;
+        shadow->len[blk] = 0;
+        if (rc < 0)
+            return rc;
+        shadow->data[blk] = malloc(length);
+        if (!shadow->data[blk])
+            return rc;
+    }
+    memcpy(shadow->data[blk], value, length);
+    shadow->len[blk] = length;
+    return rc;
+}
+
 static int mm_daemon_config_vfe_stop(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
@@ -921,17 +1250,18 @@ static int mm_daemon_config_vfe_roll_off(mm_daemon_cfg_t *cfg_obj)
             },
             .cmd_type = VFE_WRITE,
         },
+    };
+    struct msm_vfe_reg_cfg_cmd tbl_cfg_cmd[] = {
         {
             .u.rw_info = {
                 .reg_offset = 0x598,
-                .cmd_data_offset = 16,
                 .len = 8,
             },
             .cmd_type = VFE_WRITE,
         },
         {
             .u.dmi_info = {
-                .lo_tbl_offset = 24,
+                .lo_tbl_offset = 8,
                 .len = 1768,
             },
             .cmd_type = VFE_WRITE_DMI_32BIT,
@@ -940,7 +1270,7 @@ static int mm_daemon_config_vfe_roll_off(mm_daemon_cfg_t *cfg_obj)
             .u.rw_info = {
                 .reg_offset = 0x598,
                 .len = 8,
-                .cmd_data_offset = 1792,
+                .cmd_data_offset = 1776,
             },
             .cmd_type = VFE_WRITE,
         },
@@ -1408,8 +1738,14 @@ static int mm_daemon_config_vfe_roll_off(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x100;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 1800, (void *)rocfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    /* The mesh table is shared by all modes; only the config word
+       changes, so the table upload is skipped once it is in place. */
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_ROLL_OFF, 16,
+            (void *)rocfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    if (rc == 0)
+        rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_ROLL_OFF_TBL,
+                1784, (void *)(rocfg + 4), (void *)&tbl_cfg_cmd,
+                ARRAY_SIZE(tbl_cfg_cmd));
     free(rocfg);
     return rc;
 }
@@ -1475,7 +1811,7 @@ static int mm_daemon_config_vfe_fov(mm_daemon_cfg_t *cfg_obj)
     *p++ = reg_w - 1;
     *p = reg_h - 1;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 8, (void *)fov_cfg,
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_FOV, 8, (void *)fov_cfg,
             (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(fov_cfg);
     return rc;
@@ -1540,8 +1876,8 @@ static int mm_daemon_config_vfe_main_scaler(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x00310000;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 28, (void *)ms_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_MAIN_SCALER, 28,
+            (void *)ms_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(ms_cfg);
     return rc;
 }
@@ -1590,8 +1926,8 @@ static int mm_daemon_config_vfe_s2y(mm_daemon_cfg_t *cfg_obj)
     *p++ = vb->stream_info->dim.height << 16 | rb->stream_info->dim.height;
     *p = 0x00310000;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 20, (void *)s2y_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_S2Y, 20,
+            (void *)s2y_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(s2y_cfg);
     return rc;
 }
@@ -1640,8 +1976,8 @@ static int mm_daemon_config_vfe_s2cbcr(mm_daemon_cfg_t *cfg_obj)
     *p++ = (vb->stream_info->dim.height/2) << 16 | rb->stream_info->dim.height;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 20, (void *)s2cbcr_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_S2CBCR, 20,
+            (void *)s2cbcr_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(s2cbcr_cfg);
     return rc;
 }
@@ -1720,7 +2056,7 @@ static int mm_daemon_config_vfe_axi(mm_daemon_cfg_t *cfg_obj)
         *p++ = 0x500EF2;
     }
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 48, (void *)axiout,
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_AXI, 48, (void *)axiout,
             (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(axiout);
     return rc;
@@ -1755,15 +2091,104 @@ static int mm_daemon_config_vfe_chroma_en(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x0fd70fd7;
     *p = 0x00800080;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 36, (void *)chroma_en,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_CHROMA_EN, 36,
+            (void *)chroma_en, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(chroma_en);
     return rc;
 }
 
+/* Place the smoothed AWB gains on the calibration locus by their Q8 B/R
+   ratio, which falls monotonically with CCT, and interpolate in mired. */
+static uint32_t mm_daemon_config_color_cct(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_color_cal *cal = cfg_obj->sdata->color_cal;
+    const struct mm_sensor_cct_anchor *lo, *hi;
+    int32_t q, q_lo, q_hi, m_lo, m_hi;
+    int i;
+
+    if (cal->num_anchors < 2)
+        return cfg_obj->wb.cct;
+
+    q = (int32_t)(cfg_obj->wb.b_gain * 256 / cfg_obj->wb.r_gain + 0.5f);
+    for (i = 0; i < cal->num_anchors - 1; i++) {
+        lo = &cal->anchors[i];
+        hi = &cal->anchors[i + 1];
+        q_lo = (lo->b_gain << 8) / lo->r_gain;
+        q_hi = (hi->b_gain << 8) / hi->r_gain;
+        if (q >= q_lo)
+            return lo->cct;
+        if (q > q_hi) {
+            m_lo = 1000000 / lo->cct;
+            m_hi = 1000000 / hi->cct;
+            return 1000000 / (m_lo + (m_hi - m_lo) * (q_lo - q) /
+                    (q_lo - q_hi));
+        }
+    }
+    return cal->anchors[cal->num_anchors - 1].cct;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_color_interp
+ *
+ * DESCRIPTION: Interpolate the color matrix and demux gains between the
+ *              two anchors around cct in Q8 mired weights. Each matrix row
+ *              is corrected for rounding so it keeps the interpolated row
+ *              sum and gray stays gray.
+ *
+ * PARAMETERS :
+ *   @cal : sensor color calibration
+ *   @cct : correlated color temperature
+ *   @ccm : returned 3x3 matrix
+ *   @gain: returned R, G and B gains
+ *
+ * RETURN     : none
+ *==========================================================================*/
+static void mm_daemon_config_color_interp(struct mm_sensor_color_cal *cal,
+        uint32_t cct, int16_t *ccm, uint16_t *gain)
+{
+    const struct mm_sensor_cct_anchor *lo = &cal->anchors[0];
+    const struct mm_sensor_cct_anchor *hi = lo;
+    int32_t w = 0;
+    int32_t m, m_lo, m_hi, sum, lo_sum, hi_sum;
+    int i, j;
+
+    for (i = 1; i < cal->num_anchors; i++) {
+        hi = &cal->anchors[i];
+        if (cct < hi->cct)
+            break;
+        lo = hi;
+    }
+    if (cct <= lo->cct || i == cal->num_anchors)
+        hi = lo;
+
+    if (hi != lo) {
+        m = 1000000 / cct;
+        m_lo = 1000000 / lo->cct;
+        m_hi = 1000000 / hi->cct;
+        w = ((m_lo - m) << 8) / (m_lo - m_hi);
+    }
+
+    for (i = 0; i < 3; i++) {
+        sum = 0;
+        lo_sum = 0;
+        hi_sum = 0;
+        for (j = i * 3; j < i * 3 + 3; j++) {
+            ccm[j] = (lo->ccm[j] * (256 - w) + hi->ccm[j] * w + 128) >> 8;
+            sum += ccm[j];
+            lo_sum += lo->ccm[j];
+            hi_sum += hi->ccm[j];
+        }
+        ccm[i * 4] += ((lo_sum * (256 - w) + hi_sum * w + 128) >> 8) - sum;
+    }
+    gain[0] = (lo->r_gain * (256 - w) + hi->r_gain * w + 128) >> 8;
+    gain[1] = (lo->g_gain * (256 - w) + hi->g_gain * w + 128) >> 8;
+    gain[2] = (lo->b_gain * (256 - w) + hi->b_gain * w + 128) >> 8;
+}
+
 static int mm_daemon_config_vfe_color_cor(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
+    int i;
     uint32_t *color_cfg, *p;
     struct msm_vfe_reg_cfg_cmd reg_cfg_cmd[] = {
         {
@@ -1780,18 +2205,23 @@ static int mm_daemon_config_vfe_color_cor(mm_daemon_cfg_t *cfg_obj)
 
     color_cfg = (uint32_t *)malloc(36);
     p = color_cfg;
-    *p++ = 0xC2;
-    *p++ = 0xFF3;
-    *p++ = 0xFCC;
-    *p++ = 0xF95;
-    *p++ = 0xEF;
-    *p++ = 0xFFD;
-    *p++ = 0xF7E;
-    *p++ = 0xF;
-    *p   = 0xF4;
-
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 36, (void *)color_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    if (cfg_obj->color.valid) {
+        for (i = 0; i < 9; i++)
+            *p++ = (uint32_t)cfg_obj->color.ccm[i] & 0xFFF;
+    } else {
+        *p++ = 0xC2;
+        *p++ = 0xFF3;
+        *p++ = 0xFCC;
+        *p++ = 0xF95;
+        *p++ = 0xEF;
+        *p++ = 0xFFD;
+        *p++ = 0xF7E;
+        *p++ = 0xF;
+        *p   = 0xF4;
+    }
+
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_COLOR_COR, 36,
+            (void *)color_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(color_cfg);
     return rc;
 }
@@ -1840,12 +2270,36 @@ static int mm_daemon_config_vfe_asf(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x0;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 48, (void *)asf_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_ASF, 48,
+            (void *)asf_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(asf_cfg);
     return rc;
 }
 
+static uint32_t mm_daemon_config_awb_q7(float gain, uint32_t base)
+{
+    uint32_t val = (uint32_t)(gain * base + 0.5f);
+
+    if (val < 1)
+        return 1;
+    if (val > 0x1FF)
+        return 0x1FF;
+    return val;
+}
+
+/* WB register value for AWB gains relative to green, scaled to the green
+   gain of the mode's auto white balance entry */
+static uint32_t mm_daemon_config_awb_reg(struct mm_sensor_awb_config *awb_cfg,
+        float r_gain, float b_gain)
+{
+    uint32_t base = awb_cfg ? awb_cfg->wb[CAM_WB_MODE_AUTO] & 0x1FF : 0;
+
+    if (!base)
+        base = 0x80;
+    return base | (mm_daemon_config_awb_q7(b_gain, base) << 9) |
+            (mm_daemon_config_awb_q7(r_gain, base) << 18);
+}
+
 static int mm_daemon_config_vfe_white_balance(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
@@ -1870,11 +2324,16 @@ static int mm_daemon_config_vfe_white_balance(mm_daemon_cfg_t *cfg_obj)
 
     wb_mode = mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_WHITE_BALANCE);
 
-    wb_reg = awb_cfg->wb[wb_mode];
+    /* Snapshot balances in the demux block, see demux_gains */
+    if (wb_mode == CAM_WB_MODE_AUTO && cfg_obj->wb.valid && mode != SNAPSHOT)
+        wb_reg = mm_daemon_config_awb_reg(awb_cfg, cfg_obj->wb.r_gain,
+                cfg_obj->wb.b_gain);
+    else
+        wb_reg = awb_cfg->wb[wb_mode];
     if (!wb_reg)
         wb_reg = awb_cfg->wb[0];
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 4, (void *)&wb_reg,
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_WB, 4, (void *)&wb_reg,
             (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     return rc;
 }
@@ -1903,8 +2362,8 @@ static int mm_daemon_config_vfe_black_level(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0xfe;
     *p = 0xfe;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 16, (void *)bl_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_BLACK_LEVEL, 16,
+            (void *)bl_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(bl_cfg);
     return rc;
 }
@@ -1925,8 +2384,8 @@ static int mm_daemon_config_vfe_rgb_gamma(mm_daemon_cfg_t *cfg_obj)
     if (cfg_obj->sdata->uses_sensor_ctrls)
         return 0;
 
-    return mm_daemon_config_vfe_reg_cmd(cfg_obj, 4, (void *)&gamma_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    return mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_GAMMA, 4,
+            (void *)&gamma_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
 }
 
 static int mm_daemon_config_vfe_rgb_gamma_chbank(mm_daemon_cfg_t *cfg_obj, int banksel)
@@ -2003,8 +2462,9 @@ static int mm_daemon_config_vfe_rgb_gamma_chbank(mm_daemon_cfg_t *cfg_obj, int b
     *p++ = 0x100;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 144, (void *)gamma_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_GAMMA_BANK + banksel,
+            144, (void *)gamma_cfg, (void *)&reg_cfg_cmd,
+            ARRAY_SIZE(reg_cfg_cmd));
     free(gamma_cfg);
     return rc;
 }
@@ -2056,19 +2516,55 @@ static int mm_daemon_config_vfe_camif(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x00;
     *p++ = 0x3fff3fff;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 32, (void *)camif_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_CAMIF, 32,
+            (void *)camif_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(camif_cfg);
     return rc;
 }
 
+static void mm_daemon_config_demux_gains(mm_daemon_cfg_t *cfg_obj,
+        uint32_t *gain)
+{
+    int32_t wb_mode;
+    uint32_t base;
+    enum mm_sensor_stream_type mode = mm_daemon_get_sensor_mode(cfg_obj);
+    struct mm_sensor_awb_config *awb_cfg;
+
+    wb_mode = mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_WHITE_BALANCE);
+    awb_cfg = cfg_obj->sdata->awb_cfg[mode];
+
+    if (!cfg_obj->sdata->vfe_dmux_cfg || !awb_cfg) {
+        gain[0] = 0x800080;
+        gain[1] = 0x800080;
+    } else if (mode == SNAPSHOT && wb_mode == CAM_WB_MODE_AUTO &&
+            cfg_obj->color.valid) {
+        /* Calibrated gains at the CCT of the converged preview estimate */
+        gain[0] = cfg_obj->color.gain[1] | (cfg_obj->color.gain[1] << 16);
+        gain[1] = cfg_obj->color.gain[2] | (cfg_obj->color.gain[0] << 16);
+    } else if (mode == SNAPSHOT && wb_mode == CAM_WB_MODE_AUTO &&
+            cfg_obj->wb.valid) {
+        /* Without a calibration, the converged preview gains scaled to
+           the auto entry's green gain */
+        base = awb_cfg->dmx_wb1[CAM_WB_MODE_AUTO] & 0xFFFF;
+        if (!base)
+            base = 0x80;
+        gain[0] = base | (base << 16);
+        gain[1] = mm_daemon_config_awb_q7(cfg_obj->wb.b_gain, base) |
+                (mm_daemon_config_awb_q7(cfg_obj->wb.r_gain, base) << 16);
+    } else if (!awb_cfg->dmx_wb1[wb_mode] || !awb_cfg->dmx_wb2[wb_mode]) {
+        gain[0] = awb_cfg->dmx_wb1[0];
+        gain[1] = awb_cfg->dmx_wb2[0];
+    } else {
+        gain[0] = awb_cfg->dmx_wb1[wb_mode];
+        gain[1] = awb_cfg->dmx_wb2[wb_mode];
+    }
+}
+
 static int mm_daemon_config_vfe_demux(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
-    int32_t wb_mode;
     enum mm_sensor_stream_type mode = mm_daemon_get_sensor_mode(cfg_obj);
     uint32_t *demux_cfg, *p;
-    struct mm_sensor_awb_config *awb_cfg;
     struct msm_vfe_reg_cfg_cmd reg_cfg_cmd[] = {
         {
             .u.rw_info = {
@@ -2079,37 +2575,90 @@ static int mm_daemon_config_vfe_demux(mm_daemon_cfg_t *cfg_obj)
         },
     };
 
-    wb_mode = mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_WHITE_BALANCE);
-    awb_cfg = cfg_obj->sdata->awb_cfg[mode];
-
     demux_cfg = (uint32_t *)malloc(20);
     p = demux_cfg;
-    if (!cfg_obj->sdata->vfe_dmux_cfg || !awb_cfg) {
+    if (!cfg_obj->sdata->vfe_dmux_cfg || !cfg_obj->sdata->awb_cfg[mode]) {
         *p++ = 0x3;
-        *p++ = 0x800080;
-        *p++ = 0x800080;
+        mm_daemon_config_demux_gains(cfg_obj, p);
+        p += 2;
         *p++ = 0x9CAC;
         *p = 0x9CAC;
     } else {
         *p++ = 0x1;
-        if (!awb_cfg->dmx_wb1[wb_mode] || !awb_cfg->dmx_wb2[wb_mode]) {
-            *p++ = awb_cfg->dmx_wb1[0];
-            *p++ = awb_cfg->dmx_wb2[0];
-        } else {
-            *p++ = awb_cfg->dmx_wb1[wb_mode];
-            *p++ = awb_cfg->dmx_wb2[wb_mode];
-        }
+        mm_daemon_config_demux_gains(cfg_obj, p);
+        p += 2;
         *p++ = ((cfg_obj->sdata->vfe_dmux_cfg & 0xFF00) >> 8);
         *p = (cfg_obj->sdata->vfe_dmux_cfg & 0x00FF);
     }
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 20, (void *)demux_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_DEMUX, 20,
+            (void *)demux_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(demux_cfg);
 
     return rc;
 }
 
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_vfe_wb_gains
+ *
+ * DESCRIPTION: Writes the WB block and the demux channel gains in a single
+ *              register command and keeps both block shadows in sync.
+ *
+ * PARAMETERS :
+ *   @cfg_obj : pointer to config object
+ *   @wb_reg  : WB block value
+ *   @dmx_gain: demux gain words
+ *
+ * RETURN     : 1 if written, 0 if unchanged, negative on failure
+ *==========================================================================*/
+static int mm_daemon_config_vfe_wb_gains(mm_daemon_cfg_t *cfg_obj,
+        uint32_t wb_reg, uint32_t *dmx_gain)
+{
+    int rc;
+    struct mm_daemon_vfe_shadow *shadow = &cfg_obj->vfe_shadow;
+    uint32_t *wb = (uint32_t *)shadow->data[VFE_BLK_WB];
+    uint32_t *dmx = (uint32_t *)shadow->data[VFE_BLK_DEMUX];
+    uint32_t gains[3] = { wb_reg, dmx_gain[0], dmx_gain[1] };
+    struct msm_vfe_reg_cfg_cmd reg_cfg_cmd[] = {
+        {
+            .u.rw_info = {
+                .reg_offset = 0x384,
+                .len = 4,
+            },
+            .cmd_type = VFE_WRITE,
+        },
+        {
+            .u.rw_info = {
+                .reg_offset = 0x288,
+                .len = 8,
+                .cmd_data_offset = 4,
+            },
+            .cmd_type = VFE_WRITE,
+        },
+    };
+
+    if (shadow->len[VFE_BLK_WB] != 4)
+        wb = NULL;
+    if (shadow->len[VFE_BLK_DEMUX] != 20)
+        dmx = NULL;
+    if (wb && dmx && wb[0] == wb_reg && dmx[1] == dmx_gain[0] &&
+            dmx[2] == dmx_gain[1])
+        return 0;
+
+    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, sizeof(gains), gains,
+            reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    if (rc < 0)
+        return rc;
+
+    if (wb)
+        wb[0] = wb_reg;
+    if (dmx) {
+        dmx[1] = dmx_gain[0];
+        dmx[2] = dmx_gain[1];
+    }
+    return 1;
+}
+
 static int mm_daemon_config_vfe_out_clamp(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
@@ -2129,8 +2678,8 @@ static int mm_daemon_config_vfe_out_clamp(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0xffffff;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 8, (void *)clamp_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_OUT_CLAMP, 8,
+            (void *)clamp_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(clamp_cfg);
     return rc;
 }
@@ -2138,7 +2687,7 @@ static int mm_daemon_config_vfe_out_clamp(mm_daemon_cfg_t *cfg_obj)
 static int mm_daemon_config_vfe_frame_skip(mm_daemon_cfg_t *cfg_obj)
 {
     int rc = 0;
-    uint32_t *skip_cfg, *p;
+    uint32_t *skip_cfg, *p, pattern;
     struct msm_vfe_reg_cfg_cmd reg_cfg_cmd[] = {
         {
             .u.rw_info = {
@@ -2149,19 +2698,23 @@ static int mm_daemon_config_vfe_frame_skip(mm_daemon_cfg_t *cfg_obj)
         },
     };
 
+    /* drop every frame until the sensor output has settled */
+    pattern = cfg_obj->settle_frames ? 0 : 0xffffffff;
+    if (cfg_obj->hdr.active)
+        pattern = cfg_obj->hdr.pattern;
     skip_cfg = (uint32_t *)malloc(32);
     p = skip_cfg;
     *p++ = 0x1f;
     *p++ = 0x1f;
-    *p++ = 0xffffffff;
-    *p++ = 0xffffffff;
+    *p++ = pattern;
+    *p++ = pattern;
     *p++ = 0x1f;
     *p++ = 0x1f;
-    *p++ = 0xffffffff;
-    *p++ = 0xffffffff;
+    *p++ = pattern;
+    *p++ = pattern;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 32, (void *)skip_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_FRAME_SKIP, 32,
+            (void *)skip_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(skip_cfg);
     return rc;
 }
@@ -2186,8 +2739,8 @@ static int mm_daemon_config_vfe_chroma_subs(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x0;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 12, (void *)chroma_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_CHROMA_SUBS, 12,
+            (void *)chroma_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(chroma_cfg);
     return rc;
 }
@@ -2246,8 +2799,8 @@ static int mm_daemon_config_vfe_sk_enhance(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x0;
     *p = 0x0;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 136, (void *)sk_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_SK_ENHANCE, 136,
+            (void *)sk_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(sk_cfg);
     return rc;
 }
@@ -2265,8 +2818,9 @@ static int mm_daemon_config_vfe_module(mm_daemon_cfg_t *cfg_obj)
         },
     };
 
-    return mm_daemon_config_vfe_reg_cmd(cfg_obj, 4, (void *)&module_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    return mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_MODULE, 4,
+            (void *)&module_cfg, (void *)&reg_cfg_cmd,
+            ARRAY_SIZE(reg_cfg_cmd));
 }
 
 static int mm_daemon_config_vfe_op_mode(mm_daemon_cfg_t *cfg_obj)
@@ -2319,8 +2873,8 @@ static int mm_daemon_config_vfe_op_mode(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x0;
     *p = cfg_obj->sdata->stats_enable;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 16, (void *)op_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_OP_MODE, 16,
+            (void *)op_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(op_cfg);
     return rc;
 }
@@ -2377,8 +2931,8 @@ static int mm_daemon_config_vfe_stats_aec(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x50000000;
     *p = 0xff03b04f;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 8, (void *)aec_stats,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_STATS_AEC, 8,
+            (void *)aec_stats, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(aec_stats);
     return rc;
 }
@@ -2408,8 +2962,8 @@ static int mm_daemon_config_vfe_stats_awb(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x4021203d;
     *p = 0x4009d082;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 32, (void *)awb_stats,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_STATS_AWB, 32,
+            (void *)awb_stats, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(awb_stats);
     return rc;
 }
@@ -2435,8 +2989,8 @@ static int mm_daemon_config_vfe_stats_af(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0xA781E;
     *p++ = 0x1FFA3FF;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 16, (void *)af_stats,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_STATS_AF, 16,
+            (void *)af_stats, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(af_stats);
     return rc;
 }
@@ -2470,8 +3024,8 @@ static int mm_daemon_config_vfe_mce(mm_daemon_cfg_t *cfg_obj)
     *p++ = 0x86AA8000;
     *p = 0x001319F4;
 
-    rc = mm_daemon_config_vfe_reg_cmd(cfg_obj, 36, (void *)mce_cfg,
-            (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
+    rc = mm_daemon_config_vfe_blk_cmd(cfg_obj, VFE_BLK_MCE, 36,
+            (void *)mce_cfg, (void *)&reg_cfg_cmd, ARRAY_SIZE(reg_cfg_cmd));
     free(mce_cfg);
     return rc;
 }
@@ -2516,96 +3070,161 @@ static void mm_daemon_config_stats_stream_release(mm_daemon_cfg_t *cfg_obj,
     stat->stream_handle = 0;
 }
 
-static int mm_daemon_config_stats_buf_alloc(mm_daemon_cfg_t *cfg_obj)
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_stats_pool_alloc
+ *
+ * DESCRIPTION: Allocate, share and map the ION buffer every stats buffer is
+ *              carved from. Each stats type gets STATS_BUFFER_MAX slots
+ *              of at least MM_DAEMON_STATS_SLOT_MIN bytes so a write larger
+ *              than its assumed layout cannot reach the next slot. Only
+ *              the first session pays for it;
+ *              the pool is kept until the daemon exits.
+ *
+ * PARAMETERS :
+ *   @pool: daemon stats buffer pool
+ *
+ * RETURN     : 0 on success, negative errno otherwise
+ *==========================================================================*/
+static int mm_daemon_config_stats_pool_alloc(mm_daemon_stats_pool_t *pool)
 {
-    int j, rc = 0;
-    int32_t len;
-    uint32_t i;
     struct ion_allocation_data alloc_data;
     struct ion_fd_data fd_data;
-    enum msm_isp_stats_type stats_type;
-    mm_daemon_stats_buf_info *stat;
+    struct ion_handle_data handle_data;
+    uint32_t i, type, len = 0;
+    int rc;
+
+    if (pool->vaddr)
+        return 0;
 
     for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
-        stats_type = vfe_stats[i];
-        stat = cfg_obj->stats_buf[stats_type];
-        len = 1000;
-        if (!stat || !len)
-            continue;
-        for (j = 0; j < stat->buf_cnt; j++) {
-            memset(&fd_data, 0, sizeof(fd_data));
-            memset(&alloc_data, 0, sizeof(alloc_data));
-            alloc_data.len = (len + 4095) & (~4095);
-            alloc_data.align = 4096;
-            alloc_data.flags = ION_HEAP(ION_CAMERA_HEAP_ID);
-            alloc_data.heap_mask = alloc_data.flags;
-            rc = ioctl(cfg_obj->ion_fd, ION_IOC_ALLOC, &alloc_data);
-            if (rc < 0) {
-                ALOGE("%s: Error allocating stat heap", __FUNCTION__);
-                return rc;
-            }
-            fd_data.handle = alloc_data.handle;
-            if (ioctl(cfg_obj->ion_fd, ION_IOC_SHARE, &fd_data) < 0) {
-                struct ion_handle_data handle_data;
-                memset(&handle_data, 0, sizeof(handle_data));
-                handle_data.handle = alloc_data.handle;
-                rc = -errno;
-                ALOGE("%s: ION_IOC_SHARE failed with error %s",
-                        __FUNCTION__, strerror(errno));
-                ioctl(cfg_obj->ion_fd, ION_IOC_FREE, &handle_data);
-                return rc;
-            }
-            stat->buf_data[j].fd = fd_data.fd;
-            stat->buf_data[j].handle = alloc_data.handle;
-            stat->buf_data[j].len = alloc_data.len;
-            stat->buf_data[j].vaddr = mmap(0, alloc_data.len,
-                        PROT_READ|PROT_WRITE, MAP_SHARED,
-                        stat->buf_data[j].fd, 0);
-            if (stat->buf_data[j].vaddr != MAP_FAILED)
-                stat->buf_data[j].mapped = 1;
-        }
+        type = vfe_stats[i];
+        pool->slot_len[type] = (vfe_stats_len[type] +
+                MM_DAEMON_STATS_BUF_ALIGN - 1) &
+                ~(MM_DAEMON_STATS_BUF_ALIGN - 1);
+        if (pool->slot_len[type] < MM_DAEMON_STATS_SLOT_MIN)
+            pool->slot_len[type] = MM_DAEMON_STATS_SLOT_MIN;
+        pool->base[type] = len;
+        len += pool->slot_len[type] * STATS_BUFFER_MAX;
+    }
+
+    pool->ion_fd = open("/dev/ion", O_RDONLY);
+    if (pool->ion_fd < 0) {
+        rc = -errno;
+        ALOGE("failed to open ion device");
+        pool->ion_fd = 0;
+        return rc;
     }
+
+    memset(&alloc_data, 0, sizeof(alloc_data));
+    alloc_data.len = (len + 4095) & ~4095;
+    alloc_data.align = 4096;
+    alloc_data.flags = ION_HEAP(ION_CAMERA_HEAP_ID);
+    alloc_data.heap_mask = alloc_data.flags;
+    rc = ioctl(pool->ion_fd, ION_IOC_ALLOC, &alloc_data);
+    if (rc < 0) {
+        ALOGE("%s: Error allocating stat heap", __FUNCTION__);
+        goto close_ion;
+    }
+
+    memset(&fd_data, 0, sizeof(fd_data));
+    fd_data.handle = alloc_data.handle;
+    if (ioctl(pool->ion_fd, ION_IOC_SHARE, &fd_data) < 0) {
+        rc = -errno;
+        ALOGE("%s: ION_IOC_SHARE failed with error %s",
+                __FUNCTION__, strerror(errno));
+        goto free_handle;
+    }
+
+    pool->vaddr = mmap(0, alloc_data.len, PROT_READ|PROT_WRITE, MAP_SHARED,
+            fd_data.fd, 0);
+    if (pool->vaddr == MAP_FAILED) {
+        rc = -errno;
+        pool->vaddr = NULL;
+        close(fd_data.fd);
+        goto free_handle;
+    }
+    pool->fd = fd_data.fd;
+    pool->handle = alloc_data.handle;
+    pool->len = alloc_data.len;
+    ALOGI("%s: %u bytes for %u stats buffers of each type", __FUNCTION__,
+            pool->len, STATS_BUFFER_MAX);
+    return 0;
+
+free_handle:
+    memset(&handle_data, 0, sizeof(handle_data));
+    handle_data.handle = alloc_data.handle;
+    ioctl(pool->ion_fd, ION_IOC_FREE, &handle_data);
+close_ion:
+    close(pool->ion_fd);
+    pool->ion_fd = 0;
     return rc;
 }
 
-static void mm_daemon_config_stats_buf_dealloc(mm_daemon_cfg_t *cfg_obj)
+void mm_daemon_config_stats_pool_release(mm_daemon_stats_pool_t *pool)
 {
-    int j;
-    size_t i;
     struct ion_handle_data handle_data;
-    mm_daemon_stats_buf_info *stat = NULL;
+
+    if (!pool->vaddr)
+        return;
+
+    munmap(pool->vaddr, pool->len);
+    close(pool->fd);
+    memset(&handle_data, 0, sizeof(handle_data));
+    handle_data.handle = pool->handle;
+    if (ioctl(pool->ion_fd, ION_IOC_FREE, &handle_data) < 0)
+        ALOGE("%s: failed to free ION buffer", __FUNCTION__);
+    close(pool->ion_fd);
+    memset(pool, 0, sizeof(*pool));
+}
+
+/* Hand the session its stats buffers from the pool, one slot per type
+   and buffer index */
+static int mm_daemon_config_stats_buf_alloc(mm_daemon_cfg_t *cfg_obj)
+{
+    mm_daemon_stats_pool_t *pool = cfg_obj->stats_pool;
+    mm_daemon_stats_buf_info *stat;
+    uint32_t i, off;
+    int j, rc;
+
+    rc = mm_daemon_config_stats_pool_alloc(pool);
+    if (rc < 0)
+        return rc;
 
     for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
         stat = cfg_obj->stats_buf[vfe_stats[i]];
         if (!stat)
             continue;
-
-        for (j = 0; j < stat->buf_cnt; j++) {
-            memset(&handle_data, 0, sizeof(handle_data));
-            if (stat->buf_data[j].mapped) {
-                munmap(stat->buf_data[j].vaddr, stat->buf_data[j].len);
-                stat->buf_data[j].vaddr = NULL;
-                if (stat->buf_data[j].fd > 0) {
-                    close(stat->buf_data[j].fd);
-                    stat->buf_data[j].fd = 0;
-                }
-                stat->buf_data[j].mapped = 0;
-            }
-            if (stat->buf_data[j].handle) {
-                handle_data.handle = stat->buf_data[j].handle;
-                if (ioctl(cfg_obj->ion_fd, ION_IOC_FREE, &handle_data) < 0)
-                    ALOGE("%s: failed to free ION buffer", __FUNCTION__);
-                stat->buf_data[j].handle = NULL;
-                stat->buf_data[j].len = 0;
-            }
+        for (j = 0; j < stat->buf_cnt && j < STATS_BUFFER_MAX; j++) {
+            off = pool->base[vfe_stats[i]] + j * pool->slot_len[vfe_stats[i]];
+            stat->buf_data[j].fd = pool->fd;
+            stat->buf_data[j].offset = off;
+            stat->buf_data[j].vaddr = (uint8_t *)pool->vaddr + off;
+            stat->buf_data[j].len = pool->slot_len[vfe_stats[i]];
+            stat->buf_data[j].mapped = 1;
+            memset(stat->buf_data[j].vaddr, 0, stat->buf_data[j].len);
         }
     }
+    return 0;
+}
+
+/* The pool outlives the session, only the references are dropped */
+static void mm_daemon_config_stats_buf_dealloc(mm_daemon_cfg_t *cfg_obj)
+{
+    mm_daemon_stats_buf_info *stat;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
+        stat = cfg_obj->stats_buf[vfe_stats[i]];
+        if (stat)
+            memset(stat->buf_data, 0, sizeof(stat->buf_data));
+    }
 }
 
 static int mm_daemon_config_stats_buf_request(mm_daemon_cfg_t *cfg_obj)
 {
+    mm_daemon_stats_pool_t *pool = cfg_obj->stats_pool;
     int rc = 0;
-    int num_buf = STATS_BUFFER_MAX;
+    int num_buf;
     size_t i;
     uint32_t stream_id;
     enum msm_isp_stats_type type;
@@ -2616,6 +3235,9 @@ static int mm_daemon_config_stats_buf_request(mm_daemon_cfg_t *cfg_obj)
 
     for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
         type = vfe_stats[i];
+        if (!pool->depth[type])
+            pool->depth[type] = STATS_BUFFER_DEF;
+        num_buf = pool->depth[type];
         stream_id = (type | ISP_NATIVE_BUF_BIT);
         memset(&buf_req, 0, sizeof(buf_req));
         buf_req.session_id = cfg_obj->session_id;
@@ -2662,7 +3284,7 @@ static int mm_daemon_config_stats_buf_enqueue(mm_daemon_cfg_t *cfg_obj)
                 qbuf_info.buffer = buffer;
                 qbuf_info.buf_idx = j;
                 plane[0].m.userptr = stat->buf_data[j].fd;
-                plane[0].data_offset = 0;
+                plane[0].data_offset = stat->buf_data[j].offset;
                 qbuf_info.handle = stat->bufq_handle;
                 ioctl(cfg_obj->vfe_fd, VIDIOC_MSM_ISP_ENQUEUE_BUF,
                         &qbuf_info);
@@ -2767,10 +3389,159 @@ static int mm_daemon_config_exp_gain(mm_daemon_cfg_t *cfg_obj, uint16_t gain,
             SENSOR_CMD_EXP_GAIN, val, wait);
     cfg_obj->ae.c_gain = gain;
     cfg_obj->ae.c_line = line;
+    mm_daemon_config_exp_land(cfg_obj, gain, line);
 
     return 0;
 }
 
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_snapshot_exp
+ *
+ * DESCRIPTION: Converts the converged preview exposure into the line count
+ *              giving the same exposure time in snapshot mode. It is sent
+ *              ahead of the mode switch so the first capture frame is
+ *              exposed correctly. Gain is carried over, rescaled only when
+ *              anti-banding holds the line at a flicker period.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *==========================================================================*/
+static void mm_daemon_config_snapshot_exp(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    struct mm_sensor_stream_attr *prev = cfg_obj->sdata->attr[PREVIEW];
+    struct mm_sensor_stream_attr *snap = cfg_obj->sdata->attr[SNAPSHOT];
+    uint64_t num, den;
+    uint32_t line;
+    uint16_t gain;
+
+    if (!aec_cfg || !prev || !snap || !prev->pix_clk || !snap->pix_clk)
+        return;
+
+    /* A metered main flash replaces the ambient exposure */
+    line = cfg_obj->ae.c_line;
+    if (cfg_obj->snap_flash && cfg_obj->ae.pf.metered)
+        line = cfg_obj->ae.pf.f_line;
+
+    /* line * ll_prev / pclk_prev == snap_line * ll_snap / pclk_snap */
+    num = (uint64_t)line * (prev->w + prev->blk_p) * snap->pix_clk;
+    den = (uint64_t)(snap->w + snap->blk_p) * prev->pix_clk;
+    line = (num + den / 2) / den;
+    if (line < aec_cfg->line_min)
+        line = aec_cfg->line_min;
+    else if (line > aec_cfg->line_max)
+        line = aec_cfg->line_max;
+
+    if (!cfg_obj->ae.restore) {
+        cfg_obj->ae.p_gain = cfg_obj->ae.c_gain;
+        cfg_obj->ae.p_line = cfg_obj->ae.c_line;
+        cfg_obj->ae.restore = 1;
+    }
+    gain = cfg_obj->ae.p_gain;
+    line = mm_daemon_config_ab_quantize(cfg_obj, SNAPSHOT, line, &gain);
+    ALOGD("%s: preview line %d -> snapshot line %d gain %d", __FUNCTION__,
+            cfg_obj->ae.p_line, line, gain);
+    mm_daemon_config_exp_gain(cfg_obj, gain, line, FALSE);
+}
+
+/* Brackets in 1/6 EV; the first is the frame already programmed when
+   the capture starts */
+static const int8_t mm_daemon_hdr_ev[MM_DAEMON_HDR_FRAMES] = { 0, -12, 12 };
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_hdr_start
+ *
+ * DESCRIPTION: Plan an HDR bracket for the capture about to start. The
+ *              brackets scale the snapshot line count, and whatever the
+ *              line limits cut off is carried into gain within the gain
+ *              limits. The frame skip pattern keeps the first frame and
+ *              the frames the later brackets land on, which are written
+ *              from the first capture SOF by mm_daemon_config_hdr_sof.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *==========================================================================*/
+static void mm_daemon_config_hdr_start(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_hdr_info *hdr = &cfg_obj->hdr;
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    mm_daemon_buf_info *buf = mm_daemon_get_stream_buf(cfg_obj,
+            CAM_STREAM_TYPE_SNAPSHOT);
+    cam_hdr_param_t *parm;
+    uint32_t want, line, lin;
+    uint16_t gain;
+    int i, lat;
+
+    memset(hdr, 0, sizeof(*hdr));
+    if (!aec_cfg || !buf || !buf->stream_info || !cfg_obj->parm_buf.cfg_buf)
+        return;
+
+    parm = (cam_hdr_param_t *)POINTER_OF(CAM_INTF_PARM_HDR,
+            cfg_obj->parm_buf.cfg_buf);
+    if (!parm->hdr_enable || buf->stream_info->num_of_burst < 2)
+        return;
+
+    hdr->num = buf->stream_info->num_of_burst;
+    if (hdr->num > MM_DAEMON_HDR_FRAMES)
+        hdr->num = MM_DAEMON_HDR_FRAMES;
+    lat = mm_daemon_config_exp_lead(cfg_obj);
+
+    lin = mm_daemon_config_gain_lin(aec_cfg, cfg_obj->ae.c_gain);
+    for (i = 0; i < hdr->num; i++) {
+        want = mm_daemon_config_ev_scale(cfg_obj->ae.c_line,
+                mm_daemon_hdr_ev[i]);
+        line = want;
+        if (line < aec_cfg->line_min)
+            line = aec_cfg->line_min;
+        else if (line > aec_cfg->line_max)
+            line = aec_cfg->line_max;
+        gain = mm_daemon_config_gain_code(aec_cfg,
+                (lin * want + line / 2) / line);
+        hdr->bracket[i] = mm_daemon_config_ab_quantize(cfg_obj, SNAPSHOT,
+                line, &gain);
+        hdr->gain[i] = gain;
+    }
+
+    hdr->pattern = 1 | (((1 << (hdr->num - 1)) - 1) << lat);
+    hdr->active = 1;
+    ALOGI("%s: %d frames, line/gain %d/%d %d/%d %d/%d, pattern 0x%x",
+            __FUNCTION__, hdr->num, hdr->bracket[0], hdr->gain[0],
+            hdr->bracket[1], hdr->gain[1], hdr->bracket[2], hdr->gain[2],
+            hdr->pattern);
+}
+
+/* Write the later brackets from the first capture SOF on, one per
+   frame, each landing on the frame after the last */
+static void mm_daemon_config_hdr_sof(mm_daemon_cfg_t *cfg_obj,
+        uint32_t frame_id)
+{
+    struct mm_daemon_hdr_info *hdr = &cfg_obj->hdr;
+    uint8_t lat = mm_daemon_config_exp_lead(cfg_obj);
+    uint32_t target;
+
+    if (!hdr->active || (hdr->started && hdr->next >= hdr->num))
+        return;
+
+    if (!hdr->started) {
+        hdr->started = 1;
+        hdr->first = frame_id;
+        hdr->next = 1;
+    }
+    target = hdr->first + lat + hdr->next - 1;
+    if (frame_id + lat < target)
+        return;
+    if (frame_id + lat > target) {
+        hdr->late++;
+        ALOGV("%s: bracket for frame %u lands on %u", __FUNCTION__,
+                target, frame_id + lat);
+    }
+    mm_daemon_config_exp_gain(cfg_obj, hdr->gain[hdr->next],
+            hdr->bracket[hdr->next], FALSE);
+    if (++hdr->next == hdr->num && hdr->late)
+        ALOGI("%s: %u of %u brackets late", __FUNCTION__, hdr->late,
+                hdr->num - 1);
+}
+
 /*==========================================================================
  * FUNCTION   : mm_daemon_config_prepare_snapshot
  *
@@ -2788,36 +3559,243 @@ static void mm_daemon_config_prepare_snapshot(mm_daemon_cfg_t *cfg_obj,
     if (!cfg_obj->info[LED_DEV] || (cfg_obj->prep_snapshot == prep_snapshot))
         return;
 
-    if (prep_snapshot)
+    if (prep_snapshot) {
         led = MSM_CAMERA_LED_LOW;
-    else
+    } else {
         led = MSM_CAMERA_LED_OFF;
+        cfg_obj->ae.pf.state = MM_PREFLASH_OFF;
+    }
 
     cfg_obj->prep_snapshot = prep_snapshot;
     mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
             LED_CMD_CONTROL, led, FALSE);
 }
 
+/* The first frame after the LED is switched is skipped as it changes
+   part way through its exposure. The main flash is taken to be
+   MM_DAEMON_PREFLASH_RATIO times brighter than the pre-flash, with a
+   white point of MM_DAEMON_FLASH_CCT kelvin. */
+#define MM_DAEMON_PREFLASH_SKIP 1
+#define MM_DAEMON_PREFLASH_RATIO 4
+#define MM_DAEMON_FLASH_CCT 5500
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_preflash_start
+ *
+ * DESCRIPTION: Turns on the pre-flash and starts metering it. Ambient luma
+ *              is what the last frame saw before the LED came on. If the
+ *              LED is already lit for focus assist, it is turned off for a
+ *              frame to meter ambient first.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *==========================================================================*/
+static void mm_daemon_config_preflash_start(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_preflash_info *pf = &cfg_obj->ae.pf;
+    uint8_t lit = cfg_obj->prep_snapshot;
+
+    mm_daemon_config_prepare_snapshot(cfg_obj, 1);
+    if (!cfg_obj->prep_snapshot || !cfg_obj->sdata->aec_cfg)
+        return;
+
+    memset(pf, 0, sizeof(*pf));
+    pf->amb_cct = cfg_obj->color.valid ? cfg_obj->color.cct :
+            cfg_obj->wb.cct;
+    if (lit) {
+        mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
+                LED_CMD_CONTROL, MSM_CAMERA_LED_OFF, FALSE);
+        pf->state = MM_PREFLASH_AMBIENT;
+    } else {
+        pf->amb_luma = cfg_obj->ae.luma;
+        pf->state = MM_PREFLASH_METER;
+    }
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_preflash
+ *
+ * DESCRIPTION: Meter a pre-flash frame at the ambient exposure. The luma
+ *              gained over ambient, scaled by the main to pre-flash ratio,
+ *              gives the main flash exposure and how far the white point
+ *              moves toward the LED.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @luma   : average luma of the current AEC stats frame
+ *==========================================================================*/
+static void mm_daemon_config_preflash(mm_daemon_cfg_t *cfg_obj, uint16_t luma)
+{
+    struct mm_daemon_preflash_info *pf = &cfg_obj->ae.pf;
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    uint32_t amb = pf->amb_luma;
+    uint32_t flash, lit;
+    uint32_t line = cfg_obj->ae.c_line;
+    uint32_t m;
+
+    if (pf->state == MM_PREFLASH_DONE ||
+            pf->frames++ < MM_DAEMON_PREFLASH_SKIP)
+        return;
+
+    if (pf->state == MM_PREFLASH_AMBIENT) {
+        pf->amb_luma = luma;
+        pf->frames = 0;
+        pf->state = MM_PREFLASH_METER;
+        mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
+                LED_CMD_CONTROL, MSM_CAMERA_LED_LOW, FALSE);
+        return;
+    }
+
+    flash = luma > amb ? (luma - amb) * MM_DAEMON_PREFLASH_RATIO : 0;
+    lit = amb + flash;
+    if (lit)
+        line = ((uint64_t)line * aec_cfg->target[PREVIEW].tgt + lit / 2) /
+                lit;
+    if (line < aec_cfg->line_min)
+        line = aec_cfg->line_min;
+    else if (line > aec_cfg->line_max)
+        line = aec_cfg->line_max;
+    pf->f_line = line;
+
+    pf->f_cct = pf->amb_cct;
+    if (lit && pf->amb_cct) {
+        m = ((uint64_t)(1000000 / pf->amb_cct) * amb +
+                (uint64_t)(1000000 / MM_DAEMON_FLASH_CCT) * flash) / lit;
+        pf->f_cct = 1000000 / m;
+    }
+
+    pf->state = MM_PREFLASH_DONE;
+    pf->metered = 1;
+    ALOGI("%s: luma %u -> %u, line %u -> %u, cct %u -> %u", __FUNCTION__,
+            amb, luma, cfg_obj->ae.c_line, line, pf->amb_cct, pf->f_cct);
+}
+
+/* Snapshot color matrix and demux gains at the metered flash white
+   point */
+static void mm_daemon_config_preflash_color(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_color_cal *cal = cfg_obj->sdata->color_cal;
+    struct mm_daemon_color_info *color = &cfg_obj->color;
+
+    if (!cfg_obj->ae.pf.metered || !cfg_obj->ae.pf.f_cct ||
+            !cal || !cal->num_anchors ||
+            cfg_obj->sdata->uses_sensor_ctrls ||
+            mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_WHITE_BALANCE)
+            != CAM_WB_MODE_AUTO)
+        return;
+
+    mm_daemon_config_color_interp(cal, cfg_obj->ae.pf.f_cct, color->ccm,
+            color->gain);
+    color->cct = cfg_obj->ae.pf.f_cct;
+    color->valid = 1;
+}
+
+enum mm_daemon_start_phase {
+    START_PHASE_ISSUE,
+    START_PHASE_BUF,
+    START_PHASE_VFE,
+    START_PHASE_STREAM,
+    START_PHASE_MODE_WAIT,
+    START_PHASE_START,
+    START_PHASE_MAX,
+};
+
+static void mm_daemon_config_start_timing(const char *name, uint64_t *ts)
+{
+    uint32_t d[START_PHASE_MAX];
+    int i;
+
+    for (i = 0; i < START_PHASE_MAX; i++)
+        d[i] = (uint32_t)(ts[i + 1] - ts[i]);
+
+    ALOGD("%s: issue %uus buf %uus vfe %uus stream %uus mode wait %uus "
+            "start %uus total %uus", name, d[START_PHASE_ISSUE],
+            d[START_PHASE_BUF], d[START_PHASE_VFE], d[START_PHASE_STREAM],
+            d[START_PHASE_MODE_WAIT], d[START_PHASE_START],
+            (uint32_t)(ts[START_PHASE_MAX] - ts[START_PHASE_ISSUE]));
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_mode_wait
+ *
+ * DESCRIPTION: Blocks until the sensor thread has finished a mode switch
+ *              issued with mm_daemon_util_subdev_cmd_async.
+ *
+ * PARAMETERS :
+ *   @cfg_obj:  pointer to config object
+ *   @mode_seq: token of the SENSOR_CMD_SET_MODE command
+ *
+ * RETURN     : 0 on success, negative errno on timeout
+ *==========================================================================*/
+static int mm_daemon_config_mode_wait(mm_daemon_cfg_t *cfg_obj,
+        uint32_t mode_seq)
+{
+    int rc;
+
+    rc = mm_daemon_util_subdev_cmd_wait(cfg_obj->info[SNSR_DEV], mode_seq,
+            MM_DAEMON_SNSR_MODE_TIMEOUT_MS);
+    if (rc < 0)
+        ALOGE("%s: sensor mode switch did not complete (%d)",
+                __FUNCTION__, rc);
+    return rc;
+}
+
 static int mm_daemon_config_start_preview(mm_daemon_cfg_t *cfg_obj)
 {
     cam_stream_type_t stream_type = CAM_STREAM_TYPE_PREVIEW;
     mm_daemon_buf_info *buf = mm_daemon_get_stream_buf(cfg_obj, stream_type);
+    uint8_t resume = cfg_obj->vfe_shadow.retained;
+    uint64_t ts[START_PHASE_MAX + 1];
+    uint32_t mode_seq;
+    int rc;
 
     if (!buf)
         return -ENOMEM;
 
-    if (cfg_obj->info[CSI_DEV])
+    ts[START_PHASE_ISSUE] = mm_daemon_util_time_us();
+    cfg_obj->vfe_shadow.retained = 0;
+    /* A flash prepared for a capture that never came is dropped */
+    cfg_obj->snap_flash = 0;
+    cfg_obj->ae.pf.metered = 0;
+    /* Returning from a capture leaves CSI and the actuator set up */
+    if (!resume && cfg_obj->info[CSI_DEV])
         mm_daemon_util_subdev_cmd(cfg_obj->info[CSI_DEV],
                 CSI_CMD_CFG, 0, FALSE);
 
-    mm_daemon_util_subdev_cmd(cfg_obj->info[SNSR_DEV], SENSOR_CMD_SET_MODE,
-            mm_daemon_get_sensor_mode(cfg_obj), TRUE);
+    /* Preview exposure held across a capture is put back */
+    if (cfg_obj->ae.restore) {
+        cfg_obj->ae.c_gain = cfg_obj->ae.p_gain;
+        cfg_obj->ae.c_line = cfg_obj->ae.p_line;
+        cfg_obj->ae.restore = 0;
+        cfg_obj->warm_start |= MM_DAEMON_3A_STATE_AE;
+    }
 
-    mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
-            ACT_CMD_INIT_FOCUS, 0, FALSE);
+    /* Exposure saved by the last session or held across a capture is
+       reapplied by the mode switch */
+    if (cfg_obj->warm_start & MM_DAEMON_3A_STATE_AE)
+        mm_daemon_util_subdev_cmd(cfg_obj->info[SNSR_DEV],
+                SENSOR_CMD_EXP_GAIN, cfg_obj->ae.c_gain |
+                (cfg_obj->ae.c_line << 16), FALSE);
 
+    /* The sensor writes its mode table while the VFE is programmed */
+    mode_seq = mm_daemon_util_subdev_cmd_async(cfg_obj->info[SNSR_DEV],
+            SENSOR_CMD_SET_MODE, mm_daemon_get_sensor_mode(cfg_obj));
+
+    if (!resume)
+        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
+                ACT_CMD_INIT_FOCUS, 0, FALSE);
+    if (cfg_obj->warm_start & MM_DAEMON_3A_STATE_AF)
+        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
+                ACT_CMD_MOVE_FOCUS, (int)cfg_obj->state->lens_pos -
+                cfg_obj->af.curr_step_pos, FALSE);
+    cfg_obj->warm_start = 0;
+    mm_daemon_config_exp_reset(cfg_obj);
+
+    ts[START_PHASE_BUF] = mm_daemon_util_time_us();
     if (buf->stream_info->num_bufs)
         mm_daemon_config_isp_buf_enqueue(cfg_obj, stream_type);
+    ts[START_PHASE_VFE] = mm_daemon_util_time_us();
+    cfg_obj->settle_frames = cfg_obj->sdata->settle_frames;
     mm_daemon_config_vfe_roll_off(cfg_obj);
     mm_daemon_config_vfe_fov(cfg_obj);
     mm_daemon_config_vfe_main_scaler(cfg_obj);
@@ -2842,9 +3820,19 @@ static int mm_daemon_config_start_preview(mm_daemon_cfg_t *cfg_obj)
     mm_daemon_config_vfe_chroma_subs(cfg_obj);
     mm_daemon_config_vfe_sk_enhance(cfg_obj);
     mm_daemon_config_vfe_op_mode(cfg_obj);
+    ts[START_PHASE_STREAM] = mm_daemon_util_time_us();
     mm_daemon_config_isp_input_cfg(cfg_obj);
     mm_daemon_config_isp_stream_request(cfg_obj, stream_type);
+    ts[START_PHASE_MODE_WAIT] = mm_daemon_util_time_us();
+    rc = mm_daemon_config_mode_wait(cfg_obj, mode_seq);
+    if (rc < 0) {
+        mm_daemon_config_isp_stream_release(cfg_obj, stream_type);
+        return rc;
+    }
+    ts[START_PHASE_START] = mm_daemon_util_time_us();
     mm_daemon_config_isp_stream_cfg(cfg_obj, stream_type, START_STREAM);
+    ts[START_PHASE_MAX] = mm_daemon_util_time_us();
+    mm_daemon_config_start_timing(resume ? "preview resume" : "preview", ts);
     return 0;
 }
 
@@ -2854,19 +3842,36 @@ static void mm_daemon_config_stop_preview(mm_daemon_cfg_t *cfg_obj)
 
     mm_daemon_config_isp_stream_cfg(cfg_obj, stream_type, STOP_STREAM);
     mm_daemon_config_isp_stream_release(cfg_obj, stream_type);
-    if (cfg_obj->prep_snapshot)
+    /* The prepared flash goes to the capture, if one follows; the next
+       preview starts with AEC running either way */
+    if (cfg_obj->prep_snapshot) {
         mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
             LED_CMD_CONTROL, MSM_CAMERA_LED_OFF, FALSE);
-    mm_daemon_config_vfe_stop(cfg_obj);
+        cfg_obj->snap_flash = 1;
+    }
+    cfg_obj->prep_snapshot = 0;
+    cfg_obj->ae.pf.state = MM_PREFLASH_OFF;
+    if (mm_daemon_config_vfe_stop(cfg_obj) == 0)
+        cfg_obj->vfe_shadow.retained = 1;
 }
 
 static int mm_daemon_config_start_snapshot(mm_daemon_cfg_t *cfg_obj)
 {
     cam_stream_type_t stream_type = CAM_STREAM_TYPE_SNAPSHOT;
+    uint64_t ts[START_PHASE_MAX + 1];
+    uint32_t mode_seq;
+    int rc;
 
-    mm_daemon_util_subdev_cmd(cfg_obj->info[SNSR_DEV], SENSOR_CMD_SET_MODE,
-            mm_daemon_get_sensor_mode(cfg_obj), TRUE);
+    ts[START_PHASE_ISSUE] = mm_daemon_util_time_us();
+    cfg_obj->vfe_shadow.retained = 0;
+    mm_daemon_config_snapshot_exp(cfg_obj);
+    mm_daemon_config_hdr_start(cfg_obj);
+    mm_daemon_config_exp_reset(cfg_obj);
+    mode_seq = mm_daemon_util_subdev_cmd_async(cfg_obj->info[SNSR_DEV],
+            SENSOR_CMD_SET_MODE, mm_daemon_get_sensor_mode(cfg_obj));
 
+    /* snapshot buffers are enqueued as each stream is started */
+    ts[START_PHASE_BUF] = ts[START_PHASE_VFE] = mm_daemon_util_time_us();
     mm_daemon_config_vfe_roll_off(cfg_obj);
     mm_daemon_config_vfe_fov(cfg_obj);
     mm_daemon_config_vfe_main_scaler(cfg_obj);
@@ -2874,6 +3879,8 @@ static int mm_daemon_config_start_snapshot(mm_daemon_cfg_t *cfg_obj)
     mm_daemon_config_vfe_s2cbcr(cfg_obj);
     mm_daemon_config_vfe_axi(cfg_obj);
     mm_daemon_config_vfe_chroma_en(cfg_obj);
+    if (cfg_obj->snap_flash)
+        mm_daemon_config_preflash_color(cfg_obj);
     mm_daemon_config_vfe_color_cor(cfg_obj);
     mm_daemon_config_vfe_asf(cfg_obj);
     mm_daemon_config_vfe_white_balance(cfg_obj);
@@ -2883,10 +3890,11 @@ static int mm_daemon_config_start_snapshot(mm_daemon_cfg_t *cfg_obj)
     mm_daemon_config_vfe_rgb_gamma_chbank(cfg_obj, 4);
     mm_daemon_config_vfe_rgb_gamma_chbank(cfg_obj, 6);
     mm_daemon_config_vfe_rgb_gamma_chbank(cfg_obj, 12);
-    if (cfg_obj->prep_snapshot) {
+    if (cfg_obj->snap_flash) {
         mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
                 LED_CMD_CONTROL, MSM_CAMERA_LED_HIGH, FALSE);
-        cfg_obj->prep_snapshot = 0;
+        cfg_obj->snap_flash = 0;
+        cfg_obj->ae.pf.metered = 0;
     }
     mm_daemon_config_vfe_camif(cfg_obj);
     mm_daemon_config_vfe_demux(cfg_obj);
@@ -2894,13 +3902,29 @@ static int mm_daemon_config_start_snapshot(mm_daemon_cfg_t *cfg_obj)
     mm_daemon_config_vfe_chroma_subs(cfg_obj);
     mm_daemon_config_vfe_sk_enhance(cfg_obj);
     mm_daemon_config_vfe_op_mode(cfg_obj);
+    if (cfg_obj->hdr.active)
+        mm_daemon_config_vfe_frame_skip(cfg_obj);
+    ts[START_PHASE_STREAM] = mm_daemon_util_time_us();
     mm_daemon_config_isp_stream_request(cfg_obj, CAM_STREAM_TYPE_POSTVIEW);
     mm_daemon_config_isp_stream_request(cfg_obj, stream_type);
-    return mm_daemon_config_isp_stream_cfg(cfg_obj, stream_type, START_STREAM);
+    ts[START_PHASE_MODE_WAIT] = mm_daemon_util_time_us();
+    rc = mm_daemon_config_mode_wait(cfg_obj, mode_seq);
+    if (rc < 0) {
+        mm_daemon_config_isp_stream_release(cfg_obj,
+                CAM_STREAM_TYPE_POSTVIEW);
+        mm_daemon_config_isp_stream_release(cfg_obj, stream_type);
+        return rc;
+    }
+    ts[START_PHASE_START] = mm_daemon_util_time_us();
+    rc = mm_daemon_config_isp_stream_cfg(cfg_obj, stream_type, START_STREAM);
+    ts[START_PHASE_MAX] = mm_daemon_util_time_us();
+    mm_daemon_config_start_timing("snapshot", ts);
+    return rc;
 }
 
 static void mm_daemon_config_stop_snapshot(mm_daemon_cfg_t *cfg_obj)
 {
+    memset(&cfg_obj->hdr, 0, sizeof(cfg_obj->hdr));
     if (cfg_obj->prep_snapshot) {
         mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
                 LED_CMD_CONTROL, MSM_CAMERA_LED_OFF, FALSE);
@@ -2910,7 +3934,8 @@ static void mm_daemon_config_stop_snapshot(mm_daemon_cfg_t *cfg_obj)
             STOP_STREAM);
     mm_daemon_config_isp_stream_release(cfg_obj, CAM_STREAM_TYPE_POSTVIEW);
     mm_daemon_config_isp_stream_release(cfg_obj, CAM_STREAM_TYPE_SNAPSHOT);
-    mm_daemon_config_vfe_stop(cfg_obj);
+    if (mm_daemon_config_vfe_stop(cfg_obj) == 0)
+        cfg_obj->vfe_shadow.retained = 1;
 }
 
 static int mm_daemon_config_start_video(mm_daemon_cfg_t *cfg_obj)
@@ -2982,6 +4007,7 @@ static int mm_daemon_config_sk_pkt_map(mm_daemon_cfg_t *cfg_obj,
                     sizeof(parm_buffer_t));
             if (cfg_obj->parm_buf.cfg_buf == NULL)
                 break;
+            mm_daemon_config_aec_ctrl(cfg_obj);
             rc = 0;
         }
         break;
@@ -3019,8 +4045,9 @@ static int mm_daemon_config_sk_pkt_map(mm_daemon_cfg_t *cfg_obj,
         }
         buf->stream_info_mapped = 1;
         buf->fd = sk_pkt->fd;
-        if (cfg_obj->current_streams == 0) {
+        if (cfg_obj->current_streams == 0 && !cfg_obj->vfe_shadow.retained) {
             mm_daemon_config_vfe_reset(cfg_obj);
+            mm_daemon_config_vfe_shadow_reset(cfg_obj);
             mm_daemon_config_vfe_module(cfg_obj);
         }
         mm_daemon_config_stream_set(cfg_obj,
@@ -3131,14 +4158,262 @@ static int mm_daemon_config_sk_pkt_unmap(mm_daemon_cfg_t *cfg_obj,
     return 0;
 }
 
+/* The flicker search runs every MM_DAEMON_AB_INTERVAL frames once the
+   window is full. A frequency wins when its amplitude is at least
+   MM_DAEMON_AB_MIN_AMP (Q8 of the frame mean) and twice the other's,
+   and the mode switches after MM_DAEMON_AB_VOTES wins in a row.
+   While on 100 Hz, a band change of MM_DAEMON_AB_PROBE_AMP across a
+   line count change is taken as 60 Hz flicker. */
+#define MM_DAEMON_AB_INTERVAL 4
+#define MM_DAEMON_AB_MIN_AMP 6
+#define MM_DAEMON_AB_PROBE_AMP 3
+#define MM_DAEMON_AB_VOTES 2
+#define MM_DAEMON_AB_LOG_RUNS 100
+
+/* One cycle of cosine in 64 steps, Q10 */
+static const int16_t mm_daemon_ab_cos[64] = {
+    1024, 1019, 1004, 980, 946, 903, 851, 792,
+    724, 650, 569, 483, 392, 297, 200, 100,
+    0, -100, -200, -297, -392, -483, -569, -650,
+    -724, -792, -851, -903, -946, -980, -1004, -1019,
+    -1024, -1019, -1004, -980, -946, -903, -851, -792,
+    -724, -650, -569, -483, -392, -297, -200, -100,
+    0, 100, 200, 297, 392, 483, 569, 650,
+    724, 792, 851, 903, 946, 980, 1004, 1019,
+};
+
+/* Flicker phase step from one AEC region row to the next, Q16 cycles */
+static uint32_t mm_daemon_config_ab_row_step(
+        struct mm_sensor_stream_attr *attr, uint32_t hz)
+{
+    uint64_t ll_hz = (uint64_t)(attr->w + attr->blk_p) * hz;
+
+    return ((ll_hz * attr->h) << 16) / ((uint64_t)attr->pix_clk *
+            MM_DAEMON_AB_ROWS);
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_ab_dft
+ *
+ * DESCRIPTION: Single bin DFT of the buffered row profiles at flicker
+ *              frequency hz. Each sample is placed in time by its row and
+ *              frame, so the frame to frame phase step is the beat of the
+ *              flicker against the frame rate. The window mean of each row
+ *              is removed first so static scene detail drops out; flicker
+ *              locked to the frame rate drops out with it.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @hz     : flicker frequency
+ *   @line   : line count the window was exposed with
+ *   @mean   : window mean of each row
+ *
+ * RETURN     : squared magnitude of the bin
+ *==========================================================================*/
+static uint64_t mm_daemon_config_ab_dft(mm_daemon_cfg_t *cfg_obj,
+        uint32_t hz, uint16_t line, const int16_t *mean)
+{
+    struct mm_daemon_ab_info *ab = &cfg_obj->ab;
+    struct mm_sensor_stream_attr *attr =
+            cfg_obj->sdata->attr[mm_daemon_get_sensor_mode(cfg_obj)];
+    uint64_t ll_hz = (uint64_t)(attr->w + attr->blk_p) * hz;
+    uint32_t fl = attr->h + attr->blk_l;
+    uint32_t row_step, frm_step, phase;
+    int32_t re = 0, im = 0;
+    const int16_t *x;
+    int f, r, idx, v;
+
+    if (line > fl)
+        fl = line;
+
+    /* Phase steps in Q16 cycles */
+    row_step = mm_daemon_config_ab_row_step(attr, hz);
+    frm_step = ((ll_hz * fl) << 16) / attr->pix_clk;
+
+    for (f = 0; f < MM_DAEMON_AB_FRAMES; f++) {
+        /* oldest first */
+        x = ab->rows[(ab->head + f) % MM_DAEMON_AB_FRAMES];
+        phase = f * frm_step;
+        for (r = 0; r < MM_DAEMON_AB_ROWS; r++) {
+            idx = (phase >> 10) & 63;
+            v = x[r] - mean[r];
+            re += v * mm_daemon_ab_cos[idx];
+            im -= v * mm_daemon_ab_cos[(idx - 16) & 63];
+            phase += row_step;
+        }
+    }
+    return (int64_t)re * re + (int64_t)im * im;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_ab_probe
+ *
+ * DESCRIPTION: Looks for 60 Hz flicker while on 100 Hz without leaving
+ *              it. At 30 fps 120 Hz flicker is locked to the frame rate,
+ *              so its bands stand still and drop out of the DFT with the
+ *              scene detail. They do move with the exposure, though: when
+ *              the line count changes, the window mean is compared with
+ *              the one from the previous line count, and a difference
+ *              that is mostly a sinusoid at the 120 Hz row frequency is
+ *              60 Hz flicker. Scene changes spread over all frequencies.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @line   : line count the window was exposed with
+ *   @mean   : window mean of each row
+ *
+ * RETURN     : TRUE if 60 Hz flicker was seen
+ *==========================================================================*/
+static uint8_t mm_daemon_config_ab_probe(mm_daemon_cfg_t *cfg_obj,
+        uint16_t line, const int16_t *mean)
+{
+    struct mm_daemon_ab_info *ab = &cfg_obj->ab;
+    struct mm_sensor_stream_attr *attr =
+            cfg_obj->sdata->attr[mm_daemon_get_sensor_mode(cfg_obj)];
+    uint32_t row_step = mm_daemon_config_ab_row_step(attr, 120);
+    uint32_t phase = 0;
+    uint16_t ref_line = ab->ref_line;
+    int32_t re = 0, im = 0;
+    uint64_t e = 0, bin, min_e;
+    int r, idx, d;
+
+    for (r = 0; r < MM_DAEMON_AB_ROWS; r++) {
+        idx = (phase >> 10) & 63;
+        d = mean[r] - ab->ref_mean[r];
+        re += d * mm_daemon_ab_cos[idx];
+        im -= d * mm_daemon_ab_cos[(idx - 16) & 63];
+        e += d * d;
+        phase += row_step;
+    }
+    memcpy(ab->ref_mean, mean, sizeof(ab->ref_mean));
+    ab->ref_line = line;
+    if (!ref_line || ref_line == line)
+        return FALSE;
+
+    /* A sinusoid of amplitude a (Q8) gives a bin of about a * rows * 512
+       and puts rows << 19 times its energy in the bin; at least 3/4 of
+       the change has to be in it. */
+    bin = (int64_t)re * re + (int64_t)im * im;
+    min_e = (uint64_t)MM_DAEMON_AB_PROBE_AMP * MM_DAEMON_AB_ROWS * 512;
+    min_e *= min_e;
+    return bin >= min_e &&
+            4 * bin >= 3 * ((e * MM_DAEMON_AB_ROWS) << 19);
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_ab_detect
+ *
+ * DESCRIPTION: Auto anti-banding. Buffers the normalized AEC row profile
+ *              and periodically compares the 100 and 120 Hz flicker bins.
+ *              The window restarts whenever the line count changes, since
+ *              that shifts the band phase.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @stats  : 16x16 AEC region luma
+ *   @mean   : average region luma
+ *   @line   : line count the stats were exposed with
+ *==========================================================================*/
+static void mm_daemon_config_ab_detect(mm_daemon_cfg_t *cfg_obj,
+        const uint16_t *stats, uint32_t mean, uint16_t line)
+{
+    struct mm_daemon_ab_info *ab = &cfg_obj->ab;
+    struct mm_sensor_stream_attr *attr =
+            cfg_obj->sdata->attr[mm_daemon_get_sensor_mode(cfg_obj)];
+    int16_t *row;
+    int16_t row_mean[MM_DAEMON_AB_ROWS];
+    uint64_t e100, e120, min_e, start;
+    uint32_t sum;
+    int32_t acc;
+    uint16_t hz;
+    uint8_t probed;
+    int r, c;
+
+    if (ab->parm != CAM_ANTIBANDING_MODE_AUTO || !mean || !attr ||
+            !attr->pix_clk)
+        return;
+
+    if (line != ab->line) {
+        ab->line = line;
+        ab->count = 0;
+    }
+
+    row = ab->rows[ab->head];
+    for (r = 0; r < MM_DAEMON_AB_ROWS; r++) {
+        sum = 0;
+        for (c = 0; c < MM_DAEMON_AB_ROWS; c++)
+            sum += *stats++;
+        row[r] = (int32_t)((sum << 8) / (mean * MM_DAEMON_AB_ROWS)) - 256;
+    }
+    ab->head = (ab->head + 1) % MM_DAEMON_AB_FRAMES;
+    if (ab->count < MM_DAEMON_AB_FRAMES)
+        ab->count++;
+
+    if (ab->count < MM_DAEMON_AB_FRAMES ||
+            ++ab->skip < MM_DAEMON_AB_INTERVAL)
+        return;
+    ab->skip = 0;
+
+    start = mm_daemon_util_time_us();
+    for (r = 0; r < MM_DAEMON_AB_ROWS; r++) {
+        acc = 0;
+        for (c = 0; c < MM_DAEMON_AB_FRAMES; c++)
+            acc += ab->rows[c][r];
+        row_mean[r] = acc / MM_DAEMON_AB_FRAMES;
+    }
+    e100 = mm_daemon_config_ab_dft(cfg_obj, 100, line, row_mean);
+    e120 = mm_daemon_config_ab_dft(cfg_obj, 120, line, row_mean);
+    probed = ab->hz == 100 &&
+            mm_daemon_config_ab_probe(cfg_obj, line, row_mean);
+    mm_daemon_util_proc_time(&ab->proc, start);
+    if (ab->proc.runs == MM_DAEMON_AB_LOG_RUNS) {
+        ALOGD("%s: avg %u us, max %u us, %d Hz", __FUNCTION__,
+                (uint32_t)(ab->proc.us_total / ab->proc.runs),
+                ab->proc.us_max, ab->hz / 2);
+        memset(&ab->proc, 0, sizeof(ab->proc));
+    }
+
+    if (probed) {
+        ALOGI("%s: 60 Hz flicker seen across an exposure change",
+                __FUNCTION__);
+        ab->hz = 120;
+        ab->votes = 0;
+        return;
+    }
+
+    /* A rolling sinusoid of amplitude a (Q8) gives a bin of about
+       a * frames * rows * 512 */
+    min_e = (uint64_t)MM_DAEMON_AB_MIN_AMP * MM_DAEMON_AB_FRAMES *
+            MM_DAEMON_AB_ROWS * 512;
+    min_e *= min_e;
+    if (e100 >= min_e && e100 >= 4 * e120)
+        hz = 100;
+    else if (e120 >= min_e && e120 >= 4 * e100)
+        hz = 120;
+    else
+        hz = 0;
+
+    if (!hz || hz == ab->hz) {
+        ab->votes = 0;
+    } else if (hz != ab->cand_hz) {
+        ab->cand_hz = hz;
+        ab->votes = 1;
+    } else if (++ab->votes >= MM_DAEMON_AB_VOTES) {
+        ALOGI("%s: %d Hz flicker detected", __FUNCTION__, hz / 2);
+        ab->hz = hz;
+        ab->ref_line = 0;
+        ab->votes = 0;
+    }
+}
+
 static void mm_daemon_config_auto_exposure(mm_daemon_cfg_t *cfg_obj,
         uint32_t buf_idx)
 {
     mm_daemon_stats_buf_info *stat = cfg_obj->stats_buf[MSM_ISP_STATS_AEC];
     enum mm_sensor_stream_type mode = mm_daemon_get_sensor_mode(cfg_obj);
     struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    struct mm_daemon_aec_ctrl *ctrl = &cfg_obj->ae.ctrl;
     int i;
-    int32_t led_mode;
     int32_t stat_val = 0;
     int16_t gain_adj = 0;
     int16_t line_adj = 0;
@@ -3147,35 +4422,70 @@ static void mm_daemon_config_auto_exposure(mm_daemon_cfg_t *cfg_obj,
     uint16_t max_line_adj = 100;
     uint16_t low_th = aec_cfg->target[mode].low_th;
     uint16_t high_th = aec_cfg->target[mode].high_th;
-    uint16_t target = aec_cfg->target[mode].tgt;
+    uint16_t target = ctrl->target[mode];
+    uint16_t def_line, period;
     uint8_t flash_needed = FALSE;
     uint16_t work_buf[256];
 
-    if (cfg_obj->info[SNSR_DEV]->state != STATE_POLL ||
-            mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_AEC_LOCK) ||
+    if (cfg_obj->info[SNSR_DEV]->state != STATE_POLL || ctrl->lock ||
+            cfg_obj->hdr.active || cfg_obj->exp_hist.in_flight ||
             !aec_cfg)
         return;
 
-    led_mode = mm_daemon_config_get_parm(cfg_obj,
-            CAM_INTF_PARM_LED_MODE);
-
     memcpy(work_buf, stat->buf_data[buf_idx].vaddr, 512);
     memset(stat->buf_data[buf_idx].vaddr, 0, stat->buf_data[buf_idx].len);
     for (i = 0; i < 256; i++)
         stat_val += work_buf[i];
     stat_val /= i;
 
+    /* Exposure holds at ambient while the pre-flash is metered */
+    if (cfg_obj->ae.pf.state != MM_PREFLASH_OFF) {
+        mm_daemon_config_preflash(cfg_obj, stat_val);
+        if (cfg_obj->ae.pf.state == MM_PREFLASH_DONE)
+            cfg_obj->ae.meta.is_prep_snapshot_done_valid = TRUE;
+        cfg_obj->ae.meta.is_ae_params_valid = TRUE;
+        return;
+    }
+    cfg_obj->ae.luma = stat_val;
+    mm_daemon_config_ab_detect(cfg_obj, work_buf, stat_val, line);
+
     if (cfg_obj->ae.frm_cnt < aec_cfg->frame_skip) {
         cfg_obj->ae.frm_cnt++;
         return;
     } else
         cfg_obj->ae.frm_cnt = 0;
 
-    if (stat_val < (target - low_th) || stat_val > (target + high_th)) {
+    /* AEC steps the exposure it asked for, not the quantized one, so
+       gain made up for a shorter line is recomputed once the line count
+       moves. Anything else writing the exposure restarts from there. */
+    if (cfg_obj->ae.b_line && cfg_obj->ae.q_gain == gain &&
+            cfg_obj->ae.q_line == line) {
+        gain = cfg_obj->ae.b_gain;
+        line = cfg_obj->ae.b_line;
+    }
+
+    /* Gain is fine tuned at the largest flicker free line count, half
+       the usual one when deblurring. A fixed ISO leaves only lines. */
+    def_line = aec_cfg->default_line[mode];
+    if (ctrl->deblur)
+        def_line /= 2;
+    period = mm_daemon_config_ab_period(cfg_obj, mode);
+    if (period && def_line >= period)
+        def_line -= def_line % period;
+    if (ctrl->iso_fixed)
+        gain = ctrl->iso_gain;
+
+    if (stat_val >= (target - low_th) && stat_val <= (target + high_th)) {
+        if (cfg_obj->state && mode == PREVIEW) {
+            cfg_obj->state->gain = gain;
+            cfg_obj->state->line = line;
+            cfg_obj->state->valid |= MM_DAEMON_3A_STATE_AE;
+        }
+    } else {
         gain_adj = (int32_t)(target - stat_val) / 100;
         if ((gain_adj > 0 && gain == aec_cfg->gain_max) ||
                 (gain_adj < 0 && gain == aec_cfg->gain_min) ||
-                (line != aec_cfg->default_line[mode])) {
+                (line != def_line) || ctrl->iso_fixed) {
             line_adj = gain_adj * aec_cfg->line_mult;
             if (line_adj > max_line_adj)
                 line_adj = max_line_adj;
@@ -3185,11 +4495,9 @@ static void mm_daemon_config_auto_exposure(mm_daemon_cfg_t *cfg_obj,
         }
 
         if (line_adj) {
-            if ((line > aec_cfg->default_line[mode] && line +
-                    line_adj < aec_cfg->default_line[mode]) ||
-                    (line < aec_cfg->default_line[mode] &&
-                    line + line_adj > aec_cfg->default_line[mode]))
-                line = aec_cfg->default_line[mode];
+            if ((line > def_line && line + line_adj < def_line) ||
+                    (line < def_line && line + line_adj > def_line))
+                line = def_line;
             else if (line + line_adj < aec_cfg->line_min)
                 line = aec_cfg->line_min;
             else if (line + line_adj > aec_cfg->line_max)
@@ -3197,28 +4505,37 @@ static void mm_daemon_config_auto_exposure(mm_daemon_cfg_t *cfg_obj,
             else
                 line += line_adj;
         } else {
-            if (line == aec_cfg->default_line[mode]) {
+            if (line == def_line) {
                 if (gain + gain_adj < aec_cfg->gain_min)
                     gain = aec_cfg->gain_min;
                 else if (gain + gain_adj > aec_cfg->gain_max)
                     gain = aec_cfg->gain_max;
                 else
                     gain += gain_adj;
-            } else if (line > aec_cfg->default_line[mode]) {
-                if (line + line_adj < aec_cfg->default_line[mode])
-                    line = aec_cfg->default_line[mode];
+            } else if (line > def_line) {
+                if (line + line_adj < def_line)
+                    line = def_line;
                 else
                     line += line_adj;
             } else {
-                if (line + line_adj > aec_cfg->default_line[mode])
-                    line = aec_cfg->default_line[mode];
+                if (line + line_adj > def_line)
+                    line = def_line;
                 else
                     line += line_adj;
             }
         }
     }
 
-    if (gain >= aec_cfg->flash_threshold && led_mode == CAM_FLASH_MODE_AUTO)
+    /* A fixed ISO has no gain to absorb the remainder */
+    cfg_obj->ae.b_gain = gain;
+    cfg_obj->ae.b_line = line;
+    line = mm_daemon_config_ab_quantize(cfg_obj, mode, line,
+            ctrl->iso_fixed ? NULL : &gain);
+    cfg_obj->ae.q_gain = gain;
+    cfg_obj->ae.q_line = line;
+
+    if (gain >= aec_cfg->flash_threshold &&
+            ctrl->led_mode == CAM_FLASH_MODE_AUTO)
         flash_needed = TRUE;
 
     if (mm_daemon_config_exp_gain(cfg_obj, gain, line, FALSE)) {
@@ -3230,113 +4547,798 @@ static void mm_daemon_config_auto_exposure(mm_daemon_cfg_t *cfg_obj,
     cfg_obj->ae.meta.is_ae_params_valid = TRUE;
 }
 
+static void mm_daemon_config_af_reset(mm_daemon_cfg_t *cfg_obj)
+{
+    uint8_t curr_step_pos = cfg_obj->af.curr_step_pos;
+
+    memset(&cfg_obj->af, 0, sizeof(struct mm_daemon_af_info));
+    cfg_obj->af.curr_step_pos = curr_step_pos;
+    if (curr_step_pos != 0)
+        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
+                ACT_CMD_DEFAULT_FOCUS, 0, FALSE);
+    mm_daemon_config_stats(cfg_obj, BIT(MSM_ISP_STATS_AF), 1);
+}
+
 static void mm_daemon_config_auto_focus_start(mm_daemon_cfg_t *cfg_obj)
 {
     if (!cfg_obj->info[ACT_DEV])
         return;
 
-    if (cfg_obj->ae.flash_needed || (mm_daemon_config_get_parm(cfg_obj,
-            CAM_INTF_PARM_LED_MODE) == CAM_FLASH_MODE_ON))
+    /* Continuous AF already owns the lens, report where it stands */
+    if (cfg_obj->caf.active) {
+        if (cfg_obj->af.state == MM_FOCUS_MONITOR) {
+            cfg_obj->af.meta.state = cfg_obj->caf.focused ?
+                    CAM_AF_FOCUSED : CAM_AF_NOT_FOCUSED;
+            cfg_obj->af.meta.is_focus_valid = 1;
+        }
+        return;
+    }
+
+    if (cfg_obj->ae.flash_needed ||
+            cfg_obj->ae.ctrl.led_mode == CAM_FLASH_MODE_ON)
         mm_daemon_config_prepare_snapshot(cfg_obj, 1);
 
-    if (cfg_obj->af.curr_step_pos != 0) {
-        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
-                ACT_CMD_DEFAULT_FOCUS, 0, FALSE);
-        memset(&cfg_obj->af, 0, sizeof(struct mm_daemon_af_info));
-    }
-    mm_daemon_config_stats(cfg_obj, BIT(MSM_ISP_STATS_AF), 1);
+    mm_daemon_config_af_reset(cfg_obj);
 }
 
 static void mm_daemon_config_auto_focus_stop(mm_daemon_cfg_t *cfg_obj)
 {
-    mm_daemon_config_stats(cfg_obj, BIT(MSM_ISP_STATS_AF), 0);
+    if (!cfg_obj->caf.active)
+        mm_daemon_config_stats(cfg_obj, BIT(MSM_ISP_STATS_AF), 0);
     mm_daemon_config_prepare_snapshot(cfg_obj, 0);
 }
 
-static void mm_daemon_config_auto_focus(mm_daemon_cfg_t *cfg_obj,
+/* The AF stats buffer holds one word per window of the grid programmed
+   at 0x53C, with the focus value in bits [23:8] over a status and count
+   byte. The middle windows carry more weight so the subject, not the
+   background, drives the search. A lens move that times out is retried
+   MM_DAEMON_AF_MOVE_RETRIES times before the search fails. */
+#define MM_DAEMON_AF_SETTLE_FRAMES 1
+#define MM_DAEMON_AF_MOVE_TIMEOUT 8
+#define MM_DAEMON_AF_MOVE_RETRIES 2
+#define MM_DAEMON_AF_FV(win) (((win) >> 8) & 0xFFFF)
+#define MM_DAEMON_AF_INNER(x, k) ((x) >= (k) / 3 && (x) < (k) - (k) / 3)
+#define MM_DAEMON_AF_SAMPLED(af, pos) ((af)->sampled & (1ULL << (pos)))
+
+/* While monitoring, continuous AF looks at one stats frame in
+   MM_DAEMON_CAF_INTERVAL and rescans after MM_DAEMON_CAF_DROPS low
+   sharpness samples once the scene has stopped changing. */
+#define MM_DAEMON_CAF_INTERVAL 3
+#define MM_DAEMON_CAF_DROPS 3
+
+static uint32_t mm_daemon_config_af_focus_value(mm_daemon_buf_data *buf)
+{
+    uint32_t *win = (uint32_t *)buf->vaddr;
+    uint32_t k = MM_DAEMON_AF_GRID;
+    uint64_t sum = 0, wsum = 0;
+    uint32_t i, w;
+
+    if (buf->len < MM_DAEMON_STATS_AF_LEN)
+        return 0;
+
+    for (i = 0; i < k * k; i++) {
+        w = (1 + MM_DAEMON_AF_INNER(i / k, k)) *
+                (1 + MM_DAEMON_AF_INNER(i % k, k));
+        sum += (uint64_t)MM_DAEMON_AF_FV(win[i]) * w;
+        wsum += w;
+    }
+    return (uint32_t)(sum / wsum);
+}
+
+static void mm_daemon_config_af_move(mm_daemon_cfg_t *cfg_obj, uint8_t pos)
+{
+    struct mm_daemon_af_info *af = &cfg_obj->af;
+
+    af->target_pos = pos;
+    if (pos == af->curr_step_pos) {
+        af->frm_cnt = MM_DAEMON_AF_SETTLE_FRAMES;
+        return;
+    }
+    af->frm_cnt = 0;
+    af->moves++;
+    if (cfg_obj->caf.active)
+        cfg_obj->caf.moves++;
+    mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV], ACT_CMD_MOVE_FOCUS,
+            (int)pos - af->curr_step_pos, FALSE);
+}
+
+/* Next unsampled neighbour of the best position, or -1 once the peak is
+   bracketed on both sides. Moving best_pos after each probe turns this
+   into a hill climb that follows the curve upward. */
+static int mm_daemon_config_af_probe(struct mm_daemon_af_info *af,
+        uint32_t total_steps)
+{
+    int pos;
+
+    pos = af->best_pos + af->fine_step;
+    if (pos <= (int)total_steps && !MM_DAEMON_AF_SAMPLED(af, pos))
+        return pos;
+    pos = af->best_pos - af->fine_step;
+    if (pos >= 0 && !MM_DAEMON_AF_SAMPLED(af, pos))
+        return pos;
+    return -1;
+}
+
+/* Fit a parabola through the best sample and its two neighbours and
+   return the step closest to its vertex. */
+static uint8_t mm_daemon_config_af_fit(struct mm_daemon_af_info *af,
+        uint32_t total_steps)
+{
+    int pos = af->best_pos;
+    int h = af->fine_step;
+    float fa, fb, fc, denom, offset;
+
+    if (pos - h < 0 || pos + h > (int)total_steps ||
+            !MM_DAEMON_AF_SAMPLED(af, pos - h) ||
+            !MM_DAEMON_AF_SAMPLED(af, pos + h))
+        return pos;
+
+    fa = af->fv[pos - h];
+    fb = af->fv[pos];
+    fc = af->fv[pos + h];
+    denom = fa - 2 * fb + fc;
+    if (denom >= 0)
+        return pos;
+
+    offset = h * (fa - fc) / (2 * denom);
+    if (offset > h)
+        offset = h;
+    else if (offset < -h)
+        offset = -h;
+
+    return pos + (int)(offset + (offset < 0 ? -0.5f : 0.5f));
+}
+
+static void mm_daemon_config_caf_lock(mm_daemon_cfg_t *cfg_obj, uint32_t fv)
+{
+    struct mm_daemon_caf_info *caf = &cfg_obj->caf;
+
+    memset(caf->hist, 0, sizeof(caf->hist));
+    caf->focused = cfg_obj->af.best_fv != 0;
+    caf->ref_fv = fv;
+    caf->ref_luma = cfg_obj->ae.luma;
+    caf->drops = 0;
+    caf->skip = 0;
+    caf->scene_change = 0;
+    cfg_obj->af.state = MM_FOCUS_MONITOR;
+}
+
+/* A scene change restarts the full sweep. Otherwise the lens climbs
+   from where it is in single steps so refocusing does not hunt. */
+static void mm_daemon_config_caf_rescan(mm_daemon_cfg_t *cfg_obj,
+        uint32_t fv)
+{
+    struct mm_daemon_caf_info *caf = &cfg_obj->caf;
+    struct mm_daemon_af_info *af = &cfg_obj->af;
+    uint8_t pos = af->curr_step_pos;
+    uint8_t coarse_step = af->coarse_step;
+
+    if (caf->scene_change)
+        mm_daemon_config_af_reset(cfg_obj);
+    else {
+        memset(af, 0, sizeof(struct mm_daemon_af_info));
+        af->curr_step_pos = pos;
+        af->target_pos = pos;
+        af->frm_cnt = MM_DAEMON_AF_SETTLE_FRAMES;
+        af->coarse_step = coarse_step;
+        af->fine_step = 1;
+        af->fv[pos] = fv;
+        af->sampled = 1ULL << pos;
+        af->best_fv = fv;
+        af->best_pos = pos;
+        af->state = MM_FOCUS_FINE;
+    }
+    caf->rescans++;
+    caf->focused = 0;
+    af->meta.state = CAM_AF_SCANNING;
+}
+
+/* Returns 1 when a rescan was started */
+static int mm_daemon_config_caf_monitor(mm_daemon_cfg_t *cfg_obj, uint32_t fv)
+{
+    struct mm_daemon_caf_info *caf = &cfg_obj->caf;
+    uint32_t prev = caf->hist[(caf->hist_idx + MM_DAEMON_CAF_HIST - 1) %
+            MM_DAEMON_CAF_HIST];
+    int luma_diff = (int)cfg_obj->ae.luma - caf->ref_luma;
+
+    caf->hist[caf->hist_idx] = fv;
+    caf->hist_idx = (caf->hist_idx + 1) % MM_DAEMON_CAF_HIST;
+
+    if (abs(luma_diff) > caf->ref_luma / 4)
+        caf->scene_change = 1;
+
+    if (!caf->scene_change && fv >= caf->ref_fv - caf->ref_fv / 4) {
+        caf->drops = 0;
+        if (fv > caf->ref_fv)
+            caf->ref_fv = (caf->ref_fv * 7 + fv) / 8;
+        return 0;
+    }
+
+    if (caf->drops < MM_DAEMON_CAF_DROPS) {
+        caf->drops++;
+        return 0;
+    }
+
+    /* Hold off while sharpness is still moving between samples */
+    if (fv > prev + prev / 8 || fv + fv / 8 < prev)
+        return 0;
+
+    mm_daemon_config_caf_rescan(cfg_obj, fv);
+    return 1;
+}
+
+/* The lens stopped answering; end the search unfocused */
+static void mm_daemon_config_af_fail(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_af_info *af = &cfg_obj->af;
+
+    ALOGE("%s: giving up after %u frames, %u moves", __FUNCTION__,
+            af->frames, af->moves);
+    af->best_fv = 0;
+    af->meta.state = CAM_AF_NOT_FOCUSED;
+    af->meta.is_focus_valid = 1;
+    if (cfg_obj->caf.active)
+        mm_daemon_config_caf_lock(cfg_obj, 0);
+    else
+        mm_daemon_config_auto_focus_stop(cfg_obj);
+}
+
+static void mm_daemon_config_af_process(mm_daemon_cfg_t *cfg_obj,
         uint32_t buf_idx)
 {
     struct mm_daemon_act_params *act;
-    uint32_t total_steps;
-    int num_step = 0;
-    int focus_dir = 0;
-    uint16_t curr_stat_val;
-    uint8_t work_buf[3];
-    uint8_t frame_wait_count = 4;
+    struct mm_daemon_af_info *af = &cfg_obj->af;
     mm_daemon_stats_buf_info *stat = cfg_obj->stats_buf[MSM_ISP_STATS_AF];
+    mm_daemon_buf_data *buf = &stat->buf_data[buf_idx];
+    uint32_t total_steps;
+    uint32_t fv;
+    int pos;
 
     if (!cfg_obj->info[ACT_DEV] || (cfg_obj->prep_snapshot &&
-            !mm_daemon_config_get_parm(cfg_obj,
-            CAM_INTF_PARM_AEC_LOCK)) || (cfg_obj->info[ACT_DEV]->state !=
+            !cfg_obj->ae.ctrl.lock) || (cfg_obj->info[ACT_DEV]->state !=
             STATE_POLL))
         return;
 
-    if (cfg_obj->af.state != MM_FOCUS_INIT) {
-        if (cfg_obj->af.frm_cnt < frame_wait_count) {
-            cfg_obj->af.frm_cnt++;
-            return;
-        } else
-            cfg_obj->af.frm_cnt = 0;
+    if (af->state == MM_FOCUS_MONITOR &&
+            ++cfg_obj->caf.skip < MM_DAEMON_CAF_INTERVAL)
+        return;
+    cfg_obj->caf.skip = 0;
+
+    af->frames++;
+    if (af->frm_cnt < MM_DAEMON_AF_SETTLE_FRAMES ||
+            af->curr_step_pos != af->target_pos) {
+        if (++af->frm_cnt >= MM_DAEMON_AF_MOVE_TIMEOUT) {
+            ALOGE("%s: lens did not reach step %d", __FUNCTION__,
+                    af->target_pos);
+            af->target_pos = af->curr_step_pos;
+            if (++af->move_fails > MM_DAEMON_AF_MOVE_RETRIES) {
+                memset(buf->vaddr, 0, buf->len);
+                mm_daemon_config_af_fail(cfg_obj);
+                return;
+            }
+        }
+        memset(buf->vaddr, 0, buf->len);
+        return;
     }
+    if (af->frm_cnt < MM_DAEMON_AF_MOVE_TIMEOUT)
+        af->move_fails = 0;
 
-    memcpy(work_buf, stat->buf_data[buf_idx].vaddr, 3);
-    memset(stat->buf_data[buf_idx].vaddr, 0, stat->buf_data[buf_idx].len);
-    curr_stat_val = (work_buf[2] << 8) | work_buf[1];
-    if (curr_stat_val > cfg_obj->af.focus_stat_val) {
-        cfg_obj->af.focus_stat_val = curr_stat_val;
-        cfg_obj->af.focus_step_pos = cfg_obj->af.curr_step_pos;
-    }
+    fv = mm_daemon_config_af_focus_value(buf);
+    memset(buf->vaddr, 0, buf->len);
 
     act = (struct mm_daemon_act_params *)cfg_obj->sdata->act_params;
     total_steps = act->act_info->af_tuning_params.total_steps;
-    num_step = cfg_obj->af.focus_step_pos - cfg_obj->af.curr_step_pos;
-    if (num_step > 0)
-        focus_dir = MSM_ACTUATOR_MOVE_SIGNED_NEAR;
-    else if (num_step < 0)
-        focus_dir = MSM_ACTUATOR_MOVE_SIGNED_FAR;
+    if (total_steps >= MM_DAEMON_AF_MAX_POS)
+        total_steps = MM_DAEMON_AF_MAX_POS - 1;
+
+    pos = af->curr_step_pos;
+    af->fv[pos] = fv;
+    af->sampled |= 1ULL << pos;
+    if (fv > af->best_fv) {
+        af->best_fv = fv;
+        af->best_pos = pos;
+    }
 
-    switch (cfg_obj->af.state) {
+    switch (af->state) {
     case MM_FOCUS_INIT:
-        cfg_obj->af.state = MM_FOCUS_SCANNING;
-        cfg_obj->af.incr_step = total_steps / 2;
-        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV], ACT_CMD_MOVE_FOCUS,
-                cfg_obj->af.incr_step, FALSE);
-        break;
+        af->coarse_step = total_steps / 8;
+        if (af->coarse_step < 2)
+            af->coarse_step = 2;
+        af->fine_step = af->coarse_step / 2;
+        af->state = MM_FOCUS_SCANNING;
+        /* fall through */
     case MM_FOCUS_SCANNING:
-        cfg_obj->af.incr_step /= 2;
-        if (cfg_obj->af.incr_step == 1)
-            cfg_obj->af.state = MM_FOCUS_SCANNING_DONE;
-
-        mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
-                ACT_CMD_MOVE_FOCUS, cfg_obj->af.incr_step * focus_dir, FALSE);
+        /* Stop the sweep early once the curve has clearly turned over */
+        if (pos + af->coarse_step <= (int)total_steps &&
+                (pos < af->best_pos + 2 * af->coarse_step ||
+                fv > af->best_fv - af->best_fv / 4)) {
+            mm_daemon_config_af_move(cfg_obj, pos + af->coarse_step);
+            break;
+        }
+        af->state = MM_FOCUS_FINE;
+        /* fall through */
+    case MM_FOCUS_FINE:
+        pos = mm_daemon_config_af_probe(af, total_steps);
+        if (pos < 0) {
+            af->state = MM_FOCUS_SCANNING_DONE;
+            pos = mm_daemon_config_af_fit(af, total_steps);
+        }
+        mm_daemon_config_af_move(cfg_obj, pos);
         break;
     case MM_FOCUS_SCANNING_DONE:
-        if (cfg_obj->af.curr_step_pos == cfg_obj->af.focus_step_pos) {
-            cfg_obj->af.meta.state = CAM_AF_FOCUSED;
+        /* Fall back to the best sample if the fit overshot the peak */
+        if (pos != af->best_pos && fv < af->best_fv - af->best_fv / 8) {
+            mm_daemon_config_af_move(cfg_obj, af->best_pos);
+            break;
+        }
+        af->meta.state = af->best_fv ? CAM_AF_FOCUSED : CAM_AF_NOT_FOCUSED;
+        if (cfg_obj->state && af->best_fv) {
+            cfg_obj->state->lens_pos = pos;
+            cfg_obj->state->valid |= MM_DAEMON_3A_STATE_AF;
+        }
+        ALOGI("%s: step %d in %u frames, %u moves", __FUNCTION__, pos,
+                af->frames, af->moves);
+        if (cfg_obj->caf.active)
+            mm_daemon_config_caf_lock(cfg_obj, fv);
+        else
             mm_daemon_config_auto_focus_stop(cfg_obj);
-        } else
-            mm_daemon_util_subdev_cmd(cfg_obj->info[ACT_DEV],
-                    ACT_CMD_MOVE_FOCUS, cfg_obj->af.focus_step_pos -
-                    cfg_obj->af.curr_step_pos, FALSE);
+        break;
+    case MM_FOCUS_MONITOR:
+        if (!mm_daemon_config_caf_monitor(cfg_obj, fv))
+            return;
+        if (af->state == MM_FOCUS_FINE) {
+            pos = mm_daemon_config_af_probe(af, total_steps);
+            if (pos >= 0)
+                mm_daemon_config_af_move(cfg_obj, pos);
+        }
         break;
     default:
         break;
     }
-    cfg_obj->af.meta.is_focus_valid = 1;
+    af->meta.is_focus_valid = 1;
+}
+
+/* Continuous AF runs on every stats frame, so its cost is measured per
+   frame and reported when it is switched off. */
+static void mm_daemon_config_auto_focus(mm_daemon_cfg_t *cfg_obj,
+        uint32_t buf_idx)
+{
+    struct mm_daemon_caf_info *caf = &cfg_obj->caf;
+    uint64_t start;
+
+    if (!caf->active) {
+        mm_daemon_config_af_process(cfg_obj, buf_idx);
+        return;
+    }
+
+    start = mm_daemon_util_time_us();
+    mm_daemon_config_af_process(cfg_obj, buf_idx);
+    mm_daemon_util_proc_time(&caf->proc, start);
+}
+
+static void mm_daemon_config_caf_update(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_daemon_caf_info *caf = &cfg_obj->caf;
+    uint8_t mode = (uint8_t)mm_daemon_config_get_parm(cfg_obj,
+            CAM_INTF_PARM_FOCUS_MODE);
+    uint8_t enable = FALSE;
+
+    if (cfg_obj->info[ACT_DEV] &&
+            (cfg_obj->enabled_stats & BIT(MSM_ISP_STATS_AEC)) &&
+            (mode == CAM_FOCUS_MODE_CONTINOUS_VIDEO ||
+            mode == CAM_FOCUS_MODE_CONTINOUS_PICTURE))
+        enable = TRUE;
+
+    if (enable == caf->active && (!enable ||
+            (cfg_obj->enabled_stats & BIT(MSM_ISP_STATS_AF))))
+        return;
+
+    if (enable) {
+        memset(caf, 0, sizeof(struct mm_daemon_caf_info));
+        mm_daemon_config_af_reset(cfg_obj);
+        caf->active = TRUE;
+    } else {
+        ALOGI("%s: %u frames, %u rescans, %u moves, avg %u us, max %u us",
+                __FUNCTION__, caf->proc.runs, caf->rescans, caf->moves,
+                caf->proc.runs ?
+                (uint32_t)(caf->proc.us_total / caf->proc.runs) : 0,
+                caf->proc.us_max);
+        caf->active = FALSE;
+        mm_daemon_config_auto_focus_stop(cfg_obj);
+    }
+}
+
+/* AWB stats hold one record per region of a 16x16 grid: the sums of Y,
+   Cb and Cr over the pixels that fell inside the white zone programmed
+   at 0x54c, followed by their count. Cb and Cr sums are signed. This
+   layout is not confirmed by the config, so frames whose sums can't be
+   pixel values are rejected, and after MM_DAEMON_AWB_MAX_REJECTS of them
+   in a row AWB falls back to the fixed gains for the session. */
+#define MM_DAEMON_AWB_REGIONS 256
+#define MM_DAEMON_AWB_MAX_REJECTS 30
+#define MM_DAEMON_AWB_MAX_Y 1023
+#define MM_DAEMON_AWB_MAX_C 512
+#define MM_DAEMON_AWB_MIN_PIXELS 1024
+#define MM_DAEMON_AWB_BUDGET_US 200
+#define MM_DAEMON_AWB_LOG_FRAMES 300
+
+struct mm_daemon_awb_sums {
+    float y;
+    float cb;
+    float cr;
+    float n;
+};
+
+#ifdef __ARM_NEON__
+static float mm_daemon_config_awb_hsum(float32x4_t v)
+{
+    float32x2_t s = vadd_f32(vget_low_f32(v), vget_high_f32(v));
+
+    return vget_lane_f32(vpadd_f32(s, s), 0);
+}
+
+/* Gray-world sums over all regions and white-patch sums over the regions
+   whose mean Y is within 1/8 of the brightest one, four regions at a
+   time. num must be a multiple of 4. */
+static void mm_daemon_config_awb_sums(const int32_t *stats, uint32_t num,
+        struct mm_daemon_awb_sums *gw, struct mm_daemon_awb_sums *wp)
+{
+    float32x4_t y = vdupq_n_f32(0), cb = y, cr = y, n = y, ymax = y;
+    float32x4_t wy = y, wcb = y, wcr = y, wn = y;
+    float32x4_t thr;
+    float32x2_t m;
+    uint32_t i;
+
+    for (i = 0; i < num; i += 4) {
+        int32x4x4_t r = vld4q_s32(stats + i * 4);
+        float32x4_t sy = vcvtq_f32_s32(r.val[0]);
+        float32x4_t cnt = vcvtq_f32_s32(r.val[3]);
+        uint32x4_t valid = vcgtq_s32(r.val[3], vdupq_n_s32(0));
+        float32x4_t rcp = vrecpeq_f32(cnt);
+
+        rcp = vmulq_f32(vrecpsq_f32(cnt, rcp), rcp);
+        ymax = vmaxq_f32(ymax, vreinterpretq_f32_u32(vandq_u32(valid,
+                vreinterpretq_u32_f32(vmulq_f32(sy, rcp)))));
+        y = vaddq_f32(y, sy);
+        cb = vaddq_f32(cb, vcvtq_f32_s32(r.val[1]));
+        cr = vaddq_f32(cr, vcvtq_f32_s32(r.val[2]));
+        n = vaddq_f32(n, cnt);
+    }
+    gw->y = mm_daemon_config_awb_hsum(y);
+    gw->cb = mm_daemon_config_awb_hsum(cb);
+    gw->cr = mm_daemon_config_awb_hsum(cr);
+    gw->n = mm_daemon_config_awb_hsum(n);
+
+    m = vpmax_f32(vget_low_f32(ymax), vget_high_f32(ymax));
+    m = vpmax_f32(m, m);
+    thr = vdupq_n_f32(vget_lane_f32(m, 0) * 0.875f);
+
+    for (i = 0; i < num; i += 4) {
+        int32x4x4_t r = vld4q_s32(stats + i * 4);
+        float32x4_t sy = vcvtq_f32_s32(r.val[0]);
+        float32x4_t cnt = vcvtq_f32_s32(r.val[3]);
+        uint32x4_t sel = vandq_u32(vcgtq_s32(r.val[3], vdupq_n_s32(0)),
+                vcgeq_f32(sy, vmulq_f32(thr, cnt)));
+
+        wy = vaddq_f32(wy, vreinterpretq_f32_u32(vandq_u32(sel,
+                vreinterpretq_u32_f32(sy))));
+        wcb = vaddq_f32(wcb, vreinterpretq_f32_u32(vandq_u32(sel,
+                vreinterpretq_u32_f32(vcvtq_f32_s32(r.val[1])))));
+        wcr = vaddq_f32(wcr, vreinterpretq_f32_u32(vandq_u32(sel,
+                vreinterpretq_u32_f32(vcvtq_f32_s32(r.val[2])))));
+        wn = vaddq_f32(wn, vreinterpretq_f32_u32(vandq_u32(sel,
+                vreinterpretq_u32_f32(cnt))));
+    }
+    wp->y = mm_daemon_config_awb_hsum(wy);
+    wp->cb = mm_daemon_config_awb_hsum(wcb);
+    wp->cr = mm_daemon_config_awb_hsum(wcr);
+    wp->n = mm_daemon_config_awb_hsum(wn);
+}
+#else
+static void mm_daemon_config_awb_sums(const int32_t *stats, uint32_t num,
+        struct mm_daemon_awb_sums *gw, struct mm_daemon_awb_sums *wp)
+{
+    const int32_t *r;
+    int64_t max_y = 0, max_n = 1;
+    uint32_t i;
+
+    /* The brightest mean is kept as a fraction and compared by cross
+       multiplication, so there is no division per region */
+    memset(gw, 0, sizeof(*gw));
+    memset(wp, 0, sizeof(*wp));
+    for (i = 0, r = stats; i < num; i++, r += 4) {
+        gw->y += r[0];
+        gw->cb += r[1];
+        gw->cr += r[2];
+        gw->n += r[3];
+        if (r[3] > 0 && r[0] * max_n > max_y * r[3]) {
+            max_y = r[0];
+            max_n = r[3];
+        }
+    }
+
+    for (i = 0, r = stats; i < num; i++, r += 4) {
+        if (r[3] <= 0 || 8 * r[0] * max_n < 7 * max_y * r[3])
+            continue;
+        wp->y += r[0];
+        wp->cb += r[1];
+        wp->cr += r[2];
+        wp->n += r[3];
+    }
+}
+#endif
+
+static int mm_daemon_config_awb_plausible(struct mm_daemon_awb_sums *s)
+{
+    float y, cb, cr;
+
+    if (s->n < 0)
+        return 0;
+    if (s->n == 0)
+        return 1;
+    y = s->y / s->n;
+    cb = s->cb / s->n;
+    cr = s->cr / s->n;
+    return y >= 0 && y <= MM_DAEMON_AWB_MAX_Y &&
+            cb >= -MM_DAEMON_AWB_MAX_C && cb <= MM_DAEMON_AWB_MAX_C &&
+            cr >= -MM_DAEMON_AWB_MAX_C && cr <= MM_DAEMON_AWB_MAX_C;
+}
+
+/* Mean of the summed pixels converted to R/G and B/G ratios */
+static int mm_daemon_config_awb_ratio(struct mm_daemon_awb_sums *s,
+        float *rg, float *bg)
+{
+    float y, cb, cr, r, g, b;
+
+    if (s->n < MM_DAEMON_AWB_MIN_PIXELS)
+        return -1;
+
+    y = s->y / s->n;
+    cb = s->cb / s->n;
+    cr = s->cr / s->n;
+    r = y + 1.402f * cr;
+    g = y - 0.344f * cb - 0.714f * cr;
+    b = y + 1.772f * cb;
+    if (r <= 0 || g <= 0 || b <= 0)
+        return -1;
+
+    *rg = r / g;
+    *bg = b / g;
+    return 0;
+}
+
+/* McCamy's approximation from the chromaticity of the illuminant */
+static uint32_t mm_daemon_config_awb_cct(float rg, float bg)
+{
+    float x, y, z, sum, n, cct;
+
+    x = 0.4124f * rg + 0.3576f + 0.1805f * bg;
+    y = 0.2126f * rg + 0.7152f + 0.0722f * bg;
+    z = 0.0193f * rg + 0.1192f + 0.9505f * bg;
+    sum = x + y + z;
+    x /= sum;
+    y /= sum;
+    if (y <= 0.1858f)
+        return 10000;
+
+    n = (x - 0.3320f) / (0.1858f - y);
+    cct = ((449.0f * n + 3525.0f) * n + 6823.3f) * n + 5520.33f;
+    if (cct < 2000.0f)
+        cct = 2000.0f;
+    else if (cct > 10000.0f)
+        cct = 10000.0f;
+    return (uint32_t)cct;
+}
+
+static float mm_daemon_config_awb_clamp(float gain)
+{
+    if (gain < 0.5f)
+        return 0.5f;
+    if (gain > 4.0f)
+        return 4.0f;
+    return gain;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_awb_estimate
+ *
+ * DESCRIPTION: Estimate the illuminant from a frame of AWB stats as the
+ *              average of the gray-world and white-patch estimates, and
+ *              move the smoothed gains a quarter of the way toward it.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @buf    : AWB stats buffer
+ *
+ * RETURN     : 0 when the gains were updated, -1 otherwise
+ *==========================================================================*/
+static int mm_daemon_config_awb_estimate(mm_daemon_cfg_t *cfg_obj,
+        mm_daemon_buf_data *buf)
+{
+    struct mm_daemon_wb_info *wb = &cfg_obj->wb;
+    struct mm_daemon_awb_sums gw, wp;
+    uint32_t num = buf->len / (4 * sizeof(int32_t));
+    float rg, bg, wrg, wbg;
+
+    if (num > MM_DAEMON_AWB_REGIONS)
+        num = MM_DAEMON_AWB_REGIONS;
+    num &= ~3;
+
+    mm_daemon_config_awb_sums((const int32_t *)buf->vaddr, num, &gw, &wp);
+    if (!mm_daemon_config_awb_plausible(&gw)) {
+        if (++wb->rejects >= MM_DAEMON_AWB_MAX_REJECTS) {
+            ALOGE("%s: stats are not pixel sums, using fixed gains",
+                    __FUNCTION__);
+            wb->disabled = 1;
+            wb->valid = 0;
+        }
+        return -1;
+    }
+    wb->rejects = 0;
+    if (mm_daemon_config_awb_ratio(&gw, &rg, &bg) < 0)
+        return -1;
+    if (mm_daemon_config_awb_ratio(&wp, &wrg, &wbg) == 0) {
+        rg = (rg + wrg) / 2;
+        bg = (bg + wbg) / 2;
+    }
+
+    if (!wb->valid) {
+        wb->r_gain = mm_daemon_config_awb_clamp(1 / rg);
+        wb->b_gain = mm_daemon_config_awb_clamp(1 / bg);
+        wb->valid = 1;
+    } else {
+        wb->r_gain += (mm_daemon_config_awb_clamp(1 / rg) - wb->r_gain) / 4;
+        wb->b_gain += (mm_daemon_config_awb_clamp(1 / bg) - wb->b_gain) / 4;
+    }
+    wb->cct = mm_daemon_config_awb_cct(1 / wb->r_gain, 1 / wb->b_gain);
+    return 0;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_color_update
+ *
+ * DESCRIPTION: Interpolate the sensor color calibration at the current AWB
+ *              estimate. The color matrix is rewritten only when an entry
+ *              moved by at least the sensor's threshold; the demux gains
+ *              are kept for the next capture under their own threshold.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *
+ * RETURN     : 1 if the VFE was written, 0 otherwise
+ *==========================================================================*/
+static int mm_daemon_config_color_update(mm_daemon_cfg_t *cfg_obj)
+{
+    struct mm_sensor_color_cal *cal = cfg_obj->sdata->color_cal;
+    struct mm_daemon_color_info *color = &cfg_obj->color;
+    int16_t ccm[9];
+    uint16_t gain[3];
+    uint8_t ccm_changed = !color->valid;
+    uint8_t gain_changed = !color->valid;
+    uint32_t cct;
+    int i;
+
+    if (!cal || !cal->num_anchors || cfg_obj->sdata->uses_sensor_ctrls)
+        return 0;
+
+    cct = mm_daemon_config_color_cct(cfg_obj);
+    mm_daemon_config_color_interp(cal, cct, ccm, gain);
+
+    for (i = 0; i < 9 && !ccm_changed; i++)
+        if (abs(ccm[i] - color->ccm[i]) >= cal->ccm_threshold)
+            ccm_changed = 1;
+    for (i = 0; i < 3 && !gain_changed; i++)
+        if (abs(gain[i] - color->gain[i]) >= cal->gain_threshold)
+            gain_changed = 1;
+
+    if (!ccm_changed && !gain_changed)
+        return 0;
+
+    color->cct = cct;
+    if (gain_changed)
+        memcpy(color->gain, gain, sizeof(gain));
+    if (!ccm_changed)
+        return 0;
+
+    memcpy(color->ccm, ccm, sizeof(ccm));
+    color->valid = 1;
+    return mm_daemon_config_vfe_color_cor(cfg_obj) == 0;
 }
 
 static void mm_daemon_config_auto_white_balance(mm_daemon_cfg_t *cfg_obj,
         uint32_t buf_idx)
 {
     mm_daemon_stats_buf_info *stat = cfg_obj->stats_buf[MSM_ISP_STATS_AWB];
+    mm_daemon_buf_data *buf = &stat->buf_data[buf_idx];
+    struct mm_daemon_wb_info *wb_info = &cfg_obj->wb;
+    enum mm_sensor_stream_type mode = mm_daemon_get_sensor_mode(cfg_obj);
+    struct mm_sensor_awb_config *awb_cfg = cfg_obj->sdata->awb_cfg[mode];
+    uint32_t dmx_gain[2];
+    uint64_t start;
+    uint8_t updated;
+    int rc;
 
-    memset(stat->buf_data[buf_idx].vaddr, 0, stat->buf_data[buf_idx].len);
     cam_wb_mode_type wb = mm_daemon_config_get_parm(cfg_obj,
             CAM_INTF_PARM_WHITE_BALANCE);
-    if (cfg_obj->wb.curr_wb != wb) {
+    if (wb_info->curr_wb != wb) {
         mm_daemon_config_vfe_white_balance(cfg_obj);
         mm_daemon_config_vfe_update(cfg_obj);
-        cfg_obj->wb.curr_wb = wb;
+        wb_info->curr_wb = wb;
+    }
+
+    if (wb != CAM_WB_MODE_AUTO || !awb_cfg || mode == SNAPSHOT ||
+            wb_info->disabled ||
+            mm_daemon_config_get_parm(cfg_obj, CAM_INTF_PARM_AWB_LOCK)) {
+        memset(buf->vaddr, 0, buf->len);
+        return;
+    }
+
+    start = mm_daemon_util_time_us();
+    rc = mm_daemon_config_awb_estimate(cfg_obj, buf);
+    mm_daemon_util_proc_time(&wb_info->proc, start);
+    memset(buf->vaddr, 0, buf->len);
+
+    if (wb_info->proc.runs == MM_DAEMON_AWB_LOG_FRAMES) {
+        ALOGD("%s: avg %u us, max %u us, budget %u us, cct %u", __FUNCTION__,
+                (uint32_t)(wb_info->proc.us_total / wb_info->proc.runs),
+                wb_info->proc.us_max, MM_DAEMON_AWB_BUDGET_US,
+                wb_info->cct);
+        memset(&wb_info->proc, 0, sizeof(wb_info->proc));
+    }
+
+    if (rc < 0) {
+        /* The fixed gains go out once, on the frame AWB gives up; later
+           frames return before the estimate */
+        if (wb_info->disabled) {
+            mm_daemon_config_vfe_white_balance(cfg_obj);
+            mm_daemon_config_vfe_update(cfg_obj);
+        }
+        return;
+    }
+
+    wb_info->wb_reg = mm_daemon_config_awb_reg(awb_cfg, wb_info->r_gain,
+            wb_info->b_gain);
+    if (cfg_obj->state) {
+        cfg_obj->state->r_gain = wb_info->r_gain;
+        cfg_obj->state->b_gain = wb_info->b_gain;
+        cfg_obj->state->cct = wb_info->cct;
+        cfg_obj->state->wb_reg = wb_info->wb_reg;
+        cfg_obj->state->valid |= MM_DAEMON_3A_STATE_AWB;
+    }
+
+    updated = mm_daemon_config_color_update(cfg_obj);
+    mm_daemon_config_demux_gains(cfg_obj, dmx_gain);
+    if (mm_daemon_config_vfe_wb_gains(cfg_obj, wb_info->wb_reg,
+            dmx_gain) > 0)
+        updated = TRUE;
+    if (updated)
+        mm_daemon_config_vfe_update(cfg_obj);
+}
+
+/* Move the exposure that lands on the frame starting now into effect
+   and record it for the frame's metadata */
+static void mm_daemon_config_exp_sof(mm_daemon_cfg_t *cfg_obj,
+        uint32_t frame_id)
+{
+    struct mm_daemon_exp_hist *hist = &cfg_obj->exp_hist;
+    struct mm_daemon_exp_rec *land = &hist->land[frame_id %
+            MM_DAEMON_EXP_HIST];
+    struct mm_daemon_exp_rec *res = &hist->res[frame_id %
+            MM_DAEMON_EXP_HIST];
+    int i;
+
+    hist->sof_id = frame_id;
+    if (land->valid && land->frame_id == frame_id)
+        hist->cur = *land;
+    *res = hist->cur;
+    res->frame_id = frame_id;
+    memset(land, 0, sizeof(*land));
+
+    hist->in_flight = 0;
+    for (i = 1; i < MM_DAEMON_EXP_HIST; i++) {
+        land = &hist->land[(frame_id + i) % MM_DAEMON_EXP_HIST];
+        if (land->valid && land->frame_id == frame_id + i)
+            hist->in_flight = 1;
     }
 }
 
@@ -3344,7 +5346,8 @@ static int mm_daemon_config_isp_evt(mm_daemon_cfg_t *cfg_obj,
         struct v4l2_event *isp_event)
 {
     int rc = 0;
-    uint32_t buf_idx;
+    uint32_t buf_idx, mask;
+    size_t i;
     enum msm_isp_stats_type stats_type;
     struct msm_isp_stats_event *stats_event;
     struct msm_isp_event_data *event_data =
@@ -3353,6 +5356,12 @@ static int mm_daemon_config_isp_evt(mm_daemon_cfg_t *cfg_obj,
     switch (isp_event->type) {
         case ISP_EVENT_SOF:
             cfg_obj->stat_frames = 0;
+            mm_daemon_config_exp_sof(cfg_obj, event_data->frame_id);
+            mm_daemon_config_hdr_sof(cfg_obj, event_data->frame_id);
+            if (cfg_obj->settle_frames && --cfg_obj->settle_frames == 0) {
+                mm_daemon_config_vfe_frame_skip(cfg_obj);
+                mm_daemon_config_vfe_update(cfg_obj);
+            }
             break;
         case ISP_EVENT_STATS_NOTIFY + MSM_ISP_STATS_AEC:
         case ISP_EVENT_STATS_NOTIFY + MSM_ISP_STATS_AF:
@@ -3366,6 +5375,7 @@ static int mm_daemon_config_isp_evt(mm_daemon_cfg_t *cfg_obj,
                 break;
             if (BIT(stats_type) & cfg_obj->enabled_stats) {
                 cfg_obj->stat_frames |= BIT(stats_type);
+                cfg_obj->stats_pool->frames[stats_type]++;
                 if (stat->ops.proc)
                     stat->ops.proc(cfg_obj, buf_idx);
             }
@@ -3373,6 +5383,18 @@ static int mm_daemon_config_isp_evt(mm_daemon_cfg_t *cfg_obj,
             break;
         case ISP_EVENT_COMP_STATS_NOTIFY:
             break;
+        case ISP_EVENT_STATS_OVERFLOW:
+            /* The VFE had no free buffer for these stats; charge the
+               types it names, or every running one if it names none */
+            mask = event_data->u.stats.stats_mask & cfg_obj->enabled_stats;
+            if (!mask)
+                mask = cfg_obj->enabled_stats;
+            for (i = 0; i < ARRAY_SIZE(vfe_stats); i++)
+                if (mask & BIT(vfe_stats[i]))
+                    cfg_obj->stats_pool->overflows[vfe_stats[i]]++;
+            ALOGW("%s: stats overflow on frame %u, mask 0x%x", __FUNCTION__,
+                    event_data->frame_id, mask);
+            break;
         default:
             ALOGE("%s: Unknown event %d", __FUNCTION__, isp_event->type);
             break;
@@ -3435,6 +5457,7 @@ static int mm_daemon_config_read_pipe(mm_daemon_cfg_t *cfg_obj)
                 mm_daemon_config_stats(cfg_obj,
                         BIT(MSM_ISP_STATS_AEC) |
                         BIT(MSM_ISP_STATS_AWB), true);
+                mm_daemon_config_caf_update(cfg_obj);
                 break;
             case CAM_STREAM_TYPE_SNAPSHOT:
             case CAM_STREAM_TYPE_POSTVIEW:
@@ -3478,6 +5501,7 @@ static int mm_daemon_config_read_pipe(mm_daemon_cfg_t *cfg_obj)
                 if (cfg_obj->enabled_stats)
                     mm_daemon_config_stats(cfg_obj,
                             cfg_obj->enabled_stats, false);
+                mm_daemon_config_caf_update(cfg_obj);
                 break;
             default:
                 ALOGE("%s: unknown stream type %d",
@@ -3514,8 +5538,10 @@ static int mm_daemon_config_read_pipe(mm_daemon_cfg_t *cfg_obj)
             break;
         }
     case CFG_CMD_PARM:
-        if (cfg_obj->parm_buf.mapped)
+        if (cfg_obj->parm_buf.mapped) {
             mm_daemon_config_parm(cfg_obj);
+            mm_daemon_config_caf_update(cfg_obj);
+        }
         break;
     case CFG_CMD_CANCEL_AUTO_FOCUS:
         mm_daemon_config_auto_focus_stop(cfg_obj);
@@ -3524,7 +5550,7 @@ static int mm_daemon_config_read_pipe(mm_daemon_cfg_t *cfg_obj)
         mm_daemon_config_auto_focus_start(cfg_obj);
         break;
     case CFG_CMD_PREPARE_SNAPSHOT:
-        mm_daemon_config_prepare_snapshot(cfg_obj, 1);
+        mm_daemon_config_preflash_start(cfg_obj);
         break;
     case CFG_CMD_MAP_UNMAP_DONE:
         mm_daemon_util_pipe_cmd(cfg_obj->cfg->cb_pfd,
@@ -3669,6 +5695,49 @@ static void mm_daemon_config_stats_init(mm_daemon_cfg_t *cfg_obj)
     mm_daemon_config_stats_buf_enqueue(cfg_obj);
 }
 
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_stats_depth_adapt
+ *
+ * DESCRIPTION: Pick the stats queue depth of the next session from the
+ *              overflows counted in this one. A type that overflowed too
+ *              often gets another buffer, one that went long without an
+ *              overflow gives one back, within STATS_BUFFER_MIN and
+ *              STATS_BUFFER_MAX.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *==========================================================================*/
+static void mm_daemon_config_stats_depth_adapt(mm_daemon_cfg_t *cfg_obj)
+{
+    mm_daemon_stats_pool_t *pool = cfg_obj->stats_pool;
+    uint32_t type, frames, ovf;
+    uint8_t depth;
+    size_t i;
+
+    for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
+        type = vfe_stats[i];
+        if (!cfg_obj->stats_buf[type] || !pool->depth[type])
+            continue;
+        frames = pool->frames[type];
+        ovf = pool->overflows[type];
+        depth = pool->depth[type];
+        if (ovf && ovf * MM_DAEMON_STATS_OVF_RATE > frames) {
+            if (depth < STATS_BUFFER_MAX)
+                depth++;
+        } else if (!ovf && frames >= MM_DAEMON_STATS_SHRINK_FRAMES) {
+            if (depth > STATS_BUFFER_MIN)
+                depth--;
+        }
+        if (depth != pool->depth[type])
+            ALOGI("%s: stats type %u depth %u -> %u (%u overflows in %u "
+                    "frames)", __FUNCTION__, type, pool->depth[type], depth,
+                    ovf, frames);
+        pool->depth[type] = depth;
+        pool->frames[type] = 0;
+        pool->overflows[type] = 0;
+    }
+}
+
 static void mm_daemon_config_stats_deinit(mm_daemon_cfg_t *cfg_obj)
 {
     uint32_t type;
@@ -3676,6 +5745,7 @@ static void mm_daemon_config_stats_deinit(mm_daemon_cfg_t *cfg_obj)
 
     mm_daemon_config_stats_buf_release(cfg_obj);
     mm_daemon_config_stats_buf_dealloc(cfg_obj);
+    mm_daemon_config_stats_depth_adapt(cfg_obj);
     for (i = 0; i < ARRAY_SIZE(vfe_stats); i++) {
         type = vfe_stats[i];
         if (cfg_obj->stats_buf[type]) {
@@ -3685,6 +5755,112 @@ static void mm_daemon_config_stats_deinit(mm_daemon_cfg_t *cfg_obj)
     }
 }
 
+/*==========================================================================
+ * FUNCTION   : mm_daemon_config_3a_state_open
+ *
+ * DESCRIPTION: Map the sensor's 3A state file and restore the exposure,
+ *              white balance and lens position saved by the last session.
+ *              Restored values are range checked against the sensor
+ *              configuration; the exposure and lens position are applied
+ *              when the first preview stream starts.
+ *
+ * PARAMETERS :
+ *   @cfg_obj: pointer to config object
+ *   @name   : sensor name
+ *
+ * RETURN     : none
+ *==========================================================================*/
+static void mm_daemon_config_3a_state_open(mm_daemon_cfg_t *cfg_obj,
+        const char *name)
+{
+    struct mm_sensor_aec_config *aec_cfg = cfg_obj->sdata->aec_cfg;
+    struct mm_sensor_color_cal *cal = cfg_obj->sdata->color_cal;
+    struct mm_daemon_act_params *act;
+    struct mm_daemon_3a_state *state;
+    char path[PATH_MAX];
+    int fd;
+
+    if (!name[0])
+        return;
+
+    snprintf(path, sizeof(path), MM_DAEMON_3A_STATE_PATH, name);
+    fd = open(path, O_RDWR | O_CREAT, 0660);
+    if (fd < 0) {
+        ALOGE("%s: failed to open %s", __FUNCTION__, path);
+        return;
+    }
+    if (ftruncate(fd, sizeof(struct mm_daemon_3a_state)) < 0) {
+        close(fd);
+        return;
+    }
+    state = (struct mm_daemon_3a_state *)mmap(NULL,
+            sizeof(struct mm_daemon_3a_state), PROT_READ|PROT_WRITE,
+            MAP_SHARED, fd, 0);
+    if (state == MAP_FAILED) {
+        close(fd);
+        return;
+    }
+    cfg_obj->state = state;
+    cfg_obj->state_fd = fd;
+
+    if (state->magic != MM_DAEMON_3A_STATE_MAGIC ||
+            state->version != MM_DAEMON_3A_STATE_VERSION) {
+        memset(state, 0, sizeof(struct mm_daemon_3a_state));
+        state->magic = MM_DAEMON_3A_STATE_MAGIC;
+        state->version = MM_DAEMON_3A_STATE_VERSION;
+        return;
+    }
+
+    if ((state->valid & MM_DAEMON_3A_STATE_AE) && aec_cfg &&
+            state->gain >= aec_cfg->gain_min &&
+            state->gain <= aec_cfg->gain_max &&
+            state->line >= aec_cfg->line_min &&
+            state->line <= aec_cfg->line_max) {
+        cfg_obj->ae.c_gain = state->gain;
+        cfg_obj->ae.c_line = state->line;
+        cfg_obj->warm_start |= MM_DAEMON_3A_STATE_AE;
+    }
+
+    if ((state->valid & MM_DAEMON_3A_STATE_AWB) &&
+            state->r_gain >= 0.5f && state->r_gain <= 4.0f &&
+            state->b_gain >= 0.5f && state->b_gain <= 4.0f) {
+        cfg_obj->wb.r_gain = state->r_gain;
+        cfg_obj->wb.b_gain = state->b_gain;
+        cfg_obj->wb.cct = state->cct;
+        cfg_obj->wb.wb_reg = state->wb_reg;
+        cfg_obj->wb.valid = 1;
+        if (cal && cal->num_anchors && !cfg_obj->sdata->uses_sensor_ctrls) {
+            cfg_obj->color.cct = mm_daemon_config_color_cct(cfg_obj);
+            mm_daemon_config_color_interp(cal, cfg_obj->color.cct,
+                    cfg_obj->color.ccm, cfg_obj->color.gain);
+            cfg_obj->color.valid = 1;
+        }
+        cfg_obj->warm_start |= MM_DAEMON_3A_STATE_AWB;
+    }
+
+    act = (struct mm_daemon_act_params *)cfg_obj->sdata->act_params;
+    if ((state->valid & MM_DAEMON_3A_STATE_AF) && cfg_obj->info[ACT_DEV] &&
+            act && state->lens_pos <=
+            act->act_info->af_tuning_params.total_steps)
+        cfg_obj->warm_start |= MM_DAEMON_3A_STATE_AF;
+
+    ALOGI("%s: %s restored 0x%x, gain %u line %u cct %u lens %u",
+            __FUNCTION__, name, cfg_obj->warm_start, state->gain, state->line,
+            state->cct, state->lens_pos);
+}
+
+static void mm_daemon_config_3a_state_close(mm_daemon_cfg_t *cfg_obj)
+{
+    if (!cfg_obj->state)
+        return;
+
+    msync(cfg_obj->state, sizeof(struct mm_daemon_3a_state), MS_ASYNC);
+    munmap(cfg_obj->state, sizeof(struct mm_daemon_3a_state));
+    close(cfg_obj->state_fd);
+    cfg_obj->state = NULL;
+    cfg_obj->state_fd = 0;
+}
+
 static void *mm_daemon_config_thread(void *data)
 {
     size_t i;
@@ -3770,14 +5946,8 @@ static void *mm_daemon_config_thread(void *data)
     for (i = 0; i < ARRAY_SIZE(isp_events); i++)
         mm_daemon_config_subscribe(cfg_obj, isp_events[i], 1);
 
-    /* ION */
-    cfg_obj->ion_fd = open("/dev/ion", O_RDONLY);
-    if (cfg_obj->ion_fd < 0) {
-        ALOGE("failed to open ion device");
-        goto thread_close;
-    }
-
     /* STATS */
+    cfg_obj->stats_pool = &sd->stats_pool;
     if (cfg_obj->sdata->stats_enable)
         mm_daemon_config_stats_init(cfg_obj);
 
@@ -3785,6 +5955,7 @@ static void *mm_daemon_config_thread(void *data)
         cfg_obj->ae.c_gain = cfg_obj->sdata->aec_cfg->default_gain;
         cfg_obj->ae.c_line = cfg_obj->sdata->aec_cfg->default_line[PREVIEW];
     }
+    mm_daemon_config_3a_state_open(cfg_obj, sd->sensor_sd[cam_idx].name);
 
     info->state = STATE_POLL;
     pthread_cond_signal(&cfg_obj->cfg->cond);
@@ -3821,13 +5992,19 @@ static void *mm_daemon_config_thread(void *data)
 
     mm_daemon_config_buf_close(cfg_obj);
 
+    /* a flash prepared but never used goes out with the session */
+    if (cfg_obj->prep_snapshot || cfg_obj->snap_flash)
+        mm_daemon_util_subdev_cmd(cfg_obj->info[LED_DEV],
+                LED_CMD_CONTROL, MSM_CAMERA_LED_OFF, FALSE);
+    cfg_obj->prep_snapshot = 0;
+    cfg_obj->snap_flash = 0;
+    cfg_obj->ae.pf.state = MM_PREFLASH_OFF;
+
     for (i = 0; i < ARRAY_SIZE(isp_events); i++)
         mm_daemon_config_subscribe(cfg_obj, isp_events[i], 0);
 
-    if (cfg_obj->ion_fd > 0) {
-        close(cfg_obj->ion_fd);
-        cfg_obj->ion_fd = 0;
-    }
+    mm_daemon_config_vfe_shadow_reset(cfg_obj);
+    mm_daemon_config_3a_state_close(cfg_obj);
 thread_close:
     mm_daemon_config_thread_close(cfg_obj);
     if (cfg_obj->buf_fd > 0) {
@@ -3854,6 +6031,10 @@ mm_daemon_thread_info *mm_daemon_config_open(mm_daemon_sd_obj_t *sd,
         ALOGE("%s: invalid session_id %d", __FUNCTION__, session_id);
         return NULL;
     }
+    /* The session's sensor may still be probing */
+    if (mm_daemon_snsr_wait(sd, session_id - 1) < 0)
+        ALOGE("%s: no sensor loaded for session %d", __FUNCTION__,
+                session_id);
 
     info = (mm_daemon_thread_info *)calloc(1, sizeof(mm_daemon_thread_info));
     if (info == NULL)
@@ -35,6 +35,149 @@ static int mm_daemon_sensor_cmd(mm_daemon_sensor_t *mm_snsr,
     return ioctl(mm_snsr->cam_fd, VIDIOC_MSM_SENSOR_CFG, &cdata);
 }
 
+static int mm_daemon_sensor_write_setting(mm_daemon_sensor_t *mm_snsr,
+        struct msm_camera_i2c_reg_array *reg_setting, uint16_t size,
+        enum msm_camera_i2c_data_type data_type)
+{
+    struct msm_camera_i2c_reg_setting setting = {
+        .reg_setting = reg_setting,
+        .size = size,
+        .data_type = data_type,
+    };
+    return mm_daemon_sensor_cmd(mm_snsr, CFG_WRITE_I2C_ARRAY, (void *)&setting);
+}
+
+/* Pack registers at consecutive addresses into burst entries. Returns the
+   number of entries written to seq. */
+static uint16_t mm_daemon_sensor_seq_pack(
+        struct msm_camera_i2c_reg_array *regs, uint16_t size,
+        enum msm_camera_i2c_data_type data_type,
+        struct msm_camera_i2c_seq_reg_array *seq)
+{
+    uint16_t i, n = 0, width;
+    struct msm_camera_i2c_seq_reg_array *cur = NULL;
+
+    width = (data_type == MSM_CAMERA_I2C_WORD_DATA) ? 2 : 1;
+    for (i = 0; i < size; i++) {
+        if (!cur || regs[i].reg_addr != cur->reg_addr + cur->reg_data_size ||
+                cur->reg_data_size + width > I2C_SEQ_REG_DATA_MAX) {
+            cur = &seq[n++];
+            cur->reg_addr = regs[i].reg_addr;
+            cur->reg_data_size = 0;
+        }
+        if (width == 2)
+            cur->reg_data[cur->reg_data_size++] = regs[i].reg_data >> 8;
+        cur->reg_data[cur->reg_data_size++] = regs[i].reg_data & 0xFF;
+    }
+    return n;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_write_regs
+ *
+ * DESCRIPTION: Write registers, sending runs of consecutive addresses as
+ *              sequential bursts. Falls back to one write per register
+ *              when a burst fails, and for good when the kernel rejects
+ *              the burst ioctl as unsupported.
+ *
+ * PARAMETERS :
+ *   @mm_snsr   : sensor object
+ *   @regs      : registers to write
+ *   @size      : number of entries in regs
+ *   @data_type : i2c data width
+ *
+ * RETURN     : 0 on success, negative value on i2c failure
+ *==========================================================================*/
+static int mm_daemon_sensor_write_regs(mm_daemon_sensor_t *mm_snsr,
+        struct msm_camera_i2c_reg_array *regs, uint16_t size,
+        enum msm_camera_i2c_data_type data_type)
+{
+    struct msm_camera_i2c_seq_reg_array *seq;
+    struct msm_camera_i2c_seq_reg_setting setting;
+    uint16_t i, j, n, done = 0;
+    uint16_t width = (data_type == MSM_CAMERA_I2C_WORD_DATA) ? 2 : 1;
+    int rc = 0, err = 0;
+
+    if (mm_snsr->no_seq || size < 2 || !mm_snsr->cfg->addr_type ||
+            (data_type != MSM_CAMERA_I2C_BYTE_DATA &&
+            data_type != MSM_CAMERA_I2C_WORD_DATA))
+        return mm_daemon_sensor_write_setting(mm_snsr, regs, size, data_type);
+    for (i = 0; i < size; i++)
+        if (regs[i].delay)
+            return mm_daemon_sensor_write_setting(mm_snsr, regs, size,
+                    data_type);
+
+    seq = (struct msm_camera_i2c_seq_reg_array *)malloc(size * sizeof(*seq));
+    if (!seq)
+        return mm_daemon_sensor_write_setting(mm_snsr, regs, size, data_type);
+
+    n = mm_daemon_sensor_seq_pack(regs, size, data_type, seq);
+    if (n == size) {
+        free(seq);
+        return mm_daemon_sensor_write_setting(mm_snsr, regs, size, data_type);
+    }
+
+    memset(&setting, 0, sizeof(setting));
+    setting.addr_type = mm_snsr->cfg->addr_type;
+    for (i = 0; i < n; i += setting.size) {
+        setting.reg_setting = &seq[i];
+        setting.size = n - i;
+        if (setting.size > I2C_SEQ_REG_SETTING_MAX)
+            setting.size = I2C_SEQ_REG_SETTING_MAX;
+        rc = mm_daemon_sensor_cmd(mm_snsr, CFG_WRITE_I2C_SEQ_ARRAY,
+                (void *)&setting);
+        if (rc < 0) {
+            err = errno;
+            break;
+        }
+        for (j = i; j < i + setting.size; j++)
+            done += seq[j].reg_data_size / width;
+    }
+    free(seq);
+
+    if (rc < 0) {
+        rc = mm_daemon_sensor_write_setting(mm_snsr, regs + done, size - done,
+                data_type);
+        /* only stop trying bursts if the kernel doesn't know them */
+        if (rc == 0 && (err == EINVAL || err == ENOTTY)) {
+            ALOGW("%s: burst writes not supported", __FUNCTION__);
+            mm_snsr->no_seq = 1;
+        }
+    }
+    return rc;
+}
+
+static void mm_daemon_sensor_shadow_reset(mm_daemon_sensor_t *mm_snsr)
+{
+    struct mm_daemon_sensor_shadow *shadow = &mm_snsr->shadow;
+
+    memset(shadow->ent, 0, sizeof(shadow->ent));
+    shadow->var_addr = -1;
+    shadow->pending_var = -1;
+    mm_snsr->exp_mode = -1;
+}
+
+static void mm_daemon_sensor_shadow_stats(mm_daemon_sensor_t *mm_snsr)
+{
+    struct mm_daemon_sensor_shadow *shadow = &mm_snsr->shadow;
+    struct mm_daemon_sensor_priv *priv = mm_snsr->cfg->priv;
+
+    if (!shadow->writes)
+        return;
+    ALOGI("%s: %u of %u register writes skipped (%u%%), %u bytes saved",
+            __FUNCTION__, shadow->writes - shadow->sent, shadow->writes,
+            (shadow->writes - shadow->sent) * 100 / shadow->writes,
+            shadow->bytes_saved);
+    ALOGI("%s: %u write ops sent in %u transfers", __FUNCTION__,
+            mm_snsr->batch.ops, mm_snsr->batch.flushes);
+    if (priv && priv->exp_writes) {
+        ALOGI("%s: %u exposure updates, %u images computed, %u repeats "
+                "skipped", __FUNCTION__, priv->exp_writes, priv->exp_misses,
+                priv->exp_skips);
+        priv->exp_writes = priv->exp_misses = priv->exp_skips = 0;
+    }
+}
+
 static int mm_daemon_sensor_start(mm_daemon_sensor_t *mm_snsr)
 {
     int rc = -1;
@@ -58,6 +201,11 @@ static int mm_daemon_sensor_stop(mm_daemon_sensor_t *mm_snsr)
     if (mm_snsr->sensor_state == SENSOR_POWER_OFF ||
             mm_daemon_sensor_cmd(mm_snsr, CFG_POWER_DOWN, NULL) < 0)
         return rc;
+    mm_snsr->cur_mode = -1;
+    mm_snsr->batch.size = 0;
+    mm_snsr->batch.cmds = 0;
+    mm_daemon_sensor_shadow_stats(mm_snsr);
+    mm_daemon_sensor_shadow_reset(mm_snsr);
     mm_snsr->cfg->ops->deinit(mm_snsr->cfg);
     rc = ioctl(mm_snsr->cam_fd, VIDIOC_MSM_SENSOR_RELEASE, NULL);
     mm_snsr->sensor_state = SENSOR_POWER_OFF;
@@ -70,6 +218,8 @@ static int mm_daemon_sensor_power_up(mm_daemon_sensor_t *mm_snsr)
 
     if (mm_snsr->sensor_state == SENSOR_POWER_ON)
         goto done;
+    mm_snsr->cur_mode = -1;
+    mm_daemon_sensor_shadow_reset(mm_snsr);
     if (mm_daemon_sensor_cmd(mm_snsr, CFG_POWER_UP, NULL) == 0)
         rc = mm_snsr->cfg->ops->init_regs(mm_snsr->cfg);
 
@@ -80,16 +230,258 @@ done:
     return rc;
 }
 
+/* Fire-and-forget commands only hear of a failed write here. The mode
+   and shadow no longer describe the sensor, so the next mode change and
+   exposure write go out in full. */
+static void mm_daemon_sensor_write_failed(mm_daemon_sensor_t *mm_snsr,
+        uint16_t size, int rc, uint32_t cmds)
+{
+    ALOGE("%s: write of %u regs failed (%d), cmd mask 0x%x", __FUNCTION__,
+            size, rc, cmds);
+    mm_daemon_sensor_shadow_reset(mm_snsr);
+    mm_snsr->cur_mode = -1;
+}
+
+static int mm_daemon_sensor_batch_flush(mm_daemon_sensor_t *mm_snsr)
+{
+    struct mm_daemon_sensor_batch *batch = &mm_snsr->batch;
+    int rc;
+
+    if (!batch->size)
+        return 0;
+    rc = mm_daemon_sensor_write_regs(mm_snsr, batch->regs, batch->size,
+            batch->data_type);
+    if (rc < 0)
+        mm_daemon_sensor_write_failed(mm_snsr, batch->size, rc, batch->cmds);
+    batch->size = 0;
+    batch->armed = 0;
+    batch->cmds = 0;
+    batch->flushes++;
+    return rc;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_batch_write
+ *
+ * DESCRIPTION: Queue register writes. The queue is sent as one transfer
+ *              once the sensor thread has no more commands waiting, before
+ *              any read and before commands that need the registers on the
+ *              sensor (mode changes, power, synchronous commands).
+ *
+ * PARAMETERS :
+ *   @mm_snsr   : sensor object
+ *   @regs      : registers to write
+ *   @size      : number of entries in regs
+ *   @data_type : i2c data width
+ *
+ * RETURN     : 0 on success, negative value on i2c failure
+ *==========================================================================*/
+static int mm_daemon_sensor_batch_write(mm_daemon_sensor_t *mm_snsr,
+        struct msm_camera_i2c_reg_array *regs, uint16_t size,
+        enum msm_camera_i2c_data_type data_type)
+{
+    struct mm_daemon_sensor_batch *batch = &mm_snsr->batch;
+    int rc;
+
+    if (batch->size && (batch->data_type != data_type ||
+            batch->size + size > MM_DAEMON_SNSR_BATCH_MAX) &&
+            (rc = mm_daemon_sensor_batch_flush(mm_snsr)) < 0)
+        return rc;
+    if (size > MM_DAEMON_SNSR_BATCH_MAX) {
+        rc = mm_daemon_sensor_write_regs(mm_snsr, regs, size, data_type);
+        if (rc < 0)
+            mm_daemon_sensor_write_failed(mm_snsr, size, rc,
+                    BIT(batch->cmd));
+        return rc;
+    }
+
+    memcpy(&batch->regs[batch->size], regs, size * sizeof(*regs));
+    batch->size += size;
+    batch->data_type = data_type;
+    batch->cmds |= BIT(batch->cmd);
+    batch->ops++;
+    return 0;
+}
+
+static uint8_t mm_daemon_sensor_shadow_volatile(mm_sensor_cfg_t *cfg,
+        uint32_t key)
+{
+    struct mm_sensor_shadow_cfg *scfg = cfg->shadow_cfg;
+    uint16_t addr = key & 0xFFFF;
+    unsigned int i;
+
+    if (key & MM_DAEMON_SNSR_SHADOW_VAR) {
+        for (i = 0; scfg && i < scfg->num_volatile_vars; i++)
+            if (scfg->volatile_vars[i] == addr)
+                return TRUE;
+        return FALSE;
+    }
+
+    /* the kernel writes the stop settings behind our back */
+    for (i = 0; i < cfg->stop_regs->size; i++)
+        if (cfg->stop_regs->regs[i].reg_addr == addr)
+            return TRUE;
+    if (cfg->mode_regs && cfg->mode_regs->hold_addr == addr)
+        return TRUE;
+    for (i = 0; scfg && i < scfg->num_volatile_regs; i++)
+        if (scfg->volatile_regs[i] == addr)
+            return TRUE;
+    return FALSE;
+}
+
+static struct mm_daemon_sensor_shadow_ent *mm_daemon_sensor_shadow_find(
+        struct mm_daemon_sensor_shadow *shadow, uint32_t key)
+{
+    struct mm_daemon_sensor_shadow_ent *ent;
+    uint32_t i, idx = (key * 2654435761U) >> 23;
+
+    for (i = 0; i < MM_DAEMON_SNSR_SHADOW_SIZE; i++) {
+        ent = &shadow->ent[(idx + i) & (MM_DAEMON_SNSR_SHADOW_SIZE - 1)];
+        if (ent->key == key || ent->key == 0)
+            return ent;
+    }
+    return NULL;
+}
+
+/* Write the variable address register if the sensor does not already
+   point at the variable last selected. */
+static int mm_daemon_sensor_var_flush(mm_daemon_sensor_t *mm_snsr)
+{
+    struct mm_daemon_sensor_shadow *shadow = &mm_snsr->shadow;
+    struct msm_camera_i2c_reg_array reg;
+    int rc;
+
+    if (shadow->pending_var < 0 || shadow->pending_var == shadow->var_addr)
+        return 0;
+
+    reg.reg_addr = mm_snsr->cfg->shadow_cfg->var_addr_reg;
+    reg.reg_data = shadow->pending_var;
+    reg.delay = 0;
+    rc = mm_daemon_sensor_batch_write(mm_snsr, &reg, 1, shadow->pending_dt);
+    if (rc < 0) {
+        mm_daemon_sensor_shadow_reset(mm_snsr);
+        return rc;
+    }
+    shadow->var_addr = shadow->pending_var;
+    shadow->sent++;
+    return 0;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_shadow_write
+ *
+ * DESCRIPTION: Drop writes of values the registers already hold and send
+ *              the rest as a single array. Writes to the variable address
+ *              register are held back until a variable write needs them.
+ *
+ * PARAMETERS :
+ *   @mm_snsr   : sensor object
+ *   @regs      : registers to write
+ *   @size      : number of entries in regs
+ *   @data_type : i2c data width
+ *
+ * RETURN     : 0 on success, negative value on i2c failure
+ *==========================================================================*/
+static int mm_daemon_sensor_shadow_write(mm_daemon_sensor_t *mm_snsr,
+        struct msm_camera_i2c_reg_array *regs, uint16_t size,
+        enum msm_camera_i2c_data_type data_type)
+{
+    struct mm_daemon_sensor_shadow *shadow = &mm_snsr->shadow;
+    struct mm_sensor_shadow_cfg *scfg = mm_snsr->cfg->shadow_cfg;
+    struct mm_daemon_sensor_shadow_ent *ent;
+    struct msm_camera_i2c_reg_array *out;
+    uint8_t cacheable = (data_type == MSM_CAMERA_I2C_BYTE_DATA ||
+            data_type == MSM_CAMERA_I2C_WORD_DATA);
+    uint8_t has_vars = (scfg && scfg->var_data_reg);
+    uint8_t keep;
+    uint16_t i, n = 0;
+    uint32_t key;
+    int rc = 0;
+
+    out = (struct msm_camera_i2c_reg_array *)malloc(2 * size * sizeof(*out));
+    if (!out)
+        return -ENOMEM;
+
+    shadow->writes += size;
+    for (i = 0; i < size; i++) {
+        if (has_vars && regs[i].reg_addr == scfg->var_addr_reg) {
+            shadow->pending_var = regs[i].reg_data;
+            shadow->pending_dt = data_type;
+            continue;
+        }
+        if (has_vars && regs[i].reg_addr == scfg->var_data_reg)
+            key = (shadow->pending_var < 0) ? 0 :
+                    (MM_DAEMON_SNSR_SHADOW_VAR | shadow->pending_var);
+        else
+            key = MM_DAEMON_SNSR_SHADOW_REG | regs[i].reg_addr;
+
+        ent = key ? mm_daemon_sensor_shadow_find(shadow, key) : NULL;
+        if (ent && ent->key == key && ent->data_type == data_type &&
+                ent->data == regs[i].reg_data && !regs[i].delay)
+            continue;
+
+        if ((key & MM_DAEMON_SNSR_SHADOW_VAR) &&
+                shadow->var_addr != shadow->pending_var) {
+            if (shadow->pending_dt != data_type) {
+                if (n && (rc = mm_daemon_sensor_batch_write(mm_snsr, out,
+                        n, data_type)) < 0)
+                    goto error;
+                shadow->sent += n;
+                n = 0;
+                if ((rc = mm_daemon_sensor_var_flush(mm_snsr)) < 0)
+                    goto error;
+            } else {
+                out[n].reg_addr = scfg->var_addr_reg;
+                out[n].reg_data = shadow->pending_var;
+                out[n++].delay = 0;
+                shadow->var_addr = shadow->pending_var;
+            }
+        }
+        out[n++] = regs[i];
+
+        keep = cacheable && !mm_daemon_sensor_shadow_volatile(mm_snsr->cfg,
+                key);
+        if (ent && (ent->key == key || keep)) {
+            ent->key = key;
+            ent->data = regs[i].reg_data;
+            ent->data_type = keep ? data_type : 0;
+        }
+    }
+
+    if (n && (rc = mm_daemon_sensor_batch_write(mm_snsr, out, n,
+            data_type)) < 0)
+        goto error;
+    shadow->sent += n;
+    if (size > n)
+        shadow->bytes_saved += (size - n) *
+                (data_type == MSM_CAMERA_I2C_WORD_DATA ? 4 : 3);
+    free(out);
+    return 0;
+
+error:
+    mm_daemon_sensor_shadow_reset(mm_snsr);
+    free(out);
+    return rc;
+}
+
 static int mm_daemon_sensor_i2c_read(void *snsr,
         uint16_t reg_addr, uint16_t *data,
         enum msm_camera_i2c_data_type data_type)
 {
     mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
+    struct mm_sensor_shadow_cfg *scfg = mm_snsr->cfg->shadow_cfg;
     struct msm_camera_i2c_read_config read_config = {
         .reg_addr = reg_addr,
         .data = data,
         .data_type = data_type,
     };
+    int rc;
+
+    if (scfg && scfg->var_data_reg && reg_addr == scfg->var_data_reg &&
+            (rc = mm_daemon_sensor_var_flush(mm_snsr)) < 0)
+        return rc;
+    if ((rc = mm_daemon_sensor_batch_flush(mm_snsr)) < 0)
+        return rc;
 
     return mm_daemon_sensor_cmd(mm_snsr, CFG_SLAVE_READ_I2C, (void *)&read_config);
 }
@@ -103,13 +495,9 @@ static int mm_daemon_sensor_i2c_write(void *snsr,
         .reg_addr = reg_addr,
         .reg_data = reg_data,
     };
-    struct msm_camera_i2c_reg_setting setting = {
-        .reg_setting = &i2c_write_array,
-        .size = 1,
-        .data_type = data_type,
-    };
 
-    return mm_daemon_sensor_cmd(mm_snsr, CFG_WRITE_I2C_ARRAY, (void *)&setting);
+    return mm_daemon_sensor_shadow_write(mm_snsr, &i2c_write_array, 1,
+            data_type);
 }
 
 static int mm_daemon_sensor_i2c_write_array(void *snsr,
@@ -117,20 +505,245 @@ static int mm_daemon_sensor_i2c_write_array(void *snsr,
         enum msm_camera_i2c_data_type data_type)
 {
     mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
-    struct msm_camera_i2c_reg_setting setting = {
-        .reg_setting = reg_setting,
-        .size = size,
-        .data_type = data_type,
-    };
-    return mm_daemon_sensor_cmd(mm_snsr, CFG_WRITE_I2C_ARRAY, (void *)&setting);
+
+    return mm_daemon_sensor_shadow_write(mm_snsr, reg_setting, size,
+            data_type);
+}
+
+static int mm_daemon_sensor_write_mode(void *snsr, int mode)
+{
+    mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
+    struct mm_daemon_sensor_priv *priv = mm_snsr->cfg->priv;
+    struct mm_daemon_sensor_mode_tbl *tbl;
+    unsigned int from;
+    int rc = 0;
+
+    if (!priv || mode < 0 || (unsigned int)mode >= priv->num_modes)
+        return -EINVAL;
+
+    from = (mm_snsr->cur_mode < 0) ? priv->num_modes :
+            (unsigned int)mm_snsr->cur_mode;
+    tbl = &priv->mode_diff[from * priv->num_modes + mode];
+    if (tbl->size) {
+        rc = mm_snsr->cfg->ops->i2c_write_array(snsr, tbl->regs, tbl->size,
+                priv->mode_dt);
+        mm_snsr->exp_mode = -1;
+    }
+    mm_snsr->cur_mode = (rc < 0) ? -1 : mode;
+    return rc;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_write_exp
+ *
+ * DESCRIPTION: Write an exposure through the prebuilt grouped hold packet.
+ *              Register images come from the plugin and are kept by mode,
+ *              gain and line, so a repeated exposure costs a table lookup.
+ *              Writing the exposure the sensor already holds is skipped.
+ *
+ * PARAMETERS :
+ *   @snsr : sensor object
+ *   @mode : sensor mode the exposure is for
+ *   @gain : gain code
+ *   @line : line count
+ *
+ * RETURN     : 0 on success, negative value on failure
+ *==========================================================================*/
+static int mm_daemon_sensor_write_exp(void *snsr, int mode, uint16_t gain,
+        uint16_t line)
+{
+    mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
+    struct mm_sensor_exp_regs *er = mm_snsr->cfg->exp_regs;
+    struct mm_daemon_sensor_priv *priv = mm_snsr->cfg->priv;
+    struct mm_daemon_sensor_exp_img *img;
+    uint32_t key = gain | ((uint32_t)line << 16);
+    unsigned int i;
+    int rc;
+
+    if (!er || !priv || !priv->exp_size || !mm_snsr->cfg->ops->exp_img)
+        return -EINVAL;
+
+    priv->exp_writes++;
+    if (mode == mm_snsr->exp_mode && key == mm_snsr->exp_key) {
+        priv->exp_skips++;
+        return 0;
+    }
+
+    img = &priv->exp_memo[((key * 2654435761U) >> 24 ^ mode) %
+            MM_DAEMON_SNSR_EXP_MEMO];
+    if (img->mode != mode + 1 || img->key != key) {
+        mm_snsr->cfg->ops->exp_img(mm_snsr->cfg, mode, gain, line,
+                img->data);
+        img->mode = mode + 1;
+        img->key = key;
+        priv->exp_misses++;
+    }
+    for (i = 0; i < er->num; i++)
+        priv->exp_pkt[i + 1].reg_data = img->data[i];
+
+    rc = mm_snsr->cfg->ops->i2c_write_array(snsr, priv->exp_pkt,
+            priv->exp_size, er->data_type);
+    mm_snsr->exp_mode = (rc < 0) ? -1 : mode;
+    mm_snsr->exp_key = key;
+    return rc;
+}
+
+/* Returns 1 when the condition holds. Read errors count as not met so
+   the caller keeps polling until its deadline. */
+static int mm_daemon_sensor_reg_check(mm_daemon_sensor_t *mm_snsr,
+        struct mm_sensor_reg_cond *cond)
+{
+    uint16_t value = 0;
+
+    if (cond->sel_addr && mm_snsr->cfg->ops->i2c_write(mm_snsr,
+            cond->sel_addr, cond->sel_data, cond->data_type) < 0)
+        return 0;
+    if (mm_snsr->cfg->ops->i2c_read(mm_snsr, cond->reg_addr, &value,
+            cond->data_type) < 0)
+        return 0;
+    return (value & cond->mask) == cond->val;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_wait_reg
+ *
+ * DESCRIPTION: Poll a register until a condition holds, backing off from
+ *              MM_DAEMON_SNSR_WAIT_MIN_US up to MM_DAEMON_SNSR_WAIT_MAX_US
+ *              between reads without sleeping past the deadline.
+ *
+ * PARAMETERS :
+ *   @snsr : sensor object
+ *   @cond : condition to wait for
+ *
+ * RETURN     : 0 when met, -ETIMEDOUT otherwise
+ *==========================================================================*/
+static int mm_daemon_sensor_wait_reg(void *snsr,
+        struct mm_sensor_reg_cond *cond)
+{
+    mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
+    uint32_t backoff = MM_DAEMON_SNSR_WAIT_MIN_US;
+    uint64_t now, deadline;
+
+    deadline = mm_daemon_util_time_us() + (uint64_t)cond->timeout_ms * 1000;
+    while (!mm_daemon_sensor_reg_check(mm_snsr, cond)) {
+        now = mm_daemon_util_time_us();
+        if (now >= deadline) {
+            ALOGE("%s: timed out on 0x%04x", __FUNCTION__,
+                    cond->sel_addr ? cond->sel_data : cond->reg_addr);
+            return -ETIMEDOUT;
+        }
+        if (now + backoff > deadline)
+            backoff = (uint32_t)(deadline - now);
+        usleep(backoff);
+        backoff *= 2;
+        if (backoff > MM_DAEMON_SNSR_WAIT_MAX_US)
+            backoff = MM_DAEMON_SNSR_WAIT_MAX_US;
+    }
+    return 0;
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_wait_reg_deferred
+ *
+ * DESCRIPTION: Like mm_daemon_sensor_wait_reg but returns immediately. The
+ *              sensor thread keeps polling the condition between events and
+ *              holds back further commands until it is met or times out.
+ *              The command that called this completes at that point, with
+ *              -ETIMEDOUT if the condition was never met.
+ *
+ * PARAMETERS :
+ *   @snsr : sensor object
+ *   @cond : condition to wait for
+ *
+ * RETURN     : 0 on success, -EBUSY if a wait is already pending
+ *==========================================================================*/
+static int mm_daemon_sensor_wait_reg_deferred(void *snsr,
+        struct mm_sensor_reg_cond *cond)
+{
+    mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)snsr;
+    struct mm_daemon_sensor_reg_wait *wait = &mm_snsr->reg_wait;
+
+    if (wait->active)
+        return -EBUSY;
+    if (mm_daemon_sensor_reg_check(mm_snsr, cond))
+        return 0;
+
+    wait->cond = *cond;
+    wait->start_us = mm_daemon_util_time_us();
+    wait->deadline_us = wait->start_us + (uint64_t)cond->timeout_ms * 1000;
+    wait->backoff_us = MM_DAEMON_SNSR_WAIT_MIN_US;
+    wait->next_us = wait->start_us + wait->backoff_us;
+    wait->reads = 1;
+    wait->wait = FALSE;
+    wait->active = 1;
+    return 0;
+}
+
+static int mm_daemon_sensor_poll_timeout(mm_daemon_thread_info *info,
+        uint8_t *hold_cmds)
+{
+    mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)info->obj;
+    struct mm_daemon_sensor_reg_wait *wait;
+    uint64_t now;
+    int met, rc;
+
+    if (!mm_snsr)
+        return -1;
+    if (!mm_snsr->reg_wait.active) {
+        /* check the pipe once more before sending queued writes */
+        if (!mm_snsr->batch.size)
+            return -1;
+        if (!mm_snsr->batch.armed) {
+            mm_snsr->batch.armed = 1;
+            return 0;
+        }
+        mm_daemon_sensor_batch_flush(mm_snsr);
+        return -1;
+    }
+
+    wait = &mm_snsr->reg_wait;
+    now = mm_daemon_util_time_us();
+    if (now >= wait->next_us) {
+        met = mm_daemon_sensor_reg_check(mm_snsr, &wait->cond);
+        wait->reads++;
+        now = mm_daemon_util_time_us();
+        if (met || now >= wait->deadline_us) {
+            rc = 0;
+            if (met) {
+                ALOGD("%s: 0x%04x ready after %u us, %u reads", __FUNCTION__,
+                        wait->cond.sel_addr ? wait->cond.sel_data :
+                        wait->cond.reg_addr,
+                        (uint32_t)(now - wait->start_us), wait->reads);
+            } else {
+                ALOGE("%s: timed out on 0x%04x", __FUNCTION__,
+                        wait->cond.sel_addr ? wait->cond.sel_data :
+                        wait->cond.reg_addr);
+                /* the mode the sensor ended up in is unknown */
+                mm_snsr->cur_mode = -1;
+                rc = -ETIMEDOUT;
+            }
+            wait->active = 0;
+            mm_daemon_util_subdev_cmd_finish(info, wait->wait, wait->seq, rc);
+            return -1;
+        }
+        wait->next_us = now + wait->backoff_us;
+        if (wait->next_us > wait->deadline_us)
+            wait->next_us = wait->deadline_us;
+        wait->backoff_us *= 2;
+        if (wait->backoff_us > MM_DAEMON_SNSR_WAIT_MAX_US)
+            wait->backoff_us = MM_DAEMON_SNSR_WAIT_MAX_US;
+    }
+    *hold_cmds = 1;
+    return (int)((wait->next_us - now + 999) / 1000);
 }
 
 static int mm_daemon_sensor_read_cmd(mm_daemon_thread_info *info, uint8_t cmd,
         uint32_t val)
 {
     mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)info->obj;
-    int rc = 0;
+    int rc = 0, flush_rc;
 
+    mm_snsr->batch.cmd = cmd;
     switch (cmd) {
     case SENSOR_CMD_SET_MODE:
         if ((rc = mm_snsr->cfg->ops->set_mode(mm_snsr->cfg, val)) < 0)
@@ -179,6 +792,24 @@ static int mm_daemon_sensor_read_cmd(mm_daemon_thread_info *info, uint8_t cmd,
     default:
         ALOGE("%s: Unknown cmd %d", __FUNCTION__, cmd);
     }
+
+    /* callers waiting on the command expect the writes on the sensor */
+    if (info->active_wait != FALSE) {
+        flush_rc = mm_daemon_sensor_batch_flush(mm_snsr);
+        if (flush_rc < 0 && rc >= 0)
+            rc = flush_rc;
+    }
+
+    /* a register wait was started, complete the command when it ends */
+    if (mm_snsr->reg_wait.active) {
+        if (rc < 0) {
+            mm_snsr->reg_wait.active = 0;
+        } else {
+            mm_snsr->reg_wait.wait = info->active_wait;
+            mm_snsr->reg_wait.seq = info->active_seq;
+            rc = MM_DAEMON_CMD_PENDING;
+        }
+    }
     return rc;
 }
 
@@ -187,6 +818,11 @@ static void mm_daemon_sensor_shutdown(mm_daemon_thread_info *info)
     mm_daemon_sensor_t *mm_snsr = (mm_daemon_sensor_t *)info->obj;
 
     if (mm_snsr) {
+        if (mm_snsr->reg_wait.active) {
+            mm_snsr->reg_wait.active = 0;
+            mm_daemon_util_subdev_cmd_finish(info, mm_snsr->reg_wait.wait,
+                    mm_snsr->reg_wait.seq, -EPIPE);
+        }
         mm_daemon_sensor_stop(mm_snsr);
         if (mm_snsr->cam_fd) {
             close(mm_snsr->cam_fd);
@@ -216,6 +852,15 @@ static int mm_daemon_sensor_set_ops(mm_daemon_thread_info *info,
         mm_snsr->cfg->ops->i2c_write = &mm_daemon_sensor_i2c_write;
     if (!mm_snsr->cfg->ops->i2c_write_array)
         mm_snsr->cfg->ops->i2c_write_array = &mm_daemon_sensor_i2c_write_array;
+    if (!mm_snsr->cfg->ops->write_mode)
+        mm_snsr->cfg->ops->write_mode = &mm_daemon_sensor_write_mode;
+    if (!mm_snsr->cfg->ops->write_exp)
+        mm_snsr->cfg->ops->write_exp = &mm_daemon_sensor_write_exp;
+    if (!mm_snsr->cfg->ops->wait_reg)
+        mm_snsr->cfg->ops->wait_reg = &mm_daemon_sensor_wait_reg;
+    if (!mm_snsr->cfg->ops->wait_reg_deferred)
+        mm_snsr->cfg->ops->wait_reg_deferred =
+                &mm_daemon_sensor_wait_reg_deferred;
     mm_snsr->cfg->mm_snsr = (void *)mm_snsr;
     mm_snsr->cfg->ops->init_data(mm_snsr->cfg);
     return 0;
@@ -232,6 +877,8 @@ static int mm_daemon_sensor_init(mm_daemon_thread_info *info)
     if (!mm_snsr)
         return -EINVAL;
 
+    mm_snsr->cur_mode = -1;
+    mm_daemon_sensor_shadow_reset(mm_snsr);
     mm_snsr->cam_fd = open(info->devpath, O_RDWR | O_NONBLOCK);
     if (mm_snsr->cam_fd < 0)
         goto cam_error;
@@ -261,8 +908,197 @@ static struct mm_daemon_thread_ops mm_daemon_snsr_thread_ops = {
     .init = mm_daemon_sensor_init,
     .shutdown = mm_daemon_sensor_shutdown,
     .cmd = mm_daemon_sensor_read_cmd,
+    .poll_timeout = mm_daemon_sensor_poll_timeout,
 };
 
+static unsigned int mm_daemon_sensor_mode_image(struct mm_sensor_mode_regs *mr,
+        unsigned int mode, struct msm_camera_i2c_reg_array *img)
+{
+    struct mm_sensor_regs *delta = mr->delta[mode];
+    unsigned int i, j, n = mr->base->size;
+
+    memcpy(img, mr->base->regs, n * sizeof(*img));
+    for (i = 0; delta && i < delta->size; i++) {
+        for (j = 0; j < n; j++)
+            if (img[j].reg_addr == delta->regs[i].reg_addr)
+                break;
+        img[j] = delta->regs[i];
+        if (j == n)
+            n++;
+    }
+    return n;
+}
+
+static int mm_daemon_sensor_mode_diff(struct mm_sensor_mode_regs *mr,
+        struct msm_camera_i2c_reg_array *from, unsigned int from_size,
+        struct msm_camera_i2c_reg_array *to, unsigned int to_size,
+        struct mm_daemon_sensor_mode_tbl *tbl)
+{
+    struct msm_camera_i2c_reg_array *regs;
+    unsigned int i, j, n = 0;
+
+    tbl->regs = NULL;
+    tbl->size = 0;
+    regs = (struct msm_camera_i2c_reg_array *)malloc(
+            (to_size + 2) * sizeof(*regs));
+    if (!regs)
+        return -ENOMEM;
+
+    regs[n].reg_addr = mr->hold_addr;
+    regs[n++].reg_data = 0x01;
+    for (i = 0; i < to_size; i++) {
+        for (j = 0; j < from_size; j++)
+            if (from[j].reg_addr == to[i].reg_addr)
+                break;
+        if (j < from_size && from[j].reg_data == to[i].reg_data)
+            continue;
+        regs[n++] = to[i];
+    }
+    regs[n].reg_addr = mr->hold_addr;
+    regs[n++].reg_data = 0x00;
+
+    if (n == 2) {
+        free(regs);
+        return 0;
+    }
+    /* Table order is kept: some sensors need PLL before streaming and
+       group hold settings. Bursts only take runs already contiguous. */
+    if (!mr->hold_addr) {
+        memmove(regs, regs + 1, (n - 2) * sizeof(*regs));
+        n -= 2;
+    }
+    tbl->regs = regs;
+    tbl->size = n;
+    return 0;
+}
+
+static void mm_daemon_sensor_mode_release(struct mm_daemon_sensor_priv *priv)
+{
+    unsigned int i;
+
+    if (priv->mode_diff) {
+        for (i = 0; i < (priv->num_modes + 1) * priv->num_modes; i++)
+            free(priv->mode_diff[i].regs);
+        free(priv->mode_diff);
+    }
+    free(priv);
+}
+
+/*===========================================================================
+ * FUNCTION   : mm_daemon_sensor_mode_prepare
+ *
+ * DESCRIPTION: Expand the plugin's base and per-mode delta tables and cache
+ *              the registers that differ between every pair of modes. The
+ *              row for an unknown starting state holds the full mode table.
+ *
+ * PARAMETERS :
+ *   @cfg : sensor plugin configuration
+ *
+ * RETURN     : 0 on success, negative errno otherwise
+ *==========================================================================*/
+static int mm_daemon_sensor_mode_prepare(mm_sensor_cfg_t *cfg)
+{
+    struct mm_sensor_mode_regs *mr = cfg->mode_regs;
+    struct mm_daemon_sensor_priv *priv;
+    struct msm_camera_i2c_reg_array **img;
+    unsigned int *img_size;
+    struct mm_daemon_sensor_mode_tbl *tbl;
+    unsigned int i, j, k, max = 0, bursts = 0, n;
+    int rc = -ENOMEM;
+
+    if (!mr || !mr->base || !mr->delta || !mr->num_modes)
+        return 0;
+
+    priv = (struct mm_daemon_sensor_priv *)calloc(1, sizeof(*priv));
+    img = (struct msm_camera_i2c_reg_array **)calloc(mr->num_modes,
+            sizeof(*img));
+    img_size = (unsigned int *)calloc(mr->num_modes, sizeof(*img_size));
+    if (!priv || !img || !img_size)
+        goto done;
+    priv->num_modes = mr->num_modes;
+    priv->mode_dt = mr->base->data_type;
+    priv->mode_diff = (struct mm_daemon_sensor_mode_tbl *)calloc(
+            (mr->num_modes + 1) * mr->num_modes,
+            sizeof(struct mm_daemon_sensor_mode_tbl));
+    if (!priv->mode_diff)
+        goto done;
+
+    for (i = 0; i < mr->num_modes; i++) {
+        n = mr->base->size + (mr->delta[i] ? mr->delta[i]->size : 0);
+        img[i] = (struct msm_camera_i2c_reg_array *)malloc(n *
+                sizeof(struct msm_camera_i2c_reg_array));
+        if (!img[i])
+            goto done;
+        img_size[i] = mm_daemon_sensor_mode_image(mr, i, img[i]);
+    }
+
+    for (i = 0; i <= mr->num_modes; i++) {
+        for (j = 0; j < mr->num_modes; j++) {
+            if (i == mr->num_modes)
+                rc = mm_daemon_sensor_mode_diff(mr, NULL, 0, img[j],
+                        img_size[j], &priv->mode_diff[i * mr->num_modes + j]);
+            else
+                rc = mm_daemon_sensor_mode_diff(mr, img[i], img_size[i],
+                        img[j], img_size[j],
+                        &priv->mode_diff[i * mr->num_modes + j]);
+            if (rc < 0)
+                goto done;
+            tbl = &priv->mode_diff[i * mr->num_modes + j];
+            if (i == mr->num_modes || tbl->size <= max)
+                continue;
+            max = tbl->size;
+            for (k = 0, bursts = 0; k < tbl->size; k++)
+                if (!k || tbl->regs[k].reg_addr !=
+                        tbl->regs[k - 1].reg_addr + 1)
+                    bursts++;
+        }
+    }
+    ALOGI("%s: %u modes, largest mode switch %u regs in %u bursts",
+            __FUNCTION__, mr->num_modes, max, bursts);
+    cfg->priv = (void *)priv;
+    priv = NULL;
+    rc = 0;
+
+done:
+    if (img) {
+        for (i = 0; i < mr->num_modes; i++)
+            free(img[i]);
+        free(img);
+    }
+    free(img_size);
+    if (priv)
+        mm_daemon_sensor_mode_release(priv);
+    return rc;
+}
+
+/* Build the exposure packet once; its data words are filled per write */
+static int mm_daemon_sensor_exp_prepare(mm_sensor_cfg_t *cfg)
+{
+    struct mm_sensor_exp_regs *er = cfg->exp_regs;
+    struct mm_daemon_sensor_priv *priv = cfg->priv;
+    unsigned int i;
+
+    if (!er || !er->num)
+        return 0;
+    if (er->num > MM_DAEMON_SNSR_EXP_REGS_MAX)
+        return -EINVAL;
+    if (!priv) {
+        priv = (struct mm_daemon_sensor_priv *)calloc(1, sizeof(*priv));
+        if (!priv)
+            return -ENOMEM;
+        cfg->priv = (void *)priv;
+    }
+
+    priv->exp_pkt[0].reg_addr = er->hold_addr;
+    priv->exp_pkt[0].reg_data = 0x01;
+    for (i = 0; i < er->num; i++)
+        priv->exp_pkt[i + 1].reg_addr = er->addr[i];
+    priv->exp_pkt[i + 1].reg_addr = er->hold_addr;
+    priv->exp_pkt[i + 1].reg_data = 0x00;
+    priv->exp_size = er->num + 2;
+    return 0;
+}
+
 void mm_daemon_snsr_load(mm_daemon_sd_info *sd, mm_daemon_sd_info *camif,
         mm_daemon_sd_info *act)
 {
@@ -293,12 +1129,97 @@ void mm_daemon_snsr_load(mm_daemon_sd_info *sd, mm_daemon_sd_info *camif,
     }
     ALOGI("Successfully loaded %s sensor", cdata.cfg.sensor_info.sensor_name);
     cfg = (mm_sensor_cfg_t *)dlsym(sd->handle, "sensor_cfg_obj");
-    if (!cfg) {
-        dlclose(sd->handle);
-        return;
+    if (!cfg)
+        goto error;
+    if (mm_daemon_sensor_mode_prepare(cfg) < 0) {
+        ALOGE("%s: Error preparing %s mode tables", __FUNCTION__,
+                cdata.cfg.sensor_info.sensor_name);
+        goto error;
     }
+    if (mm_daemon_sensor_exp_prepare(cfg) < 0) {
+        ALOGE("%s: Error preparing %s exposure registers", __FUNCTION__,
+                cdata.cfg.sensor_info.sensor_name);
+        goto error;
+    }
+    snprintf(sd->name, sizeof(sd->name), "%s",
+            cdata.cfg.sensor_info.sensor_name);
     sd->data = (void *)cfg;
     sd->ops = (void *)&mm_daemon_snsr_thread_ops;
     camif->data = cfg->data->csi_params;
     act->data = cfg->data->act_params;
+    return;
+
+error:
+    /* priv lives in the plugin's cfg object, free it while mapped */
+    if (cfg && cfg->priv) {
+        mm_daemon_sensor_mode_release(
+                (struct mm_daemon_sensor_priv *)cfg->priv);
+        cfg->priv = NULL;
+    }
+    dlclose(sd->handle);
+    sd->handle = NULL;
+}
+
+struct mm_daemon_snsr_probe_arg {
+    mm_daemon_sd_obj_t *sd;
+    uint8_t idx;
+};
+
+static void *mm_daemon_snsr_probe_thread(void *data)
+{
+    struct mm_daemon_snsr_probe_arg *arg =
+            (struct mm_daemon_snsr_probe_arg *)data;
+    mm_daemon_sd_obj_t *sd = arg->sd;
+    uint8_t idx = arg->idx;
+    uint64_t t0 = mm_daemon_util_time_us();
+
+    free(arg);
+    mm_daemon_snsr_load(&sd->sensor_sd[idx], &sd->csi[idx], &sd->act[idx]);
+    ALOGI("%s: sensor %u %s in %lluus", __FUNCTION__, idx,
+            sd->sensor_sd[idx].data ? "loaded" : "failed",
+            (unsigned long long)(mm_daemon_util_time_us() - t0));
+    return NULL;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_snsr_probe
+ *
+ * DESCRIPTION: Probe a sensor subdev and load its library on a worker
+ *              thread so sensors come up in parallel and the daemon can
+ *              serve sessions before all of them are ready. Falls back to
+ *              loading inline if the thread can't be started.
+ *
+ * PARAMETERS :
+ *   @sd : daemon subdev object
+ *   @idx: sensor index
+ *==========================================================================*/
+void mm_daemon_snsr_probe(mm_daemon_sd_obj_t *sd, uint8_t idx)
+{
+    struct mm_daemon_snsr_probe_arg *arg;
+
+    arg = (struct mm_daemon_snsr_probe_arg *)malloc(sizeof(*arg));
+    if (arg) {
+        arg->sd = sd;
+        arg->idx = idx;
+        if (pthread_create(&sd->snsr_probe[idx], NULL,
+                mm_daemon_snsr_probe_thread, (void *)arg) == 0) {
+            sd->snsr_probing[idx] = 1;
+            return;
+        }
+        free(arg);
+    }
+    mm_daemon_snsr_load(&sd->sensor_sd[idx], &sd->csi[idx], &sd->act[idx]);
+}
+
+/* Wait for a sensor's probe to finish. Returns -ENODEV if no library
+   was loaded for it. */
+int mm_daemon_snsr_wait(mm_daemon_sd_obj_t *sd, uint8_t idx)
+{
+    if (idx >= MSM_MAX_CAMERA_SENSORS)
+        return -EINVAL;
+    if (sd->snsr_probing[idx]) {
+        pthread_join(sd->snsr_probe[idx], NULL);
+        sd->snsr_probing[idx] = 0;
+    }
+    return sd->sensor_sd[idx].data ? 0 : -ENODEV;
 }
@@ -45,12 +45,111 @@ typedef enum {
     SENSOR_POWER_ON,
 } mm_daemon_sensor_state_t;
 
+#ifndef I2C_SEQ_REG_SETTING_MAX
+#define I2C_SEQ_REG_SETTING_MAX 5
+#endif
+
+#define MM_DAEMON_SNSR_SHADOW_SIZE 512
+#define MM_DAEMON_SNSR_SHADOW_VAR 0x20000
+#define MM_DAEMON_SNSR_SHADOW_REG 0x10000
+
+struct mm_daemon_sensor_shadow_ent {
+    uint32_t key;
+    uint16_t data;
+    uint8_t data_type;
+};
+
+/* Last value written to each sensor register. Writes that match are
+   dropped before reaching the I2C bus. */
+struct mm_daemon_sensor_shadow {
+    struct mm_daemon_sensor_shadow_ent ent[MM_DAEMON_SNSR_SHADOW_SIZE];
+    int32_t var_addr;
+    int32_t pending_var;
+    uint8_t pending_dt;
+    uint32_t writes;
+    uint32_t sent;
+    uint32_t bytes_saved;
+};
+
+#define MM_DAEMON_SNSR_BATCH_MAX 64
+
+/* Register writes queued while the sensor thread has commands waiting */
+struct mm_daemon_sensor_batch {
+    struct msm_camera_i2c_reg_array regs[MM_DAEMON_SNSR_BATCH_MAX];
+    enum msm_camera_i2c_data_type data_type;
+    uint16_t size;
+    uint8_t armed;
+    /* command being processed, and the commands with writes queued */
+    uint8_t cmd;
+    uint32_t cmds;
+    uint32_t ops;
+    uint32_t flushes;
+};
+
+#define MM_DAEMON_SNSR_WAIT_MIN_US 250
+#define MM_DAEMON_SNSR_WAIT_MAX_US 8000
+
+/* Register condition polled from the sensor thread event loop. The
+   command that started it completes once the condition is met. */
+struct mm_daemon_sensor_reg_wait {
+    struct mm_sensor_reg_cond cond;
+    uint64_t start_us;
+    uint64_t deadline_us;
+    uint64_t next_us;
+    uint32_t backoff_us;
+    uint32_t seq;
+    uint32_t reads;
+    /* how the command was sent, see mm_daemon_util_subdev_cmd_finish */
+    uint8_t wait;
+    uint8_t active;
+};
+
+/* register writes needed to go from one sensor mode to another */
+struct mm_daemon_sensor_mode_tbl {
+    struct msm_camera_i2c_reg_array *regs;
+    uint16_t size;
+};
+
+#define MM_DAEMON_SNSR_EXP_REGS_MAX 16
+#define MM_DAEMON_SNSR_EXP_MEMO 16
+
+/* Exposure register image for a mode, gain and line; mode is stored
+   plus one so a zeroed entry is empty */
+struct mm_daemon_sensor_exp_img {
+    uint32_t key;
+    uint8_t mode;
+    uint16_t data[MM_DAEMON_SNSR_EXP_REGS_MAX];
+};
+
+/* Tables derived from the plugin once when it is loaded */
+struct mm_daemon_sensor_priv {
+    unsigned int num_modes;
+    enum msm_camera_i2c_data_type mode_dt;
+    /* [from * num_modes + to], from == num_modes when state is unknown */
+    struct mm_daemon_sensor_mode_tbl *mode_diff;
+    /* hold on, exposure registers, hold off; only the data changes */
+    struct msm_camera_i2c_reg_array exp_pkt[MM_DAEMON_SNSR_EXP_REGS_MAX + 2];
+    uint16_t exp_size;
+    struct mm_daemon_sensor_exp_img exp_memo[MM_DAEMON_SNSR_EXP_MEMO];
+    uint32_t exp_writes;
+    uint32_t exp_misses;
+    uint32_t exp_skips;
+};
+
 typedef struct mm_daemon_sensor {
     int cam_fd;
+    int cur_mode;
+    /* exposure last written, exp_mode -1 when unknown */
+    int exp_mode;
+    uint32_t exp_key;
+    uint8_t no_seq;
     uint16_t lines;
     mm_daemon_cfg_t *cfg_obj;
     mm_daemon_thread_info *info;
     mm_daemon_sensor_state_t sensor_state;
     mm_sensor_cfg_t *cfg;
+    struct mm_daemon_sensor_shadow shadow;
+    struct mm_daemon_sensor_reg_wait reg_wait;
+    struct mm_daemon_sensor_batch batch;
 } mm_daemon_sensor_t;
 #endif
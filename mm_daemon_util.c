@@ -28,8 +28,8 @@ static void *mm_daemon_util_thread_poll_start(void *data)
     mm_daemon_pipe_evt_t pipe_cmd;
     struct pollfd pfd;
     ssize_t read_len;
-    uint8_t wait;
-    int ret = 0;
+    uint8_t wait, hold_cmds;
+    int timeout, ret = 0;
 
     if (info->ops->init(info) < 0) {
         mm_daemon_util_pipe_cmd(info->cb_pfd, CFG_CMD_ERR, info->type);
@@ -38,27 +38,39 @@ static void *mm_daemon_util_thread_poll_start(void *data)
 
     pfd.fd = info->pfds[0];
     do {
-        pfd.events = POLLIN|POLLRDNORM;
+        hold_cmds = 0;
+        timeout = -1;
+        if (info->ops->poll_timeout)
+            timeout = info->ops->poll_timeout(info, &hold_cmds);
+        pfd.events = (hold_cmds && timeout >= 0) ? 0 : POLLIN|POLLRDNORM;
         if (mm_daemon_util_set_thread_state(info, STATE_POLL) < 0)
             break;
-        if (poll(&pfd, 1, -1) > 0) {
+        if ((ret = poll(&pfd, 1, timeout)) > 0) {
             if (mm_daemon_util_set_thread_state(info, STATE_BUSY) < 0)
                 break;
             if ((pfd.revents & POLLIN) && (pfd.revents & POLLRDNORM)) {
                 read_len = read(info->pfds[0], &pipe_cmd, sizeof(pipe_cmd));
                 wait = pipe_cmd.wait;
-                if (wait)
+                if (wait == TRUE)
                     pthread_mutex_lock(&info->lock);
+                info->active_seq = pipe_cmd.seq;
+                info->active_wait = wait;
                 ret = info->ops->cmd(info, pipe_cmd.cmd, pipe_cmd.val);
-                if (wait) {
-                    pthread_cond_signal(&info->cond);
+                if (wait == TRUE) {
+                    /* a pending command releases its waiter when done */
+                    if (ret != MM_DAEMON_CMD_PENDING) {
+                        info->cmd_rc = ret;
+                        pthread_cond_signal(&info->cond);
+                    }
                     pthread_mutex_unlock(&info->lock);
-                }
+                } else if (wait == MM_DAEMON_CMD_ASYNC &&
+                        ret != MM_DAEMON_CMD_PENDING)
+                    mm_daemon_util_subdev_cmd_done(info, pipe_cmd.seq, ret);
                 if (ret < 0)
                     break;
             } else
                 usleep(1000);
-        } else {
+        } else if (ret < 0 || timeout < 0) {
             usleep(100);
             continue;
         }
@@ -113,6 +125,7 @@ mm_daemon_thread_info *mm_daemon_util_thread_open(mm_daemon_sd_info *sd,
     info->ops = ops;
     pthread_mutex_init(&(info->lock), NULL);
     pthread_cond_init(&(info->cond), NULL);
+    pthread_cond_init(&(info->done_cond), NULL);
     pthread_attr_t attr;
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
@@ -130,6 +143,7 @@ int mm_daemon_util_thread_close(mm_daemon_thread_info *info)
     pthread_join(info->pid, &rc);
     pthread_mutex_destroy(&(info->lock));
     pthread_cond_destroy(&(info->cond));
+    pthread_cond_destroy(&(info->done_cond));
     free(info);
     return (int)rc;
 }
@@ -186,15 +200,19 @@ void mm_daemon_util_pipe_cmd(int32_t pfd, uint8_t cmd, int32_t val)
  *   @cmd:  subdev command
  *   @val:  extra data value
  *   @wait: set to 1 to wait for polling thread to unlock before continuing
+ *
+ * RETURN     : result of the command when waiting, 0 otherwise
  *==========================================================================*/
-void mm_daemon_util_subdev_cmd(mm_daemon_thread_info *info, uint8_t cmd,
+int mm_daemon_util_subdev_cmd(mm_daemon_thread_info *info, uint8_t cmd,
         int32_t val, uint8_t wait)
 {
     mm_daemon_pipe_evt_t pipe_cmd;
+    int rc = 0;
 
     if (!info)
-        return;
+        return 0;
 
+    memset(&pipe_cmd, 0, sizeof(pipe_cmd));
     pipe_cmd.wait = wait;
     pipe_cmd.cmd = cmd;
     pipe_cmd.val = val;
@@ -204,6 +222,156 @@ void mm_daemon_util_subdev_cmd(mm_daemon_thread_info *info, uint8_t cmd,
     write(info->pfds[1], &pipe_cmd, sizeof(pipe_cmd));
     if (wait) {
         pthread_cond_wait(&info->cond, &info->lock);
+        rc = info->cmd_rc;
+        pthread_mutex_unlock(&info->lock);
+    }
+    return rc;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_util_subdev_cmd_async
+ *
+ * DESCRIPTION: Sends pipe command to a subdevice thread without blocking.
+ *              Completion is signaled through the returned token.
+ *
+ * PARAMETERS :
+ *   @info: pointer to thread info object
+ *   @cmd:  subdev command
+ *   @val:  extra data value
+ *
+ * RETURN     : token to pass to mm_daemon_util_subdev_cmd_wait
+ *==========================================================================*/
+uint32_t mm_daemon_util_subdev_cmd_async(mm_daemon_thread_info *info,
+        uint8_t cmd, int32_t val)
+{
+    mm_daemon_pipe_evt_t pipe_cmd;
+
+    if (!info)
+        return 0;
+
+    memset(&pipe_cmd, 0, sizeof(pipe_cmd));
+    pipe_cmd.wait = MM_DAEMON_CMD_ASYNC;
+    pipe_cmd.cmd = cmd;
+    pipe_cmd.val = val;
+
+    pthread_mutex_lock(&info->lock);
+    pipe_cmd.seq = ++info->cmd_seq;
+    pthread_mutex_unlock(&info->lock);
+    write(info->pfds[1], &pipe_cmd, sizeof(pipe_cmd));
+    return pipe_cmd.seq;
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_util_subdev_cmd_done
+ *
+ * DESCRIPTION: Marks an asynchronous subdev command complete and wakes any
+ *              thread waiting on it. Called by the subdevice thread once
+ *              the command has been handled.
+ *
+ * PARAMETERS :
+ *   @info: pointer to thread info object
+ *   @seq:  token carried by the completed pipe command
+ *   @rc:   result of the command, returned to its waiter
+ *==========================================================================*/
+void mm_daemon_util_subdev_cmd_done(mm_daemon_thread_info *info,
+        uint32_t seq, int32_t rc)
+{
+    pthread_mutex_lock(&info->lock);
+    if ((int32_t)(seq - info->done_seq) > 0) {
+        info->done_seq = seq;
+        info->done_rc = rc;
+    }
+    pthread_cond_broadcast(&info->done_cond);
+    pthread_mutex_unlock(&info->lock);
+}
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_util_subdev_cmd_finish
+ *
+ * DESCRIPTION: Completes a command whose cmd op returned
+ *              MM_DAEMON_CMD_PENDING, releasing the thread that sent it
+ *              whether it blocked in mm_daemon_util_subdev_cmd or holds an
+ *              async token.
+ *
+ * PARAMETERS :
+ *   @info: pointer to thread info object
+ *   @wait: wait mode the command was sent with
+ *   @seq:  token carried by the command
+ *   @rc:   result of the command, returned to its waiter
+ *==========================================================================*/
+void mm_daemon_util_subdev_cmd_finish(mm_daemon_thread_info *info,
+        uint8_t wait, uint32_t seq, int32_t rc)
+{
+    if (wait == MM_DAEMON_CMD_ASYNC) {
+        mm_daemon_util_subdev_cmd_done(info, seq, rc);
+    } else if (wait == TRUE) {
+        pthread_mutex_lock(&info->lock);
+        info->cmd_rc = rc;
+        pthread_cond_signal(&info->cond);
         pthread_mutex_unlock(&info->lock);
     }
 }
+
+/*==========================================================================
+ * FUNCTION   : mm_daemon_util_subdev_cmd_wait
+ *
+ * DESCRIPTION: Waits for an asynchronous subdev command to complete
+ *
+ * PARAMETERS :
+ *   @info:       pointer to thread info object
+ *   @seq:        token returned by mm_daemon_util_subdev_cmd_async
+ *   @timeout_ms: maximum time to wait
+ *
+ * RETURN     : result of the command on completion
+ *              -ETIMEDOUT if the command did not complete in time
+ *==========================================================================*/
+int mm_daemon_util_subdev_cmd_wait(mm_daemon_thread_info *info,
+        uint32_t seq, uint32_t timeout_ms)
+{
+    struct timespec ts;
+    int rc = 0;
+
+    if (!info || !seq)
+        return 0;
+
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&info->lock);
+    while ((int32_t)(seq - info->done_seq) > 0 && rc == 0) {
+        if (info->state == STATE_STOPPED)
+            rc = -EPIPE;
+        else if (pthread_cond_timedwait(&info->done_cond, &info->lock,
+                &ts) == ETIMEDOUT)
+            rc = -ETIMEDOUT;
+    }
+    if (rc == 0 && seq == info->done_seq)
+        rc = info->done_rc;
+    pthread_mutex_unlock(&info->lock);
+    return rc;
+}
+
+uint64_t mm_daemon_util_time_us(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/* Account one run of a per-frame algorithm that started at start_us */
+void mm_daemon_util_proc_time(struct mm_daemon_proc_time *pt,
+        uint64_t start_us)
+{
+    uint32_t us = (uint32_t)(mm_daemon_util_time_us() - start_us);
+
+    if (us > pt->us_max)
+        pt->us_max = us;
+    pt->us_total += us;
+    pt->runs++;
+}
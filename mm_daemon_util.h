@@ -24,12 +24,18 @@
 
 #include "mm_daemon.h"
 
+#define MM_DAEMON_CMD_ASYNC 2
+
+/* returned by a thread cmd op that completes the command later */
+#define MM_DAEMON_CMD_PENDING 1
+
 struct mm_daemon_thread_ops {
     void *(*start)(void *data);
     int (*init)(mm_daemon_thread_info *info);
     void (*stop)(mm_daemon_thread_info *info);
     void (*shutdown)(mm_daemon_thread_info *info);
     int (*cmd)(mm_daemon_thread_info *info, uint8_t cmd, uint32_t val);
+    int (*poll_timeout)(mm_daemon_thread_info *info, uint8_t *hold_cmds);
 };
 
 mm_daemon_thread_info *mm_daemon_util_thread_open(mm_daemon_sd_info *sd,
@@ -38,6 +44,17 @@ int mm_daemon_util_thread_close(mm_daemon_thread_info *info);
 int mm_daemon_util_set_thread_state(mm_daemon_thread_info *info,
         mm_daemon_thread_state state);
 void mm_daemon_util_pipe_cmd(int32_t pfd, uint8_t cmd, int32_t val);
-void mm_daemon_util_subdev_cmd(mm_daemon_thread_info *info, uint8_t cmd,
+int mm_daemon_util_subdev_cmd(mm_daemon_thread_info *info, uint8_t cmd,
         int32_t val, uint8_t wait);
+uint32_t mm_daemon_util_subdev_cmd_async(mm_daemon_thread_info *info,
+        uint8_t cmd, int32_t val);
+void mm_daemon_util_subdev_cmd_done(mm_daemon_thread_info *info,
+        uint32_t seq, int32_t rc);
+void mm_daemon_util_subdev_cmd_finish(mm_daemon_thread_info *info,
+        uint8_t wait, uint32_t seq, int32_t rc);
+int mm_daemon_util_subdev_cmd_wait(mm_daemon_thread_info *info,
+        uint32_t seq, uint32_t timeout_ms);
+uint64_t mm_daemon_util_time_us(void);
+void mm_daemon_util_proc_time(struct mm_daemon_proc_time *pt,
+        uint64_t start_us);
 #endif /* MM_DAEMON_UTIL_H */
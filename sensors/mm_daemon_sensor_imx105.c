@@ -42,7 +42,7 @@ struct imx105_pdata {
 static uint16_t imx105_act_pos_tbl[] = {
     0, 48, 96, 144, 156, 168, 184, 200, 216, 232, 248, 264, 280, 296, 312,
     328, 344, 360, 376, 392, 408, 424, 440, 456, 472, 488, 504, 520, 536,
-    552, 568, 584, 600, 616, 632, 648, 664, 680, 696, 712, 728, 744,
+    552, 568, 584, 600, 616, 632, 648, 664, 680, 696, 712, 728, 744, 760,
 };
 
 static struct msm_camera_i2c_reg_array imx105_init_settings[] = {
@@ -77,10 +77,29 @@ static struct msm_camera_i2c_reg_array imx105_init_settings[] = {
     {0x0104, 0x00, 0},
 };
 
-static struct msm_camera_i2c_reg_array imx105_prev_tbl[] = {
-    {0x0104, 0x01, 0},
+static struct msm_camera_i2c_reg_array imx105_mode_base_tbl[] = {
     {0x0342, 0x0D, 0},
     {0x0343, 0xD0, 0},
+    {0x0381, 0x01, 0},
+    {0x3033, 0x00, 0},
+    {0x304C, 0x6F, 0},
+    {0x304D, 0x03, 0},
+    {0x309C, 0x34, 0},
+    {0x309E, 0x00, 0},
+    {0x30AA, 0x03, 0},
+    {0x3102, 0x08, 0},
+    {0x3103, 0x22, 0},
+    {0x3104, 0x20, 0},
+    {0x3105, 0x00, 0},
+    {0x3106, 0x87, 0},
+    {0x3107, 0x00, 0},
+    {0x315C, 0xA5, 0},
+    {0x315D, 0xA4, 0},
+    {0x316E, 0xA6, 0},
+    {0x316F, 0xA5, 0},
+};
+
+static struct msm_camera_i2c_reg_array imx105_prev_tbl[] = {
     {0x0346, 0x00, 0},
     {0x0347, 0x24, 0},
     {0x034A, 0x09, 0},
@@ -89,41 +108,20 @@ static struct msm_camera_i2c_reg_array imx105_prev_tbl[] = {
     {0x034D, 0x68, 0},
     {0x034E, 0x04, 0},
     {0x034F, 0xD0, 0},
-    {0x0381, 0x01, 0},
     {0x0383, 0x03, 0},
     {0x0385, 0x01, 0},
     {0x0387, 0x03, 0},
-    {0x3033, 0x00, 0},
     {0x3048, 0x01, 0},
-    {0x304C, 0x6F, 0},
-    {0x304D, 0x03, 0},
     {0x306A, 0xD2, 0},
     {0x309B, 0x28, 0},
-    {0x309C, 0x34, 0},
-    {0x309E, 0x00, 0},
-    {0x30AA, 0x03, 0},
     {0x30D5, 0x09, 0},
     {0x30D6, 0x01, 0},
     {0x30D7, 0x01, 0},
     {0x30DE, 0x02, 0},
-    {0x3102, 0x08, 0},
-    {0x3103, 0x22, 0},
-    {0x3104, 0x20, 0},
-    {0x3105, 0x00, 0},
-    {0x3106, 0x87, 0},
-    {0x3107, 0x00, 0},
-    {0x315C, 0xA5, 0},
-    {0x315D, 0xA4, 0},
-    {0x316E, 0xA6, 0},
-    {0x316F, 0xA5, 0},
     {0x3318, 0x72, 0},
-    {0x0104, 0x00, 0},
 };
 
 static struct msm_camera_i2c_reg_array imx105_video_tbl[] = {
-    {0x0104, 0x01, 0},
-    {0x0342, 0x0D, 0},
-    {0x0343, 0xD0, 0},
     {0x0344, 0x00, 0},
     {0x0345, 0x66, 0},
     {0x0346, 0x01, 0},
@@ -136,41 +134,20 @@ static struct msm_camera_i2c_reg_array imx105_video_tbl[] = {
     {0x034D, 0x0C, 0},
     {0x034E, 0x04, 0},
     {0x034F, 0x84, 0},
-    {0x0381, 0x01, 0},
     {0x0383, 0x01, 0},
     {0x0385, 0x02, 0},
     {0x0387, 0x03, 0},
-    {0x3033, 0x00, 0},
     {0x3048, 0x00, 0},
-    {0x304C, 0x6F, 0},
-    {0x304D, 0x03, 0},
     {0x306A, 0xF2, 0},
     {0x309B, 0x20, 0},
-    {0x309C, 0x34, 0},
-    {0x309E, 0x00, 0},
-    {0x30AA, 0x03, 0},
     {0x30D5, 0x00, 0},
     {0x30D6, 0x85, 0},
     {0x30D7, 0x2A, 0},
     {0x30DE, 0x00, 0},
-    {0x3102, 0x08, 0},
-    {0x3103, 0x22, 0},
-    {0x3104, 0x20, 0},
-    {0x3105, 0x00, 0},
-    {0x3106, 0x87, 0},
-    {0x3107, 0x00, 0},
-    {0x315C, 0xA5, 0},
-    {0x315D, 0xA4, 0},
-    {0x316E, 0xA6, 0},
-    {0x316F, 0xA5, 0},
     {0x3318, 0x62, 0},
-    {0x0104, 0x00, 0},
 };
 
 static struct msm_camera_i2c_reg_array imx105_snap_tbl[] = {
-    {0x0104, 0x01, 0},
-    {0x0342, 0x0D, 0},
-    {0x0343, 0xD0, 0},
     {0x0344, 0x00, 0},
     {0x0345, 0x04, 0},
     {0x0346, 0x00, 0},
@@ -183,35 +160,17 @@ static struct msm_camera_i2c_reg_array imx105_snap_tbl[] = {
     {0x034D, 0xD0, 0},
     {0x034E, 0x09, 0},
     {0x034F, 0xA0, 0},
-    {0x0381, 0x01, 0},
     {0x0383, 0x01, 0},
     {0x0385, 0x01, 0},
     {0x0387, 0x01, 0},
-    {0x3033, 0x00, 0},
     {0x3048, 0x00, 0},
-    {0x304C, 0x6F, 0},
-    {0x304D, 0x03, 0},
     {0x306A, 0xD2, 0},
     {0x309B, 0x20, 0},
-    {0x309C, 0x34, 0},
-    {0x309E, 0x00, 0},
-    {0x30AA, 0x03, 0},
     {0x30D5, 0x00, 0},
     {0x30D6, 0x85, 0},
     {0x30D7, 0x2A, 0},
     {0x30DE, 0x00, 0},
-    {0x3102, 0x08, 0},
-    {0x3103, 0x22, 0},
-    {0x3104, 0x20, 0},
-    {0x3105, 0x00, 0},
-    {0x3106, 0x87, 0},
-    {0x3107, 0x00, 0},
-    {0x315C, 0xA5, 0},
-    {0x315D, 0xA4, 0},
-    {0x316E, 0xA6, 0},
-    {0x316F, 0xA5, 0},
     {0x3318, 0x62, 0},
-    {0x0104, 0x00, 0},
 };
 
 static struct msm_camera_i2c_reg_array imx105_stop_settings[] = {
@@ -237,16 +196,27 @@ static int imx105_stream(mm_sensor_cfg_t *cfg, int start)
             MSM_CAMERA_I2C_BYTE_DATA);
 }
 
-static int imx105_exp_gain(mm_sensor_cfg_t *cfg, uint16_t gain, uint16_t line)
+static uint16_t imx105_exp_addr[] = {
+    0x0202, 0x0203, 0x0204, 0x0205, 0x020E, 0x020F, 0x0210, 0x0211,
+    0x0212, 0x0213, 0x0214, 0x0215, 0x0340, 0x0341,
+};
+
+static struct mm_sensor_exp_regs imx105_exp_regs = {
+    .addr = imx105_exp_addr,
+    .num = ARRAY_SIZE(imx105_exp_addr),
+    .hold_addr = 0x0104,
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static void imx105_exp_img(mm_sensor_cfg_t *cfg, int mode, uint16_t gain,
+        uint16_t line, uint16_t *data)
 {
-    int rc = 0;
-    struct imx105_pdata *pdata = (struct imx105_pdata *)cfg->pdata;
-    uint16_t max_line_val = 2398;
     uint16_t dgain = IMX105_MIN_DIGITAL_GAIN;
     uint16_t again = gain;
-    uint32_t line_val = line;
     uint32_t fl_lines;
+    int i;
 
+    /* Gain codes past the analog range extend into digital gain */
     if (again > IMX105_MAX_ANALOG_GAIN) {
         dgain += again - IMX105_MAX_ANALOG_GAIN;
         again = IMX105_MAX_ANALOG_GAIN;
@@ -254,35 +224,28 @@ static int imx105_exp_gain(mm_sensor_cfg_t *cfg, uint16_t gain, uint16_t line)
     if (dgain > IMX105_MAX_DIGITAL_GAIN)
         dgain = IMX105_MAX_DIGITAL_GAIN;
 
-    fl_lines = cfg->data->attr[pdata->mode]->h +
-            cfg->data->attr[pdata->mode]->blk_l;
+    fl_lines = cfg->data->attr[mode]->h + cfg->data->attr[mode]->blk_l;
+    if (line > (fl_lines - IMX105_OFFSET))
+        fl_lines = line + IMX105_OFFSET;
+
+    data[0] = MSB(line);
+    data[1] = LSB(line);
+    data[2] = MSB(again);
+    data[3] = LSB(again);
+    for (i = 4; i < 12; i += 2) {
+        data[i] = MSB(dgain);
+        data[i + 1] = LSB(dgain);
+    }
+    data[12] = MSB(fl_lines);
+    data[13] = LSB(fl_lines);
+}
 
-    if (line_val > (fl_lines - IMX105_OFFSET))
-        fl_lines = line_val + IMX105_OFFSET;
+static int imx105_exp_gain(mm_sensor_cfg_t *cfg, uint16_t gain, uint16_t line)
+{
+    struct imx105_pdata *pdata = (struct imx105_pdata *)cfg->pdata;
+    int rc;
 
-    {
-        struct msm_camera_i2c_reg_array exp_settings[] = {
-            {0x0104, 0x01, 0},
-            {0x0204, MSB(again), 0},
-            {0x0205, LSB(again), 0},
-            {0x020E, MSB(dgain), 0},
-            {0x020F, LSB(dgain), 0},
-            {0x0210, MSB(dgain), 0},
-            {0x0211, LSB(dgain), 0},
-            {0x0212, MSB(dgain), 0},
-            {0x0213, LSB(dgain), 0},
-            {0x0214, MSB(dgain), 0},
-            {0x0215, LSB(dgain), 0},
-            {0x0340, MSB(fl_lines), 0},
-            {0x0341, LSB(fl_lines), 0},
-            {0x0202, MSB(line_val), 0},
-            {0x0203, LSB(line_val), 0},
-            {0x0104, 0x00, 0},
-        };
-
-        rc = cfg->ops->i2c_write_array(cfg->mm_snsr, exp_settings,
-                ARRAY_SIZE(exp_settings), MSM_CAMERA_I2C_BYTE_DATA);
-    }
+    rc = cfg->ops->write_exp(cfg->mm_snsr, pdata->mode, gain, line);
     pdata->line = line;
     pdata->gain = gain;
     return rc;
@@ -355,27 +318,10 @@ static int imx105_deinit(mm_sensor_cfg_t *cfg)
 static int imx105_set_mode(mm_sensor_cfg_t *cfg, int mode)
 {
     struct imx105_pdata *pdata = (struct imx105_pdata *)cfg->pdata;
-    struct msm_camera_i2c_reg_array *settings;
-    enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_BYTE_DATA;
-    uint16_t size;
     int rc;
 
-    switch (mode) {
-    case PREVIEW:
-        settings = imx105_prev_tbl;
-        size = ARRAY_SIZE(imx105_prev_tbl);
-        break;
-    case VIDEO:
-        settings = imx105_video_tbl;
-        size = ARRAY_SIZE(imx105_video_tbl);
-        break;
-    case SNAPSHOT:
-        settings = imx105_snap_tbl;
-        size = ARRAY_SIZE(imx105_snap_tbl);
-        break;
-    default:
+    if (mode < PREVIEW || mode >= STREAM_TYPE_MAX)
         return -1;
-    }
 
     pdata->mode = mode;
     if ((rc = imx105_stream(cfg, 0)) < 0)
@@ -384,7 +330,7 @@ static int imx105_set_mode(mm_sensor_cfg_t *cfg, int mode)
     if ((rc = imx105_exp_gain(cfg, pdata->gain, pdata->line)) < 0)
         return rc;
 
-    if ((rc = cfg->ops->i2c_write_array(cfg->mm_snsr, settings, size, dt)) < 0)
+    if ((rc = cfg->ops->write_mode(cfg->mm_snsr, mode)) < 0)
         return rc;
 
     return imx105_stream(cfg, 1);
@@ -419,9 +365,23 @@ static cam_capability_t imx105_capabilities = {
         CAM_AEC_MODE_CENTER_WEIGHTED,
     },
 
+    /* +/- 2 EV in 1/6 EV steps */
+    .exposure_compensation_min = -12,
+    .exposure_compensation_max = 12,
+    .exposure_compensation_default = 0,
+    .exposure_compensation_step = 1.0 / 6,
+
     .fps_ranges_tbl_cnt = 1,
     .fps_ranges_tbl[0] = {9.0, 30},
 
+    .supported_antibandings_cnt = 4,
+    .supported_antibandings = {
+        CAM_ANTIBANDING_MODE_OFF,
+        CAM_ANTIBANDING_MODE_60HZ,
+        CAM_ANTIBANDING_MODE_50HZ,
+        CAM_ANTIBANDING_MODE_AUTO
+    },
+
     .supported_white_balances_cnt = 4,
     .supported_white_balances = {
         CAM_WB_MODE_AUTO,
@@ -497,6 +457,7 @@ static struct mm_sensor_stream_attr imx105_attr_preview = {
     .blk_l = 34,
     .blk_p = 1896,
     .vscale = 1,
+    .pix_clk = 134297280,
 };
 
 static struct mm_sensor_stream_attr imx105_attr_video = {
@@ -506,6 +467,7 @@ static struct mm_sensor_stream_attr imx105_attr_video = {
     .blk_l = 110,
     .blk_p = 452,
     .vscale = 1.5,
+    .pix_clk = 134297280,
 };
 
 static struct mm_sensor_stream_attr imx105_attr_snapshot = {
@@ -515,8 +477,33 @@ static struct mm_sensor_stream_attr imx105_attr_snapshot = {
     .blk_l = 70,
     .blk_p = 256,
     .vscale = 1,
+    .pix_clk = 134297280,
 };
 
+/* Q8 gain of a gain code: analog 256 / (256 - code) up to 8x, then the
+   digital gain on top of it */
+static uint32_t imx105_gain_lin(uint16_t code)
+{
+    uint32_t amax = 65536 / (256 - IMX105_MAX_ANALOG_GAIN);
+
+    if (code <= IMX105_MAX_ANALOG_GAIN)
+        return (65536 + (256 - code) / 2) / (256 - code);
+    return amax * (code - IMX105_MAX_ANALOG_GAIN + IMX105_MIN_DIGITAL_GAIN) /
+            IMX105_MIN_DIGITAL_GAIN;
+}
+
+static uint16_t imx105_gain_code(uint32_t lin)
+{
+    uint32_t amax = 65536 / (256 - IMX105_MAX_ANALOG_GAIN);
+
+    if (lin <= 256)
+        return IMX105_MIN_ANALOG_GAIN;
+    if (lin <= amax)
+        return 256 - (65536 + lin / 2) / lin;
+    return IMX105_MAX_ANALOG_GAIN - IMX105_MIN_DIGITAL_GAIN +
+            (lin * IMX105_MIN_DIGITAL_GAIN + amax / 2) / amax;
+}
+
 static struct mm_sensor_aec_config imx105_aec_cfg = {
     .target = { 
         { 6000, 1000, 1000 },
@@ -532,6 +519,11 @@ static struct mm_sensor_aec_config imx105_aec_cfg = {
     .line_mult = 10,
     .frame_skip = 1,
     .flash_threshold = 224,
+    /* analog 256 / (256 - code) up to 8x, then digital to 1.5x */
+    .iso_gain = { 0, 0, 0, 128, 192, 224, 352 },
+    .exp_latency = 2,
+    .gain_lin = imx105_gain_lin,
+    .gain_code = imx105_gain_code,
 };
 
 static struct mm_sensor_awb_config imx105_awb_prev_cfg = {
@@ -546,6 +538,37 @@ static struct mm_sensor_awb_config imx105_awb_snap_cfg = {
     .wb = { 0x02010080, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 };
 
+static const struct mm_sensor_cct_anchor imx105_cct_anchors[] = {
+    {
+        .cct = 2850,
+        .ccm = { 178, -10, -39, -80, 211, -2, -97, 11, 215 },
+        .r_gain = 186,
+        .g_gain = 141,
+        .b_gain = 403,
+    },
+    {
+        .cct = 4150,
+        .ccm = { 186, -11, -46, -94, 225, -2, -114, 13, 230 },
+        .r_gain = 198,
+        .g_gain = 141,
+        .b_gain = 317,
+    },
+    {
+        .cct = 6500,
+        .ccm = { 194, -13, -52, -107, 239, -3, -130, 15, 244 },
+        .r_gain = 313,
+        .g_gain = 141,
+        .b_gain = 203,
+    },
+};
+
+static struct mm_sensor_color_cal imx105_color_cal = {
+    .anchors = imx105_cct_anchors,
+    .num_anchors = ARRAY_SIZE(imx105_cct_anchors),
+    .ccm_threshold = 2,
+    .gain_threshold = 2,
+};
+
 /* MIPI CSI Controller config */
 static struct msm_camera_csic_params imx105_csic_params = {
     .data_format = CSIC_10BIT,
@@ -631,6 +654,7 @@ static struct mm_sensor_data imx105_data = {
         &imx105_awb_prev_cfg,
         &imx105_awb_snap_cfg,
     },
+    .color_cal = &imx105_color_cal,
     .csi_params = (void *)&imx105_csic_params,
     .act_params = (void *)&imx105_act_params,
     .csi_dev = 0,
@@ -644,6 +668,43 @@ static struct mm_sensor_data imx105_data = {
     .act_id = 0,
 };
 
+static struct mm_sensor_regs imx105_mode_base = {
+    .regs = imx105_mode_base_tbl,
+    .size = ARRAY_SIZE(imx105_mode_base_tbl),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs imx105_mode_prev = {
+    .regs = imx105_prev_tbl,
+    .size = ARRAY_SIZE(imx105_prev_tbl),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs imx105_mode_video = {
+    .regs = imx105_video_tbl,
+    .size = ARRAY_SIZE(imx105_video_tbl),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs imx105_mode_snap = {
+    .regs = imx105_snap_tbl,
+    .size = ARRAY_SIZE(imx105_snap_tbl),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs *imx105_mode_delta[STREAM_TYPE_MAX] = {
+    [PREVIEW] = &imx105_mode_prev,
+    [VIDEO] = &imx105_mode_video,
+    [SNAPSHOT] = &imx105_mode_snap,
+};
+
+static struct mm_sensor_mode_regs imx105_mode_regs = {
+    .base = &imx105_mode_base,
+    .delta = imx105_mode_delta,
+    .num_modes = STREAM_TYPE_MAX,
+    .hold_addr = 0x0104,
+};
+
 static struct mm_sensor_regs imx105_stop_regs = {
     .regs = imx105_stop_settings,
     .size = ARRAY_SIZE(imx105_stop_settings),
@@ -656,10 +717,14 @@ static struct mm_sensor_ops imx105_ops = {
     .deinit = imx105_deinit,
     .set_mode = imx105_set_mode,
     .exp_gain = imx105_exp_gain,
+    .exp_img = imx105_exp_img,
 };
 
 mm_sensor_cfg_t sensor_cfg_obj = {
+    .addr_type = MSM_CAMERA_I2C_WORD_ADDR,
     .stop_regs = &imx105_stop_regs,
+    .mode_regs = &imx105_mode_regs,
+    .exp_regs = &imx105_exp_regs,
     .ops = &imx105_ops,
     .data = &imx105_data,
 };
@@ -23,6 +23,8 @@
 #include "mm_sensor.h"
 #include "../common.h"
 
+#define MT9V113_WAIT_TIMEOUT_MS 100
+
 enum mt9v113_brightness_mode {
     BRIGHTNESS_N3,
     BRIGHTNESS_N2,
@@ -643,10 +645,41 @@ static int mt9v113_set_antibanding(mm_sensor_cfg_t *cfg, int mode)
     return -1;
 }
 
+/* wait for the sequencer to finish the last command written to 0xA103 */
+static int mt9v113_wait_cmd(mm_sensor_cfg_t *cfg)
+{
+    struct mm_sensor_reg_cond cond = {
+        .sel_addr = 0x098C,
+        .sel_data = 0xA103,
+        .reg_addr = 0x0990,
+        .mask = 0xFFFF,
+        .val = 0x0,
+        .data_type = MSM_CAMERA_I2C_WORD_DATA,
+        .timeout_ms = MT9V113_WAIT_TIMEOUT_MS,
+    };
+
+    return cfg->ops->wait_reg(cfg->mm_snsr, &cond);
+}
+
+/* the sensor thread completes the mode change once 0xA104 reaches state */
+static int mt9v113_wait_state(mm_sensor_cfg_t *cfg, uint16_t state)
+{
+    struct mm_sensor_reg_cond cond = {
+        .sel_addr = 0x098C,
+        .sel_data = 0xA104,
+        .reg_addr = 0x0990,
+        .mask = 0xFFFF,
+        .val = state,
+        .data_type = MSM_CAMERA_I2C_WORD_DATA,
+        .timeout_ms = MT9V113_WAIT_TIMEOUT_MS,
+    };
+
+    return cfg->ops->wait_reg_deferred(cfg->mm_snsr, &cond);
+}
+
 static int mt9v113_set_wb(mm_sensor_cfg_t *cfg, int wb_mode)
 {
-    int i;
-    uint16_t value, wb_size1, wb_size2;
+    uint16_t wb_size1, wb_size2;
     struct msm_camera_i2c_reg_array *wb_setting1, *wb_setting2;
     struct mt9v113_pdata *pdata = (struct mt9v113_pdata *)cfg->pdata;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_WORD_DATA;
@@ -688,14 +721,7 @@ static int mt9v113_set_wb(mm_sensor_cfg_t *cfg, int wb_mode)
     if (cfg->ops->i2c_write_array(cfg->mm_snsr, wb_setting1, wb_size1, dt) < 0)
         return -1;
 
-    for (i = 0; i < 100; i++) {
-        cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA103, dt);
-        cfg->ops->i2c_read(cfg->mm_snsr, 0x0990, &value, dt);
-        if (value == 0x0)
-            break;
-        usleep(1000);
-    }
-    if (i == 100)
+    if (mt9v113_wait_cmd(cfg) < 0)
         return -1;
 
     return cfg->ops->i2c_write_array(cfg->mm_snsr, wb_setting2, wb_size2, dt);
@@ -748,8 +774,7 @@ static int mt9v113_set_brightness(mm_sensor_cfg_t *cfg, int mode)
 
 static int mt9v113_set_ffc(mm_sensor_cfg_t *cfg, enum mt9v113_ffc_mode mode)
 {
-    int i;
-    uint16_t value, size;
+    uint16_t size;
     struct msm_camera_i2c_reg_array *setting;
     struct mt9v113_pdata *pdata = (struct mt9v113_pdata *)cfg->pdata;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_WORD_DATA;
@@ -778,14 +803,7 @@ static int mt9v113_set_ffc(mm_sensor_cfg_t *cfg, enum mt9v113_ffc_mode mode)
         cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA103, dt);
         cfg->ops->i2c_write(cfg->mm_snsr, 0x0990, 0x0006, dt);
 
-        for (i = 0; i < 100; i++) {
-            cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA103, dt);
-            cfg->ops->i2c_read(cfg->mm_snsr, 0x0990, &value, dt);
-            if (value == 0x0)
-                break;
-            usleep(1000);
-        }
-        if (i == 100)
+        if (mt9v113_wait_cmd(cfg) < 0)
             return -1;
     }
     pdata->mirror = mode;
@@ -865,8 +883,7 @@ static int mt9v113_set_contrast(mm_sensor_cfg_t *cfg, int value)
 
 static int mt9v113_set_effect(mm_sensor_cfg_t *cfg, int mode)
 {
-    int i;
-    uint16_t value, size;
+    uint16_t size;
     struct msm_camera_i2c_reg_array *setting;
     struct mt9v113_pdata *pdata = (struct mt9v113_pdata *)cfg->pdata;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_WORD_DATA;
@@ -904,14 +921,7 @@ static int mt9v113_set_effect(mm_sensor_cfg_t *cfg, int mode)
     if (cfg->ops->i2c_write_array(cfg->mm_snsr, setting, size, dt) < 0)
         return -1;
 
-    for (i = 0; i < 100; i++) {
-        cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA103, dt);
-        cfg->ops->i2c_read(cfg->mm_snsr, 0x0990, &value, dt);
-        if (value == 0)
-            break;
-        usleep(1000);
-    }
-    if (i == 100)
+    if (mt9v113_wait_cmd(cfg) < 0)
         return -1;
 
     return 0;
@@ -953,8 +963,7 @@ static int mt9v113_set_sharpness(mm_sensor_cfg_t *cfg, int value)
 
 static int mt9v113_preview(mm_sensor_cfg_t *cfg)
 {
-    int i, rc;
-    uint16_t value;
+    int rc;
     struct mt9v113_pdata *pdata = (struct mt9v113_pdata *)cfg->pdata;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_WORD_DATA;
 
@@ -1006,18 +1015,7 @@ static int mt9v113_preview(mm_sensor_cfg_t *cfg)
     rc = cfg->ops->i2c_write(cfg->mm_snsr, 0x0990, 0x0002, dt);
     if (rc < 0)
         return rc;
-    for (i = 0; i < 100; i++) {
-        cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA104, dt);
-        cfg->ops->i2c_read(cfg->mm_snsr, 0x0990, &value, dt);
-        if (value == 0x3)
-            break;
-        usleep(1000);
-    }
-    if (i == 100)
-        return -1;
-    usleep(150000);
-
-    return rc;
+    return mt9v113_wait_state(cfg, 0x3);
 }
 
 static int mt9v113_video(mm_sensor_cfg_t *cfg)
@@ -1031,8 +1029,6 @@ static int mt9v113_video(mm_sensor_cfg_t *cfg)
 
 static int mt9v113_snapshot(mm_sensor_cfg_t *cfg)
 {
-    int i;
-    uint16_t value;
     struct mt9v113_pdata *pdata = (struct mt9v113_pdata *)cfg->pdata;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_WORD_DATA;
 
@@ -1042,17 +1038,7 @@ static int mt9v113_snapshot(mm_sensor_cfg_t *cfg)
         return -1;
     if (cfg->ops->i2c_write(cfg->mm_snsr, 0x0990, 0x1, dt) < 0)
         return -1;
-    for (i = 0; i < 100; i++) {
-        cfg->ops->i2c_write(cfg->mm_snsr, 0x098C, 0xA104, dt);
-        cfg->ops->i2c_read(cfg->mm_snsr, 0x0990, &value, dt);
-        if (value == 0x3)
-            break;
-        usleep(1000);
-    }
-    if (i == 100)
-        return -1;
-
-    return 0;
+    return mt9v113_wait_state(cfg, 0x3);
 }
 
 static int mt9v113_set_mode(mm_sensor_cfg_t *cfg, int mode)
@@ -1237,6 +1223,7 @@ static struct mm_sensor_data mt9v113_data = {
     .vfe_cfg_off = 0x0214,
     .uses_sensor_ctrls = 1,
     .stats_enable = 0,
+    .settle_frames = 5,
 };
 
 struct mm_sensor_ops mt9v113_ops = {
@@ -1253,8 +1240,23 @@ struct mm_sensor_ops mt9v113_ops = {
     .sharpness = mt9v113_set_sharpness,
 };
 
+/* sequencer command and state are changed by the sensor itself */
+static uint16_t mt9v113_volatile_vars[] = {
+    0xA103,
+    0xA104,
+};
+
+static struct mm_sensor_shadow_cfg mt9v113_shadow_cfg = {
+    .volatile_vars = mt9v113_volatile_vars,
+    .num_volatile_vars = ARRAY_SIZE(mt9v113_volatile_vars),
+    .var_addr_reg = 0x098C,
+    .var_data_reg = 0x0990,
+};
+
 mm_sensor_cfg_t sensor_cfg_obj = {
+    .addr_type = MSM_CAMERA_I2C_WORD_ADDR,
     .stop_regs = &mt9v113_stop_regs,
+    .shadow_cfg = &mt9v113_shadow_cfg,
     .ops = &mt9v113_ops,
     .data = &mt9v113_data,
 };
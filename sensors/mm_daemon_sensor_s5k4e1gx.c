@@ -43,14 +43,6 @@ static uint16_t s5k4e1gx_act_pos_tbl[] = {
     400, 412, 424, 436, 448, 460, 472, 484, 496, 508, 520, 532,
 };
 
-static struct msm_camera_i2c_reg_array s5k4e1gx_groupon_settings[] = {
-    {0x0104, 0x01, 0},
-};
-
-static struct msm_camera_i2c_reg_array s5k4e1gx_groupoff_settings[] = {
-    {0x0104, 0x00, 0},
-};
-
 static struct msm_camera_i2c_reg_array s5k4e1gx_init_settings[] = {
     {0x302B, 0x00, 0},
     {0x30BC, 0xA0, 0},
@@ -88,20 +80,11 @@ static struct msm_camera_i2c_reg_array s5k4e1gx_init_settings[] = {
     {0x3110, 0x10, 0},
 };
 
-static struct msm_camera_i2c_reg_array s5k4e1gx_prev_settings[] = {
-    {0x034C, 0x05, 0},/* x_output size msb */
-    {0x034D, 0x18, 0},/* x_output size lsb */
-    {0x034E, 0x03, 0},/* y_output size msb */
-    {0x034F, 0xD4, 0},/* y_output size lsb */
+static struct msm_camera_i2c_reg_array s5k4e1gx_mode_base_settings[] = {
     {0x0381, 0x01, 0},/* x_even_inc */
     {0x0383, 0x01, 0},/* x_odd_inc */
     {0x0385, 0x01, 0},/* y_even_inc */
-    {0x0387, 0x03, 0},/* y_odd_inc 03(10b AVG) */
-    {0x30A9, 0x02, 0},/* Horizontal Binning On */
-    {0x300E, 0xEB, 0},/* Vertical Binning On */
     {0x0105, 0x01, 0},/* mask corrupted frame */
-    {0x0340, 0x03, 0},/* Frame Length */
-    {0x0341, 0xE0, 0},
     {0x300F, 0x82, 0},/* CDS Test */
     {0x3013, 0xC0, 0},/* rst_offset1 */
     {0x3017, 0xA4, 0},/* rmb_init */
@@ -112,28 +95,28 @@ static struct msm_camera_i2c_reg_array s5k4e1gx_prev_settings[] = {
     {0x311A, 0xFA, 0},/* Data PCLK Strength */
 };
 
+static struct msm_camera_i2c_reg_array s5k4e1gx_prev_settings[] = {
+    {0x034C, 0x05, 0},/* x_output size msb */
+    {0x034D, 0x18, 0},/* x_output size lsb */
+    {0x034E, 0x03, 0},/* y_output size msb */
+    {0x034F, 0xD4, 0},/* y_output size lsb */
+    {0x0387, 0x03, 0},/* y_odd_inc 03(10b AVG) */
+    {0x30A9, 0x02, 0},/* Horizontal Binning On */
+    {0x300E, 0xEB, 0},/* Vertical Binning On */
+    {0x0340, 0x03, 0},/* Frame Length */
+    {0x0341, 0xE0, 0},
+};
+
 static struct msm_camera_i2c_reg_array s5k4e1gx_snap_settings[] = {
     {0x034C, 0x0A, 0},
     {0x034D, 0x30, 0},
     {0x034E, 0x07, 0},
     {0x034F, 0xA8, 0},
-    {0x0381, 0x01, 0},
-    {0x0383, 0x01, 0},
-    {0x0385, 0x01, 0},
     {0x0387, 0x01, 0},
     {0x30A9, 0x03, 0},
     {0x300E, 0xE8, 0},
-    {0x0105, 0x01, 0},
     {0x0340, 0x07, 0},
     {0x0341, 0xB4, 0},
-    {0x300F, 0x82, 0},
-    {0x3013, 0xC0, 0},
-    {0x3017, 0xA4, 0},
-    {0x301B, 0x88, 0},
-    {0x3110, 0x10, 0},
-    {0x3117, 0x0C, 0},
-    {0x3119, 0x0F, 0},
-    {0x311A, 0xFA, 0},
 };
 
 static struct msm_camera_i2c_reg_array s5k4e1gx_stop_settings[] = {
@@ -144,48 +127,47 @@ static struct reg_settings_t s5k4e1gx_act_init_settings[] = {
     {0x0, 0x00},
 };
 
-static int s5k4e1gx_exp_gain(mm_sensor_cfg_t *cfg, uint16_t gain, uint16_t line)
+static uint16_t s5k4e1gx_exp_addr[] = {
+    0x0202, 0x0203, 0x0204, 0x0205, 0x0342, 0x0343,
+};
+
+static struct mm_sensor_exp_regs s5k4e1gx_exp_regs = {
+    .addr = s5k4e1gx_exp_addr,
+    .num = ARRAY_SIZE(s5k4e1gx_exp_addr),
+    .hold_addr = 0x0104,
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static void s5k4e1gx_exp_img(mm_sensor_cfg_t *cfg, int mode, uint16_t gain,
+        uint16_t line, uint16_t *data)
 {
-    int rc = 0;
-    struct s5k4e1gx_pdata *pdata = (struct s5k4e1gx_pdata *)cfg->pdata;
-    enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_BYTE_DATA;
-    uint8_t min_legal_gain = 0x20;
-    uint16_t max_legal_gain = 0x200;
-    uint16_t min_line;
-    uint16_t max_line;
-    uint32_t line_val = line;
-    uint32_t ll_ratio;
-    uint32_t fl_lines;
-    uint32_t ll_pck = 2738;
+    struct mm_sensor_stream_attr *attr = cfg->data->attr[mode];
+    uint32_t line_val = line * 0x400;
+    uint32_t fl_lines = attr->h + attr->blk_l;
+    uint32_t ll_pck = attr->w + attr->blk_p;
+    uint32_t ll_ratio = 0x400;
     uint32_t offset = 12;
 
-    max_line = cfg->data->attr[pdata->mode]->h;
-    fl_lines = max_line + cfg->data->attr[pdata->mode]->blk_l;
+    /* Exposures past the frame length stretch the line instead */
+    if (fl_lines < line)
+        ll_ratio = line_val / (fl_lines - offset);
+    ll_pck = ll_pck * ll_ratio / 0x400;
+    line_val /= ll_ratio;
 
-    line_val *= 0x400;
+    data[0] = MSB(line_val);
+    data[1] = LSB(line_val);
+    data[2] = MSB(gain);
+    data[3] = LSB(gain);
+    data[4] = MSB(ll_pck);
+    data[5] = LSB(ll_pck);
+}
 
-    if (fl_lines < (line_val / 0x400))
-        ll_ratio = (line_val / (fl_lines - offset));
-    else
-        ll_ratio = 0x400;
-    ll_pck = ll_pck * ll_ratio;
-    line_val /= ll_ratio;
+static int s5k4e1gx_exp_gain(mm_sensor_cfg_t *cfg, uint16_t gain, uint16_t line)
+{
+    struct s5k4e1gx_pdata *pdata = (struct s5k4e1gx_pdata *)cfg->pdata;
+    int rc;
 
-    {
-        struct msm_camera_i2c_reg_array exp_settings[] = {
-            s5k4e1gx_groupon_settings[0],
-            {0x0204, MSB(gain), 0},
-            {0x0205, LSB(gain), 0},
-            {0x0342, MSB(ll_pck / 0x400), 0},
-            {0x0343, LSB(ll_pck / 0x400), 0},
-            {0x0202, MSB(line_val), 0},
-            {0x0203, LSB(line_val), 0},
-            s5k4e1gx_groupoff_settings[0],
-        };
-
-        rc = cfg->ops->i2c_write_array(cfg->mm_snsr, exp_settings,
-                ARRAY_SIZE(exp_settings), dt);
-    }
+    rc = cfg->ops->write_exp(cfg->mm_snsr, pdata->mode, gain, line);
     pdata->line = line;
     pdata->gain = gain;
 
@@ -289,31 +271,18 @@ static int s5k4e1gx_deinit(mm_sensor_cfg_t *cfg)
 static int s5k4e1gx_set_mode(mm_sensor_cfg_t *cfg, int mode)
 {
     struct s5k4e1gx_pdata *pdata = (struct s5k4e1gx_pdata *)cfg->pdata;
-    struct msm_camera_i2c_reg_array *settings;
     enum msm_camera_i2c_data_type dt = MSM_CAMERA_I2C_BYTE_DATA;
-    uint16_t size;
     int rc;
 
-    switch (mode) {
-    case PREVIEW:
-    case VIDEO:
-        settings = s5k4e1gx_prev_settings;
-        size = ARRAY_SIZE(s5k4e1gx_prev_settings);
-        break;
-    case SNAPSHOT:
-        settings = s5k4e1gx_snap_settings;
-        size = ARRAY_SIZE(s5k4e1gx_snap_settings);
-        break;
-    default:
+    if (mode < PREVIEW || mode >= STREAM_TYPE_MAX)
         return -1;
-    }
 
     pdata->mode = mode;
 
     if ((rc = cfg->ops->i2c_write(cfg->mm_snsr, 0x100, 0, dt)) < 0)
         return rc;
 
-    if ((rc = cfg->ops->i2c_write_array(cfg->mm_snsr, settings, size, dt)) < 0)
+    if ((rc = cfg->ops->write_mode(cfg->mm_snsr, mode)) < 0)
         return rc;
 
     if ((rc = s5k4e1gx_exp_gain(cfg, pdata->gain, pdata->line)) < 0)
@@ -322,6 +291,37 @@ static int s5k4e1gx_set_mode(mm_sensor_cfg_t *cfg, int mode)
     return cfg->ops->i2c_write(cfg->mm_snsr, 0x100, 1, dt);
 }
 
+static struct mm_sensor_regs s5k4e1gx_mode_base = {
+    .regs = &s5k4e1gx_mode_base_settings[0],
+    .size = ARRAY_SIZE(s5k4e1gx_mode_base_settings),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs s5k4e1gx_mode_prev = {
+    .regs = &s5k4e1gx_prev_settings[0],
+    .size = ARRAY_SIZE(s5k4e1gx_prev_settings),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs s5k4e1gx_mode_snap = {
+    .regs = &s5k4e1gx_snap_settings[0],
+    .size = ARRAY_SIZE(s5k4e1gx_snap_settings),
+    .data_type = MSM_CAMERA_I2C_BYTE_DATA,
+};
+
+static struct mm_sensor_regs *s5k4e1gx_mode_delta[STREAM_TYPE_MAX] = {
+    [PREVIEW] = &s5k4e1gx_mode_prev,
+    [VIDEO] = &s5k4e1gx_mode_prev,
+    [SNAPSHOT] = &s5k4e1gx_mode_snap,
+};
+
+static struct mm_sensor_mode_regs s5k4e1gx_mode_regs = {
+    .base = &s5k4e1gx_mode_base,
+    .delta = s5k4e1gx_mode_delta,
+    .num_modes = STREAM_TYPE_MAX,
+    .hold_addr = 0x0104,
+};
+
 struct mm_sensor_regs s5k4e1gx_stop_regs = {
     .regs = &s5k4e1gx_stop_settings[0],
     .size = ARRAY_SIZE(s5k4e1gx_stop_settings),
@@ -356,9 +356,23 @@ static cam_capability_t s5k4e1gx_capabilities = {
         CAM_AEC_MODE_CENTER_WEIGHTED,
     },
 
+    /* +/- 2 EV in 1/6 EV steps */
+    .exposure_compensation_min = -12,
+    .exposure_compensation_max = 12,
+    .exposure_compensation_default = 0,
+    .exposure_compensation_step = 1.0 / 6,
+
     .fps_ranges_tbl_cnt = 1,
     .fps_ranges_tbl[0] = {9.0, 30},
 
+    .supported_antibandings_cnt = 4,
+    .supported_antibandings = {
+        CAM_ANTIBANDING_MODE_OFF,
+        CAM_ANTIBANDING_MODE_60HZ,
+        CAM_ANTIBANDING_MODE_50HZ,
+        CAM_ANTIBANDING_MODE_AUTO
+    },
+
     .supported_white_balances_cnt = 4,
     .supported_white_balances = {
         CAM_WB_MODE_AUTO,
@@ -434,6 +448,7 @@ static struct mm_sensor_stream_attr s5k4e1gx_attr_preview = {
     .blk_l = 12,
     .blk_p = 1434,
     .vscale = 1,
+    .pix_clk = 81482880,
 };
 
 static struct mm_sensor_stream_attr s5k4e1gx_attr_snapshot = {
@@ -443,6 +458,7 @@ static struct mm_sensor_stream_attr s5k4e1gx_attr_snapshot = {
     .blk_l = 27,
     .blk_p = 130,
     .vscale = 1,
+    .pix_clk = 81482880,
 };
 
 static struct mm_sensor_aec_config s5k4e1gx_aec_cfg = {
@@ -460,6 +476,9 @@ static struct mm_sensor_aec_config s5k4e1gx_aec_cfg = {
     .line_mult = 1,
     .frame_skip = 2,
     .flash_threshold = 512,
+    /* ISO 100 at 1x, 0x20 per 1x */
+    .iso_gain = { 0, 0, 32, 64, 128, 256, 512 },
+    .exp_latency = 2,
 };
 
 static struct mm_sensor_awb_config s5k4e1gx_awb_prev_cfg = {
@@ -474,6 +493,37 @@ static struct mm_sensor_awb_config s5k4e1gx_awb_snap_cfg = {
     .wb = { 0x02010080, 0, 0, 0, 0, 0, 0, 0, 0, 0 },
 };
 
+static const struct mm_sensor_cct_anchor s5k4e1gx_cct_anchors[] = {
+    {
+        .cct = 2850,
+        .ccm = { 178, -10, -39, -80, 211, -2, -97, 11, 215 },
+        .r_gain = 156,
+        .g_gain = 142,
+        .b_gain = 329,
+    },
+    {
+        .cct = 4150,
+        .ccm = { 186, -11, -46, -94, 225, -2, -114, 13, 230 },
+        .r_gain = 207,
+        .g_gain = 141,
+        .b_gain = 301,
+    },
+    {
+        .cct = 6500,
+        .ccm = { 194, -13, -52, -107, 239, -3, -130, 15, 244 },
+        .r_gain = 226,
+        .g_gain = 141,
+        .b_gain = 185,
+    },
+};
+
+static struct mm_sensor_color_cal s5k4e1gx_color_cal = {
+    .anchors = s5k4e1gx_cct_anchors,
+    .num_anchors = ARRAY_SIZE(s5k4e1gx_cct_anchors),
+    .ccm_threshold = 2,
+    .gain_threshold = 2,
+};
+
 /* MIPI CSI Controller config */
 static struct msm_camera_csic_params s5k4e1gx_csic_params = {
     .data_format = CSIC_10BIT,
@@ -552,6 +602,7 @@ static struct mm_sensor_data s5k4e1gx_data = {
         &s5k4e1gx_awb_prev_cfg,
         &s5k4e1gx_awb_snap_cfg,
     },
+    .color_cal = &s5k4e1gx_color_cal,
     .csi_params = (void *)&s5k4e1gx_csic_params,
     .act_params = (void *)&s5k4e1gx_act_params,
     .cap = &s5k4e1gx_capabilities,
@@ -571,10 +622,14 @@ struct mm_sensor_ops s5k4e1gx_ops = {
     .deinit = s5k4e1gx_deinit,
     .set_mode = s5k4e1gx_set_mode,
     .exp_gain = s5k4e1gx_exp_gain,
+    .exp_img = s5k4e1gx_exp_img,
 };
 
 mm_sensor_cfg_t sensor_cfg_obj = {
+    .addr_type = MSM_CAMERA_I2C_WORD_ADDR,
     .stop_regs = &s5k4e1gx_stop_regs,
+    .mode_regs = &s5k4e1gx_mode_regs,
+    .exp_regs = &s5k4e1gx_exp_regs,
     .ops = &s5k4e1gx_ops,
     .data = &s5k4e1gx_data,
 };
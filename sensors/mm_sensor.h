@@ -33,6 +33,52 @@ struct mm_sensor_regs {
     enum msm_camera_i2c_data_type data_type;
 };
 
+/* Mode tables described as settings shared by every mode plus the
+   entries each mode adds or overrides. Registers listed here must not be
+   written outside of write_mode. */
+struct mm_sensor_mode_regs {
+    struct mm_sensor_regs *base;
+    struct mm_sensor_regs **delta;
+    unsigned int num_modes;
+    uint16_t hold_addr;
+};
+
+/* Registers the daemon may not skip even when the value written matches
+   the last one, e.g. command or self clearing registers. Sensors that
+   expose variables through an address/data register pair name both so
+   the daemon can track each variable separately. */
+struct mm_sensor_shadow_cfg {
+    uint16_t *volatile_regs;
+    unsigned int num_volatile_regs;
+    uint16_t *volatile_vars;
+    unsigned int num_volatile_vars;
+    uint16_t var_addr_reg;
+    uint16_t var_data_reg;
+};
+
+/* Exposure registers, written between hold_addr 1 and 0 so they take
+   effect on the same frame. exp_img fills data[] with the value of each
+   register in addr[] for a gain and line count in a mode; the result may
+   depend on nothing else, so the daemon keeps recent images. */
+struct mm_sensor_exp_regs {
+    uint16_t *addr;
+    unsigned int num;
+    uint16_t hold_addr;
+    enum msm_camera_i2c_data_type data_type;
+};
+
+/* Register condition (value & mask) == val. When sel_addr is set,
+   sel_data is written to it before each read. */
+struct mm_sensor_reg_cond {
+    uint16_t sel_addr;
+    uint16_t sel_data;
+    uint16_t reg_addr;
+    uint16_t mask;
+    uint16_t val;
+    enum msm_camera_i2c_data_type data_type;
+    uint32_t timeout_ms;
+};
+
 struct mm_sensor_ops {
     int (*i2c_read)(void *snsr, uint16_t reg_addr, uint16_t *data,
             enum msm_camera_i2c_data_type data_type);
@@ -53,15 +99,28 @@ struct mm_sensor_ops {
     int (*effect)(struct mm_sensor_cfg *cfg, int mode);
     int (*sharpness)(struct mm_sensor_cfg *cfg, int value);
     int (*exp_gain)(struct mm_sensor_cfg *cfg, uint16_t gain, uint16_t line);
+    int (*write_mode)(void *snsr, int mode);
+    void (*exp_img)(struct mm_sensor_cfg *cfg, int mode, uint16_t gain,
+            uint16_t line, uint16_t *data);
+    int (*write_exp)(void *snsr, int mode, uint16_t gain, uint16_t line);
+    int (*wait_reg)(void *snsr, struct mm_sensor_reg_cond *cond);
+    int (*wait_reg_deferred)(void *snsr, struct mm_sensor_reg_cond *cond);
 };
 
+/* addr_type matches the slave info the kernel driver was given and is
+   required for burst writes */
 typedef struct mm_sensor_cfg {
+    enum msm_camera_i2c_reg_addr_type addr_type;
     struct mm_sensor_regs *init;
     struct mm_sensor_regs *stop_regs;
+    struct mm_sensor_mode_regs *mode_regs;
+    struct mm_sensor_shadow_cfg *shadow_cfg;
+    struct mm_sensor_exp_regs *exp_regs;
     struct mm_sensor_ops *ops;
     struct mm_sensor_data *data;
     void *pdata;
     void *mm_snsr;
+    void *priv;
 } mm_sensor_cfg_t;
 
 #endif